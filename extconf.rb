@@ -10,7 +10,14 @@ require 'mkmf'
 srcdir = File.join(File.expand_path(File.dirname(__FILE__)), 'src')
 
 PKGConfig.have_package("loudmouth-1.0", 1, 4, 0) or exit 1
-PKGConfig.have_package("glib-2.0", 2, 4, 0) or exit 1
+PKGConfig.have_package("glib-2.0", 2, 28, 0) or exit 1
 PKGConfig.have_package("gthread-2.0", 2, 4, 0) or exit 1
 
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("rb_str_new_static")
+have_func("rb_gc_mark_movable")
+have_func("rb_interned_str_cstr")
+have_func("rb_gc_adjust_memory_usage")
+
 create_makefile("loudmouth", srcdir)
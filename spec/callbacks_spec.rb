@@ -0,0 +1,73 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection callbacks" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+  end
+
+  after(:each) do
+    @server.stop
+  end
+
+  def iq(id)
+    msg = LM::Message.new('localhost', LM::MessageType::IQ)
+    msg.root_node['id'] = id
+    msg
+  end
+
+  it 'should keep open and authenticate blocks through GC.compact' do
+    conn = LM::EventedConnection.new('127.0.0.1')
+    conn.port = @server.port
+    opened = authed = nil
+    conn.open { |res| opened = res }
+    GC.compact
+    GC.start
+    pump_until { !opened.nil? }
+    conn.authenticate('tester', 'secret', 'spec') { |res| authed = res }
+    GC.compact
+    GC.start
+    pump_until { !authed.nil? }
+    opened.should == true
+    authed.should == true
+    conn.close
+  end
+
+  it 'should call every pending reply block after GC.compact' do
+    conn = evented_connection(@server)
+    replies = []
+    %w(first second third).each do |id|
+      conn.send_with_reply(iq(id)) { |msg| replies << msg.root_node['id'] }
+    end
+    pump_until { @server.received.grep(/<iq[^>]*id=.(first|second|third)/).size == 3 }
+    GC.compact
+    GC.start
+    %w(third first second).each do |id|
+      @server.push("<iq type='result' id='#{id}' from='localhost'/>")
+    end
+    pump_until { replies.size == 3 }
+    replies.should == %w(third first second)
+    conn.close
+  end
+
+  it 'should report disconnects with the reason' do
+    conn = evented_connection(@server)
+    handler = lambda { |reason| }
+    conn.set_disconnect_handler(&handler)
+    GC.compact
+    sink = IO.for_fd(LM::Sink.file_descriptor, :autoclose => false)
+    @server.drop
+    seen = nil
+    deadline = Time.now + 5
+    while seen.nil? && Time.now < deadline
+      next unless IO.select([sink], nil, nil, 0.05)
+      cb = LM::Sink.notification
+      seen = [cb.kind, cb.data] if cb && cb.target == handler
+    end
+    seen[0].should == LM::CB_DISCONNECT
+    seen[1].should_not == LM::DisconnectReason::OK
+  end
+end
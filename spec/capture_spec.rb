@@ -0,0 +1,95 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+require 'tempfile'
+
+describe "LM::Capture" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+    @bodies = []
+    @conn.add_message_handler(LM::MessageType::MESSAGE) do |m|
+      @bodies << m.node.get_child('body').value
+    end
+    @log = Tempfile.new('capture')
+    @log.close
+  end
+
+  after(:each) do
+    LM::Capture.stop
+    @conn.close
+    @server.stop
+    @log.unlink
+  end
+
+  def capture(*bodies)
+    LM::Capture.start(@log.path)
+    LM::Capture.recording?.should == true
+    bodies.each { |b| @server.push("<message from='b@localhost'><body>#{b}</body></message>") }
+    pump_until { @bodies.size == bodies.size }
+    LM::Capture.stop.should == bodies.size
+    LM::Capture.recording?.should == false
+    @bodies.clear
+  end
+
+  it 'should replay captured stanzas to the message handlers' do
+    capture('one', 'two', 'three')
+    LM::Capture.replay(@log.path, @conn, 0)
+    pump_until { @bodies.size == 3 }
+    @bodies.should == ['one', 'two', 'three']
+  end
+
+  it 'should capture each stanza once and replay it to every handler' do
+    second = []
+    frozen = []
+    @conn.add_message_handler(LM::MessageType::MESSAGE) do |m|
+      second << m.node.get_child('body').value
+    end
+    @conn.add_message_handler(LM::MessageType::MESSAGE, true) do |m|
+      frozen << m.type
+    end
+    capture('one', 'two')
+    pump_until { second.size == 2 && frozen.size == 2 }
+    second.clear
+    frozen.clear
+    LM::Capture.replay(@log.path, @conn, 0)
+    pump_until { @bodies.size == 2 && second.size == 2 && frozen.size == 2 }
+    @bodies.should == ['one', 'two']
+    second.should == ['one', 'two']
+    frozen.should == [LM::MessageType::MESSAGE] * 2
+  end
+
+  it 'should keep the captured gaps divided by the speed' do
+    LM::Capture.start(@log.path)
+    @server.push("<message from='b@localhost'><body>early</body></message>")
+    pump_until { @bodies.size == 1 }
+    sleep 0.3
+    @server.push("<message from='b@localhost'><body>late</body></message>")
+    pump_until { @bodies.size == 2 }
+    LM::Capture.stop
+    @bodies.clear
+
+    started = Time.now
+    LM::Capture.replay(@log.path, @conn, 2)
+    pump_until { @bodies.size == 1 }
+    pump_until { @bodies.size == 2 }
+    (Time.now - started).should be_close(0.15, 0.1)
+    @bodies.should == ['early', 'late']
+  end
+
+  it 'should only replay to an evented connection' do
+    capture('one')
+    lambda {
+      LM::Capture.replay(@log.path, LM::Connection.new)
+    }.should raise_error(TypeError)
+  end
+
+  it 'should refuse files that are not captures' do
+    File.open(@log.path, 'w') { |f| f.write('<message/>') }
+    lambda {
+      LM::Capture.replay(@log.path, @conn)
+    }.should raise_error(ArgumentError)
+  end
+end
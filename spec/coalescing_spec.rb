@@ -0,0 +1,101 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection#enable_presence_coalescing" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+    @sent = @server.received.size
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  # What the server got since the connection was set up
+  def sent
+    @server.received[@sent..-1]
+  end
+
+  def presence(to, show)
+    "<presence to='#{to}'><show>#{show}</show><status>busy</status><priority>5</priority></presence>"
+  end
+
+  def stats
+    @conn.outbound_stats
+  end
+
+  it 'should send only the latest state presence to an address' do
+    @conn.enable_presence_coalescing(:window => 0.1)
+    %w(away xa dnd).each { |show| @conn.send_raw(presence('friend@localhost', show)) }
+    stats.values_at(:held, :coalesced).should == [1, 2]
+    pump_until { sent.size == 1 }
+    sent.first.should include('<show>dnd</show>')
+    stats[:held].should == 0
+  end
+
+  it 'should not coalesce MUC joins' do
+    @conn.enable_presence_coalescing(:window => 5)
+    join = "<presence to='room@conference.localhost/me'>" \
+           "<x xmlns='http://jabber.org/protocol/muc'/></presence>"
+    @conn.send_raw(join)
+    @conn.send_raw(join)
+    pump_until { sent.size == 2 }
+    stats.values_at(:held, :coalesced).should == [0, 0]
+  end
+
+  it 'should only coalesce messages carrying state' do
+    @conn.enable_presence_coalescing(:window => 5)
+    state = LM::Message.new('a@localhost', LM::MessageType::PRESENCE)
+    state.root_node.add_child('show', 'away')
+    join = LM::Message.new('room@conference.localhost/me', LM::MessageType::PRESENCE)
+    join.root_node.add_child('x')['xmlns'] = 'http://jabber.org/protocol/muc'
+    @conn.send(state)
+    @conn.send(join)
+    pump_until { sent.size == 1 }
+    sent.first.should include('room@conference.localhost/me')
+    stats[:held].should == 1
+  end
+
+  it 'should send a held presence before anything else to its address' do
+    @conn.enable_presence_coalescing(:window => 5)
+    @conn.send_raw(presence('friend@localhost', 'away'))
+    @conn.send_raw("<message to='friend@localhost'><body>hi</body></message>")
+    pump_until { sent.size == 2 }
+    sent[0].should =~ /^<presence/
+    sent[1].should =~ /^<message/
+    stats[:held].should == 0
+  end
+
+  it 'should send a held presence before a high priority stanza' do
+    @conn.enable_presence_coalescing(:window => 5)
+    @conn.send_raw(presence('friend@localhost', 'away'))
+    @conn.send_raw("<iq type='get' id='v1' to='friend@localhost'/>", :priority => :high)
+    pump_until { sent.size == 2 }
+    sent.map { |xml| xml[/^<(\w+)/, 1] }.should == %w(presence iq)
+  end
+
+  it 'should keep holding presences to other addresses' do
+    @conn.enable_presence_coalescing(:window => 5)
+    @conn.send_raw(presence('friend@localhost', 'away'))
+    @conn.send_raw("<message to='other@localhost'><body>hi</body></message>")
+    pump_until { sent.size == 1 }
+    sent.first.should =~ /^<message/
+    stats[:held].should == 1
+  end
+
+  it 'should send held presences as they were when sent' do
+    @conn.enable_presence_coalescing(:window => 5)
+    msg = LM::Message.new('friend@localhost', LM::MessageType::PRESENCE)
+    msg.root_node['id'] = 'before'
+    @conn.send(msg)
+    msg.root_node['id'] = 'after'
+    @conn.disable_presence_coalescing
+    pump_until { sent.size == 1 }
+    sent.first.should =~ /id=['"]before/
+  end
+end
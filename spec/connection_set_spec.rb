@@ -0,0 +1,79 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::ConnectionSet" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+  end
+
+  after(:each) do
+    @sets.each { |set| set.connections.each { |c| c.close rescue nil } } if @sets
+    @server.stop
+  end
+
+  def connect_all(specs, options = {})
+    results = []
+    set = LM::ConnectionSet.connect_all(specs, options) { |result| results << result }
+    (@sets ||= []) << set
+    pump_until { set.pending == 0 }
+    pump_until { results.size == specs.size }
+    [set, results.sort_by { |r| r[:index] }]
+  end
+
+  def spec_for(user)
+    { :server => '127.0.0.1', :port => @server.port,
+      :jid => "#{user}@localhost", :password => 'secret' }
+  end
+
+  it 'should open and authenticate every connection' do
+    set, results = connect_all([spec_for('alice'), spec_for('bob')], :concurrency => 1)
+    set.size.should == 2
+    results.map { |r| [r[:index], r[:success], r[:stage]] }.should == [[0, true, :auth], [1, true, :auth]]
+    results.each do |r|
+      r[:open_time].should >= 0
+      r[:auth_time].should >= 0
+    end
+    set.connections.each { |c| c.should be_authenticated }
+    @server.received.grep(/<username>/).join.should =~ /alice.*bob|bob.*alice/
+  end
+
+  it 'should take the user from the node of the jid' do
+    connect_all([spec_for('carol').merge(:resource => 'desk')])
+    auth = @server.received.grep(/type=.set.*jabber:iq:auth/).last
+    auth.should =~ %r{<username>carol</username>}
+    auth.should =~ %r{<resource>desk</resource>}
+  end
+
+  it 'should report connections that fail to open' do
+    closed = TCPServer.new('127.0.0.1', 0)
+    port = closed.addr[1]
+    closed.close
+    _, results = connect_all([spec_for('dave').merge(:port => port)])
+    results.first[:success].should == false
+    results.first[:stage].should == :open
+  end
+
+  it 'should authenticate again on reconnect' do
+    conn = LM::EventedConnection.new('127.0.0.1')
+    back = nil
+    conn.enable_reconnect(:initial_delay => 0.05, :jitter => 0) { |ok| back = ok }
+    _, results = connect_all([{ :connection => conn, :port => @server.port,
+                                :jid => 'erin@localhost', :password => 'secret' }])
+    results.first[:success].should == true
+    @server.drop
+    pump_until { back }
+    pump_until { conn.authenticated? }
+    @server.received.grep(%r{<username>erin</username>}).size.should == 2
+  end
+
+  it 'should validate specs and options' do
+    lambda { LM::ConnectionSet.connect_all([spec_for('x').merge(:password => nil)]) }.should raise_error(ArgumentError)
+    lambda { LM::ConnectionSet.connect_all([{ :server => '127.0.0.1', :password => 'p' }]) }.should raise_error(ArgumentError)
+    lambda { LM::ConnectionSet.connect_all([spec_for('x')], :concurrency => 0) }.should raise_error(ArgumentError)
+    lambda { LM::ConnectionSet.connect_all([{ :connection => 'conn', :password => 'p' }]) }.should raise_error(TypeError)
+    lambda { LM::ConnectionSet.connect_all(spec_for('x')) }.should raise_error(TypeError)
+  end
+end
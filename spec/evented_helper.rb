@@ -0,0 +1,135 @@
+require 'socket'
+require 'timeout'
+
+# A tiny XMPP server for driving LM::EventedConnection from specs. It speaks
+# just enough of the legacy jabber:iq:auth handshake to authenticate anyone,
+# records every stanza it receives and lets the spec push stanzas back to the
+# client that connected last.
+class FakeXmppServer
+  attr_reader :port, :stanzas
+
+  STREAM_HEADER = "<?xml version='1.0' encoding='UTF-8'?>" \
+                  "<stream:stream xmlns='jabber:client' " \
+                  "xmlns:stream='http://etherx.jabber.org/streams' " \
+                  "id='fake' from='localhost'>"
+
+  def initialize
+    @server = TCPServer.new('127.0.0.1', 0)
+    @port = @server.addr[1]
+    @stanzas = []
+    @lock = Mutex.new
+    @client = nil
+    @clients = []
+    @thread = Thread.new { serve }
+  end
+
+  def push(xml)
+    Timeout.timeout(5) { Thread.pass until @client }
+    @client.write(xml)
+  end
+
+  def received
+    @lock.synchronize { @stanzas.dup }
+  end
+
+  # Drops the client without closing the stream, like a network failure
+  def drop
+    @client.close if @client && !@client.closed?
+    @client = nil
+  end
+
+  def stop
+    drop
+    @clients.each { |c| c.close unless c.closed? }
+    @server.close unless @server.closed?
+    @thread.kill
+  end
+
+  private
+
+  def serve
+    loop do
+      client = @server.accept
+      @clients << client
+      @client = client
+      Thread.new do
+        begin
+          handle(client)
+        rescue IOError, SystemCallError
+        end
+      end
+    end
+  rescue IOError, Errno::EBADF
+  end
+
+  def handle(client)
+    buf = ''
+    scan = 0
+    depth = 0
+    start = nil
+    while (data = client.readpartial(4096) rescue nil)
+      buf << data
+      while (open = buf.index('<', scan)) && (close = buf.index('>', open))
+        tag = buf[open..close]
+        scan = close + 1
+        if tag.start_with?('<?')
+          next
+        elsif tag.start_with?('<stream:stream')
+          client.write(STREAM_HEADER)
+          next
+        elsif tag.start_with?('</stream:stream')
+          client.write('</stream:stream>')
+          client.close
+          return
+        elsif tag.start_with?('</')
+          depth -= 1
+        else
+          start = open if depth == 0
+          depth += 1 unless tag.end_with?('/>')
+        end
+        if depth == 0
+          stanza(client, buf[start...scan])
+          buf = buf[scan..-1]
+          scan = 0
+        end
+      end
+    end
+  end
+
+  def stanza(client, xml)
+    @lock.synchronize { @stanzas << xml }
+    return unless xml.include?('jabber:iq:auth')
+    id = xml[/id=['"]([^'"]*)/, 1]
+    if xml =~ /type=['"]get/
+      client.write("<iq type='result' id='#{id}'><query xmlns='jabber:iq:auth'>" \
+                   "<username/><password/><resource/></query></iq>")
+    else
+      client.write("<iq type='result' id='#{id}'/>")
+    end
+  end
+end
+
+# Runs LM::Sink notifications until the block returns true
+def pump_until(timeout = 5)
+  sink = IO.for_fd(LM::Sink.file_descriptor, :autoclose => false)
+  deadline = Time.now + timeout
+  until yield
+    raise "timed out waiting for the connection" if Time.now > deadline
+    next unless IO.select([sink], nil, nil, 0.05)
+    cb = LM::Sink.notification
+    cb.target.call(cb.data) if cb && cb.target
+  end
+end
+
+# An authenticated LM::EventedConnection talking to a FakeXmppServer
+def evented_connection(server)
+  conn = LM::EventedConnection.new('127.0.0.1')
+  conn.port = server.port
+  conn.jid = 'tester@localhost/spec'
+  opened = authed = nil
+  conn.open { |res| opened = res }
+  pump_until { !opened.nil? }
+  conn.authenticate('tester', 'secret', 'spec') { |res| authed = res }
+  pump_until { !authed.nil? }
+  conn
+end
@@ -0,0 +1,283 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::MessageNode" do
+
+  before(:each) do
+    @msg = LM::Message.new('someone@localhost', LM::MessageType::IQ)
+    query = @msg.node.add_child('query')
+    query['xmlns'] = 'jabber:iq:roster'
+    query.add_child('item')['jid'] = 'a@localhost'
+    query.add_child('item')['jid'] = 'b@localhost'
+  end
+
+  it 'should return the same wrapper when navigating to a node twice' do
+    @msg.node.get_child('query').should equal(@msg.node.children)
+    @msg.node.children.children.next.should equal(@msg.node.children.children.next)
+  end
+
+  it 'should keep handing out the cached wrapper after a collection' do
+    item = @msg.node.children.children
+    id = item.object_id
+    item = nil
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+    @msg.node.children.children.object_id.should == id
+    @msg.node.children.children.parent.should equal(@msg.node.children)
+  end
+
+  it 'should return shared frozen strings for element names' do
+    item = @msg.node.children.children
+    item.name.should be_frozen
+    item.name.should equal(item.next.name)
+  end
+
+  it 'should keep interned names valid across compaction' do
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+    item = @msg.node.children.children
+    item.name.should == 'item'
+    item.name.should equal(item.next.name)
+    @msg.node.children['xmlns'].should == 'jabber:iq:roster'
+    @msg.node.children['xmlns'].should be_frozen
+  end
+
+  it 'should convert the tree to nested hashes' do
+    h = @msg.node.get_child('query').to_h
+    h[:name].should == 'query'
+    h[:attributes].should == { 'xmlns' => 'jabber:iq:roster' }
+    h[:children].map { |c| c[:attributes]['jid'] }.should == ['a@localhost', 'b@localhost']
+  end
+
+  it 'should limit the hash conversion by depth' do
+    @msg.to_h(:depth => 1)[:children].first.has_key?(:children).should == false
+  end
+
+  it 'should refuse to convert trees nested beyond the limit' do
+    node = @msg.node
+    300.times { node = node.add_child('x') }
+    lambda { @msg.to_h }.should raise_error(ArgumentError)
+    @msg.to_h(:depth => 2)[:children].last[:children].first[:name].should == 'x'
+  end
+
+  it 'should select attributes and nodes by path' do
+    @msg.select('iq/query/item@jid').should == ['a@localhost', 'b@localhost']
+    @msg.node.at("//item[@jid='b@localhost']").should equal(@msg.node.children.children.next)
+    @msg.node.at('query/nothing').should be_nil
+  end
+
+  it 'should return each node once and take attributes from a subtree' do
+    group = @msg.node.children.children.add_child('group')
+    group.add_child('group').add_child('item')['jid'] = 'c@localhost'
+    @msg.node.select('//group//item').size.should == 1
+    @msg.node.select('//group//*').size.should == 2
+    @msg.select('//@jid').should == ['a@localhost', 'c@localhost', 'b@localhost']
+    @msg.node.children.select('.//@xmlns').should == ['jabber:iq:roster']
+  end
+
+  it 'should take the attribute of the element itself after a descendant step' do
+    @msg.node.children.children.add_child('alias')['jid'] = 'nested@localhost'
+    @msg.select('//item@jid').should == ['a@localhost', 'b@localhost']
+    @msg.node.select('query//item@jid').should == ['a@localhost', 'b@localhost']
+    @msg.select('//item//@jid').should == ['a@localhost', 'nested@localhost', 'b@localhost']
+  end
+
+  it 'should take the attribute of b itself in a//b@x' do
+    msg = LM::Message.new('someone@localhost', LM::MessageType::MESSAGE)
+    a = msg.node.add_child('a')
+    b = a.add_child('c').add_child('b')
+    b['x'] = 'outer'
+    b.add_child('d')['x'] = 'inner'
+    a.select('a//b@x').should == []
+    msg.node.select('a//b@x').should == ['outer']
+    msg.node.select('a//b//@x').should == ['outer', 'inner']
+  end
+
+  it 'should iterate over matching children and attributes' do
+    query = @msg.node.children
+    query.each_child('item').map { |i| i['jid'] }.should == ['a@localhost', 'b@localhost']
+    query.each_child('nothing').to_a.should == []
+    query.attributes.should == { 'xmlns' => 'jabber:iq:roster' }
+  end
+
+  it 'should build a message from the to_h layout' do
+    tree = { :children => [{ :name => 'query',
+                             :attributes => { 'xmlns' => 'jabber:iq:roster' },
+                             :children => [{ :name => 'item', :attributes => { 'jid' => 'a@localhost' } },
+                                           { :name => 'item', :attributes => { 'jid' => 'b@localhost' } }] }] }
+    built = LM::Message.build('someone@localhost', LM::MessageType::IQ, nil, tree)
+    built.node.get_child('query').to_h.should == @msg.node.get_child('query').to_h
+  end
+
+  it 'should leave out nil attributes when building and cope with unset values' do
+    built = LM::Message.build(nil, LM::MessageType::IQ, nil,
+                              :children => [{ :name => 'query', :attributes => { 'xmlns' => 'x', 'node' => nil } }])
+    built.node.children.attributes.should == { 'xmlns' => 'x' }
+    item = @msg.node.children.children
+    item['jid'] = nil
+    item.attributes.should == { 'jid' => nil }
+    item.to_h[:attributes].should == { 'jid' => nil }
+    item.to_s.should == '<item jid=""></item>'
+  end
+
+  it 'should serialize escaped xml into a reusable buffer' do
+    node = @msg.node.children.children
+    node['name'] = 'A & <B>'
+    buf = ''
+    node.to_s(buf).should equal(buf)
+    buf.should == '<item jid="a@localhost" name="A &amp; &lt;B&gt;"></item>'
+  end
+
+  it 'should stream the serialized tree into an io' do
+    require 'stringio'
+    io = StringIO.new
+    @msg.write_to(io).should == io.string.size
+    io.string.should == @msg.node.to_s
+  end
+
+  it 'should stream a large tree into a non-blocking pipe' do
+    require 'fcntl'
+    big = LM::Message.new('a@localhost', LM::MessageType::MESSAGE)
+    big.node.add_child('body', 'x' * 300_000)
+    r, w = IO.pipe
+    w.fcntl(Fcntl::F_SETFL, w.fcntl(Fcntl::F_GETFL) | Fcntl::O_NONBLOCK)
+    reader = Thread.new { r.read }
+    big.write_to(w).should == big.node.to_s.size
+    big.write_to(w.fileno).should == big.node.to_s.size
+    w.close
+    reader.value.should == big.node.to_s * 2
+    r.close
+  end
+
+  it 'should keep io buffering and encoding when streaming into a file' do
+    require 'tempfile'
+    file = Tempfile.new('lm')
+    file.write('<!-- head -->')
+    @msg.write_to(file)
+    file.close
+    File.read(file.path).should == '<!-- head -->' + @msg.node.to_s
+
+    File.open(file.path, 'w:UTF-16LE') { |f| @msg.write_to(f) }
+    File.binread(file.path).force_encoding('UTF-16LE').encode('UTF-8').should == @msg.node.to_s
+    file.unlink
+  end
+
+  it 'should not split characters between chunks written to an encoded io' do
+    require 'stringio'
+    # One of the three paddings puts a chunk boundary inside a character,
+    # and StringIO converts every write on its own
+    3.times do |pad|
+      big = LM::Message.new('a@localhost', LM::MessageType::MESSAGE)
+      big.node.add_child('body', 'x' * pad + "\u20ac" * 10_000)
+      io = StringIO.new(''.encode('UTF-16LE'))
+      big.write_to(io).should == big.node.to_s.bytesize
+      io.string.encode('UTF-8').should == big.node.to_s.force_encoding('UTF-8')
+    end
+  end
+
+  it 'should keep strings derived from views valid after the node changes' do
+    item = @msg.node.children.children
+    item['jid'] = 'someone.with.a.long.name@conference.example.org'
+    view = item.attribute_view('jid')
+    copies = [view.dup, view[5..-1], view.byteslice(0, 30), String.new(view)]
+    view = nil
+    item['jid'] = 'c@localhost'
+    item = nil
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+    ('x' * 64 + 'y') * 1000
+    copies.should == ['someone.with.a.long.name@conference.example.org',
+                      'ne.with.a.long.name@conference.example.org',
+                      'someone.with.a.long.name@confe',
+                      'someone.with.a.long.name@conference.example.org']
+  end
+
+  it 'should report the native tree to the GC as it grows' do
+    require 'objspace'
+    msg = LM::Message.new('someone@localhost', LM::MessageType::MESSAGE)
+    size = ObjectSpace.memsize_of(msg)
+    body = msg.node.add_child('body', 'x' * 100_000)
+    ObjectSpace.memsize_of(msg).should > size + 100_000
+    body.value = 'short'
+    ObjectSpace.memsize_of(msg).should < size + 1_000
+    body['lang'] = 'y' * 50_000
+    ObjectSpace.memsize_of(msg).should > size + 50_000
+  end
+
+  it 'should count native trees towards the next GC' do
+    tree = { :children => [{ :name => 'body', :value => 'x' * 1_000_000 }] }
+    GC.start
+    before = GC.stat(:malloc_increase_bytes)
+    msg = LM::Message.build(nil, LM::MessageType::MESSAGE, nil, tree)
+    GC.stat(:malloc_increase_bytes).should > before + 1_000_000
+  end
+
+  it 'should flatten into an indexed frozen snapshot' do
+    frozen = LM::FrozenMessage.new(@msg)
+    frozen.size.should == 4
+    frozen.name.should == 'iq'
+    query = frozen.find('query')
+    frozen.attribute(query, 'xmlns').should == 'jabber:iq:roster'
+    frozen.each_child(query, 'item').map { |i| frozen.attribute(i, 'jid') }.should == ['a@localhost', 'b@localhost']
+    frozen.parent(frozen.find('item')).should == query
+  end
+
+  it 'should snapshot attributes without a value as nil' do
+    @msg.node.children.children['jid'] = nil
+    frozen = LM::FrozenMessage.new(@msg)
+    item = frozen.find('item')
+    frozen.attribute(item, 'jid').should be_nil
+    frozen.attributes(item).should == { 'jid' => nil }
+    frozen.attribute(frozen.find('item', item + 1), 'jid').should == 'b@localhost'
+  end
+
+  it 'should parse serialized stanzas back into messages' do
+    LM::Message.parse(@msg.node.to_s).node.to_s.should == @msg.node.to_s
+    stream = "<stream:stream xmlns='jabber:client'><presence from='a@localhost'/>" + @msg.node.to_s
+    LM::Message.parse_many(stream).map { |m| m.node.name }.should == ['presence', 'iq']
+  end
+
+  it 'should stop parsing after the first stanza' do
+    LM::Message.parse("<presence from='a@localhost'/><message><unclosed>").node['from'].should == 'a@localhost'
+  end
+
+  it 'should keep whitespace values and drop indentation' do
+    msg = LM::Message.parse("<message>\n  <body>  </body>\n  <subject>\n</subject>\n</message>")
+    msg.node.value.should be_nil
+    msg.node.get_child('body').value.should == '  '
+    msg.node.get_child('subject').value.should == "\n"
+  end
+
+end
+
+describe "LM::MessageNode views on an inbound message" do
+
+  it 'should survive a mutation through another wrapper of the node' do
+    server = FakeXmppServer.new
+    conn = evented_connection(server)
+    body = 'a message body long enough to live outside of an embedded string'
+    views = []
+    seen = 0
+    # Each handler gets its own LM::Message wrapper, the first one to run
+    # takes a view and the second one replaces the value under it
+    2.times do
+      conn.add_message_handler(LM::MessageType::MESSAGE) do |m|
+        if views.empty?
+          views << m.node.get_child('body').value_view
+        else
+          m.node.get_child('body').value = 'replaced'
+        end
+        seen += 1
+      end
+    end
+    server.push("<message from='b@localhost'><body>#{body}</body></message>")
+    pump_until { seen == 2 }
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+    views.map { |v| v.dup }.should == [body]
+    conn.close
+    server.stop
+  end
+end
@@ -0,0 +1,81 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection outbound priorities" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  def messages
+    @server.received.grep(/<message/)
+  end
+
+  def recipients
+    messages.map { |xml| xml[/to=['"]([^@]*)/, 1] }
+  end
+
+  # Backs the shaper up so that normal stanzas queue as well as bulk ones
+  def hold_outbound
+    @conn.enable_rate_limit(:stanzas_per_sec => 2, :burst => 0.5)
+    @conn.send_raw("<message to='first@localhost'/>")
+    @conn.send_raw("<message to='second@localhost'/>")
+  end
+
+  # Sends everything queued in one go
+  def release_outbound(n)
+    @conn.disable_rate_limit
+    pump_until { messages.size >= n }
+  end
+
+  it 'should queue bulk stanzas and send them from the loop' do
+    @conn.send_raw("<message to='b@localhost'/>", :priority => :bulk)
+    pump_until { messages.size == 1 }
+    @conn.outbound_stats[:bulk].values_at(:sent, :depth).should == [1, 0]
+  end
+
+  it 'should take turns, four normal stanzas for each bulk one' do
+    hold_outbound
+    10.times { |i| @conn.send_raw("<message to='b#{i}@localhost'/>", :priority => :bulk) }
+    10.times { |i| @conn.send_raw("<message to='n#{i}@localhost'/>") }
+    @conn.outbound_stats[:normal][:depth].should == 10
+    @conn.outbound_stats[:bulk][:depth].should == 10
+    release_outbound(22)
+    kinds = recipients[2..-1].map { |r| r[0, 1] }.join
+    kinds.should == 'nnnnbnnnnbnnbbbbbbbb'
+    recipients.grep(/^n/).should == (0...10).map { |i| "n#{i}" }
+    recipients.grep(/^b\d/).should == (0...10).map { |i| "b#{i}" }
+  end
+
+  it 'should send high priority stanzas past the queues' do
+    hold_outbound
+    @conn.send_raw("<message to='n0@localhost'/>")
+    @conn.send_raw("<message to='h0@localhost'/>", :priority => :high)
+    pump_until { messages.size >= 2 }
+    recipients[0, 2].should == %w(first h0)
+    release_outbound(4)
+    @conn.outbound_stats[:high][:sent].should == 1
+  end
+
+  it 'should send queued messages as they were when sent' do
+    hold_outbound
+    msg = LM::Message.new('queued@localhost', LM::MessageType::MESSAGE)
+    msg.root_node['id'] = 'before'
+    @conn.send(msg, :priority => :bulk)
+    msg.root_node['id'] = 'after'
+    release_outbound(3)
+    messages.last.should =~ /id=['"]before/
+  end
+
+  it 'should reject unknown priorities' do
+    lambda { @conn.send_raw("<message/>", :priority => :urgent) }.should raise_error(ArgumentError)
+  end
+end
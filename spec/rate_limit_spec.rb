@@ -0,0 +1,112 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection#enable_rate_limit" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  # A message stanza of exactly size bytes
+  def stanza(to, size)
+    head = "<message to='#{to}'><body>"
+    tail = "</body></message>"
+    head + 'x' * (size - head.size - tail.size) + tail
+  end
+
+  def messages
+    @server.received.grep(/<message/)
+  end
+
+  # Seconds until the server got n messages
+  def time_until_received(n)
+    started = Time.now
+    pump_until { messages.size >= n }
+    Time.now - started
+  end
+
+  def stats
+    @conn.rate_limit_stats
+  end
+
+  it 'should send a burst right away and pace the rest' do
+    @conn.enable_rate_limit(:stanzas_per_sec => 20, :burst => 0.25)
+    10.times { |i| @conn.send_raw(stanza("u#{i}@localhost", 60)) }
+    pump_until { messages.size >= 5 }
+    messages.size.should < 10
+    time_until_received(10).should >= 0.2
+    stats[:depth].should == 0
+    stats[:queued].should >= 1
+  end
+
+  it 'should pace by bytes' do
+    @conn.enable_rate_limit(:bytes_per_sec => 1000, :burst => 0.1)
+    3.times { |i| @conn.send_raw(stanza("u#{i}@localhost", 100)) }
+    time_until_received(3).should >= 0.19
+  end
+
+  it 'should let a stanza over the burst through and wait off the debt' do
+    @conn.enable_rate_limit(:bytes_per_sec => 1000, :burst => 0.1)
+    @conn.send_raw(stanza('big@localhost', 300))
+    stats[:queued].should == 0
+    @conn.send_raw(stanza('small@localhost', 60))
+    stats[:queued].should == 1
+    time_until_received(2).should >= 0.24
+  end
+
+  it 'should give each domain its own buckets' do
+    @conn.enable_rate_limit(:domain_stanzas_per_sec => 5, :burst => 0.2)
+    @conn.send_raw(stanza('a@one.example', 60))
+    @conn.send_raw(stanza('b@two.example', 60))
+    stats[:queued].should == 0
+    @conn.send_raw(stanza('c@one.example', 60))
+    stats[:queued].should == 1
+    time_until_received(3).should >= 0.15
+  end
+
+  it 'should forget idle domains' do
+    @conn.enable_rate_limit(:domain_stanzas_per_sec => 100, :burst => 0.05)
+    %w(one two three).each { |d| @conn.send_raw(stanza("u@#{d}.example", 60)) }
+    stats[:domains].should == 3
+    sleep 0.1
+    @conn.send_raw(stanza('u@four.example', 60))
+    stats[:domains].should == 1
+  end
+
+  it 'should send messages as they were when sent' do
+    @conn.enable_rate_limit(:stanzas_per_sec => 10, :burst => 0.1)
+    msg = LM::Message.new('u@localhost', LM::MessageType::MESSAGE)
+    msg.root_node['id'] = 'before'
+    @conn.send(msg)
+    @conn.send(msg)
+    stats[:queued].should == 1
+    msg.root_node['id'] = 'after'
+    time_until_received(2)
+    messages.map { |xml| xml[/id=['"]([^'"]*)/, 1] }.should == %w(before before)
+  end
+
+  it 'should send urgent stanzas past the queue' do
+    @conn.enable_rate_limit(:stanzas_per_sec => 10, :burst => 0.1)
+    @conn.send_raw(stanza('first@localhost', 60))
+    @conn.send_raw(stanza('second@localhost', 60))
+    @conn.send_raw(stanza('urgent@localhost', 60), :priority => :high)
+    pump_until { messages.size >= 2 }
+    messages.map { |xml| xml[/to='([^']*)/, 1] }.should == %w(first@localhost urgent@localhost)
+    time_until_received(3)
+  end
+
+  it 'should validate its options' do
+    lambda { @conn.enable_rate_limit({}) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_rate_limit(:stanzas_per_sec => -1) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_rate_limit(:stanzas_per_sec => 1, :burst => 0) }.should raise_error(ArgumentError)
+    stats.should be_nil
+  end
+end
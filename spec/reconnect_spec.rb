@@ -0,0 +1,105 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection#enable_reconnect" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+  end
+
+  after(:each) do
+    @conn.close rescue nil
+    @server.stop
+  end
+
+  # Takes the server away for good and times until the attempts run out
+  def time_until_given_up(options)
+    outcome = nil
+    @conn.enable_reconnect(options) { |ok| outcome = ok }
+    started = Time.now
+    @server.stop
+    pump_until(10) { outcome == false }
+    Time.now - started
+  end
+
+  it 'should reconnect and authenticate again after a drop' do
+    back = nil
+    @conn.enable_reconnect(:initial_delay => 0.05, :jitter => 0, :user => 'tester',
+                           :password => 'secret', :resource => 'spec') { |ok| back = ok }
+    @server.drop
+    pump_until { back }
+    pump_until { @conn.authenticated? }
+    @server.received.grep(%r{<username>tester</username>}).size.should == 2
+  end
+
+  it 'should back off exponentially between attempts' do
+    elapsed = time_until_given_up(:initial_delay => 0.1, :multiplier => 2,
+                                  :jitter => 0, :max_attempts => 3)
+    elapsed.should >= 0.1 + 0.2 + 0.4
+    @conn.reconnect_stats[:attempts].should == 3
+  end
+
+  it 'should cap the delay at max_delay' do
+    elapsed = time_until_given_up(:initial_delay => 0.1, :multiplier => 10, :max_delay => 0.15,
+                                  :jitter => 0, :max_attempts => 3)
+    elapsed.should >= 0.1 + 0.15 + 0.15
+    elapsed.should < 1.0
+  end
+
+  it 'should only shorten delays with jitter' do
+    elapsed = time_until_given_up(:initial_delay => 0.2, :multiplier => 1,
+                                  :jitter => 1, :max_attempts => 3)
+    elapsed.should < 0.6
+  end
+
+  it 'should count disconnects, reconnects and downtime' do
+    back = nil
+    @conn.enable_reconnect(:initial_delay => 0.05, :jitter => 0) { |ok| back = ok }
+    @conn.reconnect_stats.should == { :disconnects => 0, :reconnects => 0, :attempts => 0,
+                                      :downtime => 0.0, :last_downtime => 0.0, :down => false }
+    @server.drop
+    pump_until { back }
+    stats = @conn.reconnect_stats
+    stats[:disconnects].should == 1
+    stats[:reconnects].should == 1
+    stats[:attempts].should == 1
+    stats[:down].should == false
+    stats[:downtime].should >= 0.05
+    stats[:last_downtime].should == stats[:downtime]
+  end
+
+  it 'should stay down once max_attempts ran out' do
+    time_until_given_up(:initial_delay => 0.05, :jitter => 0, :max_attempts => 2)
+    stats = @conn.reconnect_stats
+    stats[:disconnects].should == 1
+    stats[:reconnects].should == 0
+    stats[:down].should == true
+  end
+
+  it 'should not reconnect after an explicit close' do
+    back = nil
+    @conn.enable_reconnect(:initial_delay => 0.05, :jitter => 0) { |ok| back = ok }
+    @conn.close
+    sleep 0.2
+    pump_until(1) { true }
+    back.should be_nil
+    @conn.reconnect_stats[:disconnects].should == 0
+  end
+
+  it 'should validate its options' do
+    lambda { @conn.enable_reconnect(:initial_delay => 0) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_reconnect(:initial_delay => 2, :max_delay => 1) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_reconnect(:multiplier => 0.5) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_reconnect(:jitter => 1.5) }.should raise_error(ArgumentError)
+    @conn.reconnect_stats.should be_nil
+  end
+
+  it 'should drop its stats when disabled' do
+    @conn.enable_reconnect
+    @conn.disable_reconnect
+    @conn.reconnect_stats.should be_nil
+  end
+end
@@ -0,0 +1,103 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection#enable_roster_cache" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+    @presences = []
+    @conn.add_message_handler(LM::MessageType::PRESENCE) do |m|
+      @presences << m.root_node['from']
+    end
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  def roster_iq(type, jid, from = nil)
+    attrs = "type='#{type}' id='#{type}-#{jid}'"
+    attrs << " from='#{from}'" if from
+    "<iq #{attrs}><query xmlns='jabber:iq:roster'>" \
+    "<item jid='#{jid}' subscription='both'/></query></iq>"
+  end
+
+  # Pushes a roster item from the server and waits for the cache to take it
+  def push_roster(jid)
+    @server.push(roster_iq('set', jid))
+    pump_until { @conn.roster.include?(jid) }
+  end
+
+  # Waits for a presence from jid to reach ruby, so that everything pushed
+  # before has been handled
+  def sync(jid = 'marker@localhost/x')
+    @server.push("<presence from='#{jid}'/>")
+    pump_until { @presences.include?(jid) }
+  end
+
+  it 'should take roster pushes without a from' do
+    @conn.enable_roster_cache
+    push_roster('friend@localhost')
+    @conn.roster.should == ['friend@localhost']
+  end
+
+  it 'should take roster pushes from the account' do
+    @conn.enable_roster_cache
+    @server.push(roster_iq('set', 'a@localhost', 'tester@localhost'))
+    @server.push(roster_iq('set', 'b@localhost', 'Tester@LOCALHOST'))
+    pump_until { @conn.roster.size == 2 }
+    @conn.roster.sort.should == ['a@localhost', 'b@localhost']
+  end
+
+  it 'should ignore roster pushes from anyone else' do
+    @conn.enable_roster_cache
+    @server.push(roster_iq('set', 'mallory@localhost', 'mallory@localhost'))
+    @server.push(roster_iq('set', 'eve@localhost', 'tester@localhost/other'))
+    @server.push(roster_iq('result', 'trudy@localhost', 'localhost'))
+    sync
+    @conn.roster.should == []
+  end
+
+  it 'should replace the roster with a result' do
+    @conn.enable_roster_cache
+    push_roster('old@localhost')
+    @server.push(roster_iq('result', 'new@localhost'))
+    pump_until { @conn.roster.include?('new@localhost') }
+    @conn.roster.should == ['new@localhost']
+  end
+
+  it 'should keep presences of contacts' do
+    @conn.enable_roster_cache
+    push_roster('friend@localhost')
+    @server.push("<presence from='friend@localhost/home'><show>away</show>" \
+                 "<status>out</status><priority>3</priority></presence>")
+    pump_until { @presences.include?('friend@localhost/home') }
+    @conn.presence_of('friend@localhost/home').should == { :show => 'away', :status => 'out', :priority => 3 }
+  end
+
+  it 'should leave MUC occupants alone' do
+    @conn.enable_roster_cache(:consume_presence => true)
+    push_roster('room@conference.localhost')
+    @server.push("<presence from='room@conference.localhost/nick'>" \
+                 "<x xmlns='http://jabber.org/protocol/muc#user'>" \
+                 "<item affiliation='none' role='participant'/></x></presence>")
+    sync
+    @presences.should include('room@conference.localhost/nick')
+    @conn.presence_of('room@conference.localhost/nick').should be_nil
+  end
+
+  it 'should only consume presences of roster contacts' do
+    @conn.enable_roster_cache(:consume_presence => true)
+    push_roster('friend@localhost')
+    @server.push("<presence from='friend@localhost/home'/>")
+    @server.push("<presence from='stranger@localhost/home'/>")
+    sync('stranger@localhost/home')
+    @presences.should == ['stranger@localhost/home']
+    @conn.presence_of('friend@localhost/home').should_not be_nil
+    @conn.presence_of('stranger@localhost/home').should_not be_nil
+  end
+end
@@ -0,0 +1,66 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+class RawStanza
+  def initialize(to)
+    @to = to
+  end
+
+  # A new String every time, nothing else references it
+  def to_str
+    "<message to='#{@to}'/>"
+  end
+end
+
+describe "LM::EventedConnection#send_raw_batch" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  def wait_for_messages(n)
+    pump_until { @server.received.grep(/<message/).size >= n }
+    @server.received.grep(/<message/)
+  end
+
+  it 'should send every string in order and return the count' do
+    @conn.send_raw_batch(["<message to='a@localhost'/>", "<message to='b@localhost'/>"]).should == 2
+    wait_for_messages(2).should == ["<message to='a@localhost'/>", "<message to='b@localhost'/>"]
+  end
+
+  it 'should keep strings from to_str alive across chunks' do
+    stanzas = (1..150).map { |i| RawStanza.new("u#{i}@localhost") }
+    begin
+      GC.stress = true
+      @conn.send_raw_batch(stanzas).should == 150
+    ensure
+      GC.stress = false
+    end
+    wait_for_messages(150).should == stanzas.map { |s| s.to_str }
+  end
+
+  it 'should raise before sending anything from a chunk holding a non String' do
+    lambda {
+      @conn.send_raw_batch(["<message to='a@localhost'/>", 42])
+    }.should raise_error(TypeError)
+    @conn.send_raw("<message to='b@localhost'/>").should == true
+    wait_for_messages(1).should == ["<message to='b@localhost'/>"]
+  end
+end
+
+describe "LM::Connection#send_raw_batch" do
+
+  it 'should return how many strings went out before a failure' do
+    conn = LM::Connection.new('127.0.0.1')
+    conn.send_raw_batch(["<message to='a@localhost'/>"]).should == 0
+    conn.send_raw("<message to='a@localhost'/>").should == false
+  end
+end
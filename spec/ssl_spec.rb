@@ -0,0 +1,63 @@
+require File.dirname(__FILE__) + '/spec_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::SSL policy" do
+
+  PIN_HEX = '0123456789abcdef1122334455667788'
+  PIN = [PIN_HEX].pack('H*')
+
+  [LM::SSL, LM::EventedSSL].each do |klass|
+    describe klass do
+
+      it 'should accept a hex pin with colons' do
+        pin = PIN_HEX.scan(/../).join(':').upcase
+        klass.new(:pins => pin).fingerprint.should == PIN
+      end
+
+      it 'should accept a hex pin with spaces' do
+        klass.new(:pins => PIN_HEX.scan(/../).join(' ')).fingerprint.should == PIN
+      end
+
+      it 'should accept a raw digest' do
+        klass.new(:pins => [PIN]).fingerprint.should == PIN
+      end
+
+      it 'should expect the first of several pins' do
+        other = 'ffeeddccbbaa99887766554433221100'
+        klass.new(:pins => [PIN_HEX, other]).fingerprint.should == PIN
+      end
+
+      it 'should prefer an explicit fingerprint over the pins' do
+        explicit = 'abcdefghijklmnop'
+        klass.new(explicit, :pins => PIN_HEX).fingerprint.should == explicit
+      end
+
+      it 'should reject malformed pins' do
+        ['0123', PIN_HEX + '99', PIN_HEX.sub('0', 'g'), 'not a fingerprint'].each do |pin|
+          lambda { klass.new(:pins => pin) }.should raise_error(ArgumentError)
+        end
+      end
+
+      it 'should reject unknown statuses to allow' do
+        lambda { klass.new(:allow => [LM::SSLStatus::CERT_EXPIRED, 99]) }.should raise_error(ArgumentError)
+      end
+
+      it 'should take allowed statuses without pins' do
+        ssl = klass.new(:allow => [LM::SSLStatus::UNTRUSTED_CERT, LM::SSLStatus::CERT_EXPIRED])
+        ssl.fingerprint.should be_nil
+      end
+
+      it 'should reject a policy that is not a hash' do
+        lambda { klass.new(nil, [PIN_HEX]) }.should raise_error(TypeError)
+      end
+
+      it 'should keep its block through GC.compact' do
+        ssl = klass.new(:pins => PIN_HEX) { |status| LM::SSLResponse::CONTINUE }
+        GC.compact
+        GC.start
+        ssl.fingerprint.should == PIN
+      end
+    end
+  end
+end
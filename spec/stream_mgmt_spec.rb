@@ -0,0 +1,110 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::EventedConnection#enable_stream_management" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  def send_messages(n)
+    before = @server.received.grep(/<message/).size
+    n.times { |i| @conn.send_raw("<message to='u#{i}@localhost'/>") }
+    pump_until { @server.received.grep(/<message/).size >= before + n }
+  end
+
+  def pings(n)
+    pump_until { @server.received.grep(/urn:xmpp:ping/).size >= n }
+    @server.received.grep(/urn:xmpp:ping/).map { |xml| xml[/id=['"]([^'"]*)/, 1] }
+  end
+
+  def answer(id, type = 'result')
+    @server.push("<iq type='#{type}' id='#{id}' from='localhost'/>")
+  end
+
+  def stats
+    @conn.stream_management_stats
+  end
+
+  it 'should keep sent stanzas until a ping acknowledges them' do
+    @conn.enable_stream_management(:buffer => 8, :ack_every => 4)
+    send_messages(3)
+    stats.values_at(:sent, :acked, :unacked).should == [3, 0, 3]
+    @server.received.grep(/urn:xmpp:ping/).should be_empty
+
+    send_messages(1)
+    answer(pings(1).first)
+    pump_until { stats[:acked] == 4 }
+    stats.values_at(:sent, :acked, :unacked).should == [4, 4, 0]
+  end
+
+  it 'should take error replies to a ping as acknowledgements' do
+    @conn.enable_stream_management(:buffer => 4, :ack_every => 2)
+    send_messages(2)
+    answer(pings(1).first, 'error')
+    pump_until { stats[:acked] == 2 }
+    stats[:unacked].should == 0
+  end
+
+  it 'should not go back on a late acknowledgement' do
+    @conn.enable_stream_management(:buffer => 8, :ack_every => 2)
+    send_messages(4)
+    first, second = pings(2)
+    answer(second)
+    pump_until { stats[:acked] == 4 }
+    answer(first)
+    # Stanzas are handled in order, once this one counts the late reply is in
+    @server.push("<message from='a@localhost/x'/>")
+    pump_until { stats[:received] == 1 }
+    send_messages(1)
+    stats.values_at(:acked, :unacked).should == [4, 1]
+  end
+
+  it 'should drop the oldest stanzas from a full ring' do
+    @conn.enable_stream_management(:buffer => 2, :ack_every => 2)
+    send_messages(5)
+    stats.values_at(:sent, :unacked, :dropped).should == [5, 2, 3]
+  end
+
+  it 'should resend what is unacknowledged' do
+    @conn.enable_stream_management(:buffer => 8, :ack_every => 8)
+    send_messages(3)
+    @conn.resend_unacked.should == 3
+    pump_until { @server.received.grep(/<message/).size == 6 }
+    @server.received.grep(/<message/).should == (0...3).map { |i| "<message to='u#{i}@localhost'/>" } * 2
+    stats[:resent].should == 3
+    pings(1).size.should == 1
+  end
+
+  it 'should count every inbound stanza' do
+    @conn.enable_stream_management
+    @server.push("<message from='a@localhost/x' to='tester@localhost/spec'><body>hi</body></message>")
+    @server.push("<presence from='a@localhost/x'/>")
+    @server.push("<iq type='get' id='q1' from='localhost'><query xmlns='jabber:iq:version'/></iq>")
+    pump_until { stats[:received] == 3 }
+  end
+
+  it 'should count presences the roster cache consumes' do
+    @conn.enable_stream_management
+    @conn.enable_roster_cache(:consume_presence => true)
+    @server.push("<iq type='set' id='push1'><query xmlns='jabber:iq:roster'>" \
+                 "<item jid='friend@localhost' subscription='both'/></query></iq>")
+    @server.push("<presence from='friend@localhost/home'/>")
+    pump_until { @conn.presence_of('friend@localhost') }
+    pump_until { stats[:received] == 2 }
+  end
+
+  it 'should validate its options' do
+    lambda { @conn.enable_stream_management(:buffer => 0) }.should raise_error(ArgumentError)
+    lambda { @conn.enable_stream_management(:buffer => 4, :ack_every => 5) }.should raise_error(ArgumentError)
+    @conn.stream_management_stats.should be_nil
+  end
+end
@@ -0,0 +1,94 @@
+require File.dirname(__FILE__) + '/spec_helper'
+require File.dirname(__FILE__) + '/evented_helper'
+`cd #{File.dirname(__FILE__) + '/..'} && ruby extconf.rb configure && make clean && make`
+require File.dirname(__FILE__) + '/../loudmouth.bundle'
+
+describe "LM::Template" do
+
+  before(:each) do
+    @chat = LM::Template.compile("<message to='{{to}}' type='chat'><body>{{ body }}</body></message>")
+  end
+
+  it 'should list its slots in order' do
+    @chat.slots.should == [:to, :body]
+  end
+
+  it 'should render escaped values from symbol or string keys' do
+    @chat.render(:to => 'a@localhost', 'body' => "<b> & 'c'").should ==
+      "<message to='a@localhost' type='chat'><body>&lt;b&gt; &amp; &apos;c&apos;</body></message>"
+  end
+
+  it 'should render nil as nothing and refuse missing values' do
+    @chat.render(:to => 'a@localhost', :body => nil).should ==
+      "<message to='a@localhost' type='chat'><body></body></message>"
+    lambda { @chat.render(:to => 'a@localhost') }.should raise_error(ArgumentError)
+  end
+
+  it 'should keep escaped braces literal' do
+    tmpl = LM::Template.compile('<body>\{{not a slot}} {{x}}</body>')
+    tmpl.slots.should == [:x]
+    tmpl.render(:x => 1).should == '<body>{{not a slot}} 1</body>'
+  end
+
+  it 'should reject malformed slots' do
+    lambda { LM::Template.compile('<body>{{}}</body>') }.should raise_error(ArgumentError)
+    lambda { LM::Template.compile('<body>{{x</body>') }.should raise_error(ArgumentError)
+  end
+
+  it 'should recompile when initialized again' do
+    @chat.__send__(:initialize, '<presence to="{{to}}"/>')
+    @chat.slots.should == [:to]
+    @chat.render(:to => 'b@localhost').should == '<presence to="b@localhost"/>'
+  end
+
+  it 'should not mix up renders from several threads' do
+    slow = Class.new do
+      def initialize(s); @s = s; end
+      def to_s; Thread.pass; sleep 0.001; @s; end
+    end
+    threads = (1..8).map do |i|
+      Thread.new do
+        (1..20).map { @chat.render(:to => slow.new("#{i}@localhost"), :body => slow.new(i.to_s)) }
+      end
+    end
+    threads.each_with_index do |t, i|
+      t.value.uniq.should == ["<message to='#{i + 1}@localhost' type='chat'><body>#{i + 1}</body></message>"]
+    end
+  end
+
+end
+
+describe "LM::Template#send" do
+
+  before(:each) do
+    @server = FakeXmppServer.new
+    @conn = evented_connection(@server)
+    @chat = LM::Template.compile("<message to='{{to}}'><body>{{body}}</body></message>")
+  end
+
+  after(:each) do
+    @conn.close
+    @server.stop
+  end
+
+  def messages
+    @server.received.grep(/<message/)
+  end
+
+  it 'should go through rate limiting and stream management' do
+    @conn.enable_stream_management(:buffer => 8, :ack_every => 8)
+    @conn.enable_rate_limit(:stanzas_per_sec => 10, :burst => 0.1)
+    @chat.send(@conn, :to => 'a@localhost', :body => 'one').should == true
+    @chat.send(@conn, :to => 'b@localhost', :body => 'two').should == true
+    @conn.rate_limit_stats[:queued].should == 1
+    pump_until { messages.size == 2 }
+    @conn.stream_management_stats.values_at(:sent, :unacked).should == [2, 2]
+  end
+
+  it 'should take a priority' do
+    @chat.send(@conn, { :to => 'a@localhost', :body => 'hi' }, :priority => :bulk)
+    pump_until { messages.size == 1 }
+    @conn.outbound_stats[:bulk][:sent].should == 1
+    lambda { @chat.send(@conn, { :to => 'a', :body => 'b' }, :priority => :later) }.should raise_error(ArgumentError)
+  end
+end
@@ -6,6 +6,8 @@
 #include "rblm-callback.h"
 #include "rblm-private.h"
 #include "rblm-synchronizer.h"
+#include "rblm-frozen-message.h"
+#include "rblm-connection-set.h"
 #include <ruby.h>
 
 /* Ruby callback class */
@@ -18,10 +20,19 @@ create_async_message (LmAsyncNotification notification, VALUE block, gpointer da
     LmAsyncCallback* cb = (LmAsyncCallback*)malloc (sizeof(LmAsyncCallback));
     cb->notification = notification;
     cb->block = block;
+    cb->handler = NULL;
     cb->data = data;
     return cb;
 }
 
+LmAsyncCallback*
+create_handler_message (LmAsyncNotification notification, RbLmHandler* handler, gpointer data)
+{
+    LmAsyncCallback* cb = create_async_message (notification, Qnil, data);
+    cb->handler = rblm_handler_ref (handler);
+    return cb;
+}
+
 /* Free underlying async message */
 static void
 callback_free (LmAsyncCallback* cb)
@@ -34,18 +45,61 @@ callback_free (LmAsyncCallback* cb)
             lm_message_unref ((LmMessage*)cb->data);
             break;
         }
+        case LM_CB_FROZEN_MSG:
+        {
+            rblm_frozen_message_unref ((RbLmFrozenMessage*)cb->data);
+            break;
+        }
+        case LM_CB_CONNECT:
+        {
+            rblm_connect_result_free ((RbLmConnectResult*)cb->data);
+            break;
+        }
         default:
             break;
     }
+    if (cb->handler)
+        rblm_handler_unref (cb->handler);
     free (cb);
 }
 
+/* Size of the callback and the stanza it carries */
+static size_t
+callback_memsize (const LmAsyncCallback* cb)
+{
+    size_t size = sizeof (LmAsyncCallback);
+    switch (cb->notification)
+    {
+        case LM_CB_MSG:
+        case LM_CB_REPLY:
+            size += rb_lm_message_node_memsize (GPOINTER2MSG (cb->data)->node);
+            break;
+        case LM_CB_FROZEN_MSG:
+            size += rblm_frozen_message_memsize ((RbLmFrozenMessage*)cb->data);
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+static const rb_data_type_t callback_type = {
+    "LM::Callback",
+    {
+        NULL,
+        (RUBY_DATA_FUNC) callback_free,
+        (size_t (*) (const void*)) callback_memsize,
+    },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 /* Convert raw async message to ruby object */
 VALUE
 lm_callback_to_ruby_object (LmAsyncCallback* cb)
 {
     if (cb)
-        return Data_Wrap_Struct (lm_cCallback, NULL, callback_free, cb);
+        return TypedData_Wrap_Struct (lm_cCallback, &callback_type, cb);
     else
         return Qnil;
 }
@@ -55,10 +109,7 @@ rb_lm_callback_from_ruby_object (VALUE obj)
 {
     LmAsyncCallback* cb = NULL;
 
-    if (!rb_lm__is_kind_of (obj, lm_cCallback))
-        rb_raise (rb_eTypeError, "not a LM::Callback");
-
-    Data_Get_Struct (obj, LmAsyncCallback, cb);
+    TypedData_Get_Struct (obj, LmAsyncCallback, &callback_type, cb);
 
     return cb;
 }
@@ -76,6 +127,10 @@ callback_get_target (VALUE self)
 {
     LmAsyncCallback* cb = rb_lm_callback_from_ruby_object (self);
 
+    /* nil if the handler was removed since the callback was queued */
+    if (cb->handler)
+        return cb->handler->block;
+
     return cb->block;
 }
 
@@ -108,6 +163,16 @@ callback_get_data (VALUE self)
             res = INT2FIX (GPOINTER2SSLSTATUS (cb->data));
             break;
         }
+        case LM_CB_FROZEN_MSG:
+        {
+            res = rb_lm_frozen_message_to_ruby_object ((RbLmFrozenMessage*)cb->data);
+            break;
+        }
+        case LM_CB_CONNECT:
+        {
+            res = rb_lm_connect_result_to_ruby_object ((RbLmConnectResult*)cb->data);
+            break;
+        }
         default:
             g_warning ("Unknown callback type '%d'\n", cb->notification);
     }
@@ -120,6 +185,7 @@ void
 Init_lm_callback(VALUE lm_mLM)
 {
     lm_cCallback = rb_define_class_under (lm_mLM, "Callback", rb_cObject);
+    rb_undef_alloc_func (lm_cCallback);
 
     rb_define_const (lm_mLM, "CB_MSG", INT2FIX (LM_CB_MSG));
     rb_define_const (lm_mLM, "CB_REPLY", INT2FIX (LM_CB_REPLY));
@@ -127,6 +193,8 @@ Init_lm_callback(VALUE lm_mLM)
     rb_define_const (lm_mLM, "CB_AUTH", INT2FIX (LM_CB_AUTH));
     rb_define_const (lm_mLM, "CB_DISCONNECT", INT2FIX (LM_CB_DISCONNECT));
     rb_define_const (lm_mLM, "CB_SSL", INT2FIX (LM_CB_SSL));
+    rb_define_const (lm_mLM, "CB_FROZEN_MSG", INT2FIX (LM_CB_FROZEN_MSG));
+    rb_define_const (lm_mLM, "CB_CONNECT", INT2FIX (LM_CB_CONNECT));
 
     rb_define_method (lm_cCallback, "target", callback_get_target, 0);
     rb_define_method (lm_cCallback, "kind", callback_get_kind, 0);
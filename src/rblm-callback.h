@@ -7,6 +7,7 @@
 #define	_RBLM_CALLBACK_H
 
 #include "rblm.h"
+#include "rblm-handlers.h"
 
 /* Types of callbacks that Loudmouth may trigger */
 typedef enum {
@@ -16,15 +17,21 @@ typedef enum {
     LM_CB_CONN_OPEN,
     LM_CB_AUTH,
     LM_CB_DISCONNECT,
-    LM_CB_SSL
+    LM_CB_SSL,
+    LM_CB_FROZEN_MSG,
+    LM_CB_CONNECT
 } LmAsyncNotification;
 
 /* Data posted to the async queue from Loudmouth */
 typedef struct {
     LmAsyncNotification notification; /* Type of callback   */
     VALUE block;                      /* Target of callback */
+    RbLmHandler* handler;             /* Message handler holding the target
+                                       * instead of block, or NULL */
     gpointer data;                    /* Associated data: LmMessage*, gboolean,
-                                       * LmDisconnectReason or LmSSLStatus */
+                                       * LmDisconnectReason, LmSSLStatus,
+                                       * RbLmFrozenMessage* or
+                                       * RbLmConnectResult* */
 } LmAsyncCallback;
 
 /* Data structure used for Loudmouth callback user data */
@@ -38,6 +45,11 @@ LmAsyncCallback* create_async_message (LmAsyncNotification notification,
                                        VALUE block,
                                        gpointer data);
 
+/* Create async messages for a registered message handler */
+LmAsyncCallback* create_handler_message (LmAsyncNotification notification,
+                                         RbLmHandler* handler,
+                                         gpointer data);
+
 /* Create ruby object from raw async message */
 VALUE lm_callback_to_ruby_object (LmAsyncCallback* callback);
 
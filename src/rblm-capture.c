@@ -0,0 +1,348 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-synchronizer.h"
+#include "rblm-capture.h"
+#include "rblm-frozen-message.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/* Records dispatched per GLib main loop iteration when replaying with no delay */
+#define REPLAY_BATCH 256
+
+/* Ahead of handlers at LM_HANDLER_PRIORITY_FIRST, which may remove stanzas */
+#define CAPTURE_PRIORITY ((LmHandlerPriority)(LM_HANDLER_PRIORITY_FIRST + 1))
+
+extern VALUE lm_cEventedConnection;
+
+static VALUE lm_mCapture;
+
+/* Capture file, written from the GLib thread under capture_mx */
+static GMutex* capture_mx = NULL;
+static FILE* capture_file = NULL;
+static gulong capture_records = 0;
+
+/* Replay in progress, owned by the GLib thread once scheduled */
+typedef struct {
+    FILE*               file;
+    gdouble             speed;        /* 0 replays as fast as possible */
+    GPtrArray*          handlers[LM_MESSAGE_TYPE_UNKNOWN + 1];
+    gint64              started;      /* monotonic time replay started at */
+    guint64             first_ts;     /* capture time of the first record */
+    guint64             ts;           /* pending record */
+    GString*            payload;
+} CaptureReplay;
+
+static guint64
+capture_now (void)
+{
+    return (guint64)g_get_monotonic_time ();
+}
+
+/* Records an inbound stanza if a capture is running, from the GLib thread */
+static LmHandlerResult
+capture_handler (LmMessageHandler *handler,
+                 LmConnection     *connection,
+                 LmMessage        *m,
+                 gpointer          user_data)
+{
+    GString* xml;
+    guint64  ts;
+    guint32  len;
+    guint8   k = (guint8)LM_CB_MSG;
+
+    if (!capture_mx || !capture_file)
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+
+    ts = GUINT64_TO_LE (capture_now ());
+    xml = g_string_sized_new (512);
+    rb_lm_message_node_serialize (m->node, rb_lm__gstring_write, xml);
+    len = GUINT32_TO_LE ((guint32)xml->len);
+
+    g_mutex_lock (capture_mx);
+    if (capture_file)
+    {
+        fwrite (&ts, sizeof (ts), 1, capture_file);
+        fwrite (&k, sizeof (k), 1, capture_file);
+        fwrite (&len, sizeof (len), 1, capture_file);
+        fwrite (xml->str, 1, xml->len, capture_file);
+        capture_records++;
+    }
+    g_mutex_unlock (capture_mx);
+
+    g_string_free (xml, TRUE);
+
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+void
+rblm_capture_attach (LmConnection* conn)
+{
+    LmMessageHandler* handler = lm_message_handler_new (capture_handler, NULL, NULL);
+    gint              type;
+
+    for (type = 0; type <= LM_MESSAGE_TYPE_UNKNOWN; type++)
+        lm_connection_register_message_handler (conn, handler, (LmMessageType)type,
+                                                CAPTURE_PRIORITY);
+    lm_message_handler_unref (handler);
+}
+
+/* Reads the next record into r, FALSE at end of log */
+static gboolean
+replay_read_record (CaptureReplay* r)
+{
+    guint64 ts;
+    guint8  k;
+    guint32 len;
+
+    if (fread (&ts, sizeof (ts), 1, r->file) != 1 ||
+        fread (&k, sizeof (k), 1, r->file) != 1 ||
+        fread (&len, sizeof (len), 1, r->file) != 1)
+        return FALSE;
+
+    len = GUINT32_FROM_LE (len);
+    g_string_set_size (r->payload, len);
+    if (len > 0 && fread (r->payload->str, 1, len, r->file) != len)
+        return FALSE;
+
+    r->ts = GUINT64_FROM_LE (ts);
+
+    return TRUE;
+}
+
+static void
+replay_free (CaptureReplay* r)
+{
+    gint  type;
+    guint i;
+
+    for (type = 0; type <= LM_MESSAGE_TYPE_UNKNOWN; type++)
+    {
+        if (!r->handlers[type])
+            continue;
+        for (i = 0; i < r->handlers[type]->len; i++)
+            rblm_handler_unref (g_ptr_array_index (r->handlers[type], i));
+        g_ptr_array_free (r->handlers[type], TRUE);
+    }
+    fclose (r->file);
+    g_string_free (r->payload, TRUE);
+    g_free (r);
+}
+
+/* Post the pending record to every handler block for its message type */
+static void
+replay_dispatch (CaptureReplay* r)
+{
+    GError*      error = NULL;
+    LmMessage*   m;
+    GPtrArray*   handlers;
+    guint        i;
+
+    m = rblm_message_parse (r->payload->str, r->payload->len, &error);
+    if (!m)
+    {
+        if (error)
+        {
+            g_warning ("Skipping unreadable captured stanza: %s\n", error->message);
+            g_error_free (error);
+        }
+        return;
+    }
+
+    /* Replies go to the type handlers like any other inbound message, the
+     * send blocks waiting for them are gone. Each handler is given the
+     * stanza the way it takes live ones. */
+    handlers = r->handlers[lm_message_get_type (m)];
+    for (i = 0; i < handlers->len; i++)
+    {
+        RbLmHandler* handler = g_ptr_array_index (handlers, i);
+
+        if (handler->function == frozen_msg_handler)
+            notify_ruby_handler (LM_CB_FROZEN_MSG, handler, rblm_frozen_message_new (m));
+        else
+            notify_ruby_handler (LM_CB_MSG, handler, MSG2GPOINTER (lm_message_ref (m)));
+    }
+
+    lm_message_unref (m);
+}
+
+/* Microseconds until the pending record is due */
+static gint64
+replay_delay (CaptureReplay* r)
+{
+    gint64 elapsed, due;
+
+    if (r->speed <= 0)
+        return 0;
+
+    elapsed = g_get_monotonic_time () - r->started;
+    due = (gint64)((r->ts - r->first_ts) / r->speed);
+
+    return due - elapsed;
+}
+
+/* GLib source callback driving a replay */
+static gboolean
+replay_step (gpointer data)
+{
+    CaptureReplay* r = data;
+    gint64         delay;
+    guint          batch = 0;
+
+    for (;;)
+    {
+        delay = replay_delay (r);
+        if (delay > 0)
+        {
+            g_timeout_add ((guint)(delay / 1000) + 1, replay_step, r);
+            return FALSE;
+        }
+        if (batch++ == REPLAY_BATCH)
+        {
+            /* Let the rest of the main loop run between batches */
+            g_idle_add (replay_step, r);
+            return FALSE;
+        }
+
+        replay_dispatch (r);
+
+        if (!replay_read_record (r))
+        {
+            replay_free (r);
+            return FALSE;
+        }
+    }
+}
+
+static FILE*
+capture_open (VALUE path, const gchar* mode)
+{
+    FILE* file = fopen (StringValueCStr (path), mode);
+    if (!file)
+        rb_raise (rb_eIOError, "Could not open capture file %s: %s",
+                  RSTRING_PTR (path), strerror (errno));
+    return file;
+}
+
+/* LM::Capture.start (path) starts recording inbound stanzas to path */
+static VALUE
+capture_start (VALUE self, VALUE path)
+{
+    FILE* file;
+
+    rblm_init_sync ();
+    if (!capture_mx)
+        capture_mx = g_mutex_new ();
+
+    file = capture_open (path, "wb");
+    fwrite (RBLM_CAPTURE_MAGIC, 1, RBLM_CAPTURE_MAGIC_LEN, file);
+
+    g_mutex_lock (capture_mx);
+    if (capture_file)
+        fclose (capture_file);
+    capture_file = file;
+    capture_records = 0;
+    g_mutex_unlock (capture_mx);
+
+    return Qnil;
+}
+
+/* LM::Capture.stop closes the log, returns the number of records written */
+static VALUE
+capture_stop (VALUE self)
+{
+    gulong records = 0;
+
+    if (!capture_mx)
+        return INT2FIX (0);
+
+    g_mutex_lock (capture_mx);
+    if (capture_file)
+    {
+        fclose (capture_file);
+        capture_file = NULL;
+        records = capture_records;
+    }
+    g_mutex_unlock (capture_mx);
+
+    return ULONG2NUM (records);
+}
+
+static VALUE
+capture_is_recording (VALUE self)
+{
+    return capture_file ? Qtrue : Qfalse;
+}
+
+/* LM::Capture.replay (path, conn, speed = 1.0) posts every stanza in the log
+ * to the message handlers of the evented connection conn. A speed of 2 plays
+ * twice as fast as captured, 0 plays without any delay. Returns immediately,
+ * the stanzas arrive through LM::Sink like live traffic.
+ *
+ * Only LM::EventedConnection is supported, anything else raises TypeError:
+ * replay runs on the synchronizer's GLib thread and posts through LM::Sink,
+ * while LM::Connection calls its handlers directly from a main loop run by
+ * ruby. */
+static VALUE
+capture_replay (int argc, VALUE* argv, VALUE self)
+{
+    VALUE           path, conn, speed;
+    RbLmConnection* data;
+    CaptureReplay*  r;
+    FILE*           file;
+    gdouble         speed_val;
+    gchar           magic[RBLM_CAPTURE_MAGIC_LEN];
+    gint            type;
+
+    rb_scan_args (argc, argv, "21", &path, &conn, &speed);
+
+    if (!rb_lm__is_kind_of (conn, lm_cEventedConnection))
+        rb_raise (rb_eTypeError, "not a LM::EventedConnection");
+
+    data = rb_lm_ev_connection_data_from_ruby_object (conn);
+
+    speed_val = NIL_P (speed) ? 1.0 : NUM2DBL (speed);
+    file = capture_open (path, "rb");
+
+    r = g_new0 (CaptureReplay, 1);
+    r->speed = speed_val;
+    r->file = file;
+    r->payload = g_string_new (NULL);
+
+    if (fread (magic, 1, RBLM_CAPTURE_MAGIC_LEN, r->file) != RBLM_CAPTURE_MAGIC_LEN ||
+        memcmp (magic, RBLM_CAPTURE_MAGIC, RBLM_CAPTURE_MAGIC_LEN) != 0)
+    {
+        replay_free (r);
+        rb_raise (rb_eArgError, "%s is not a capture file", RSTRING_PTR (path));
+    }
+
+    if (!replay_read_record (r))
+    {
+        replay_free (r);
+        return Qnil;
+    }
+
+    /* Handlers are resolved now, ones added later do not see the replay and
+     * records for a handler removed meanwhile arrive with a nil target */
+    for (type = 0; type <= LM_MESSAGE_TYPE_UNKNOWN; type++)
+        r->handlers[type] = rb_lm_handler_registry_lookup (data->handlers, (LmMessageType)type);
+
+    r->first_ts = r->ts;
+    r->started = g_get_monotonic_time ();
+
+    rblm_init_sync ();
+    g_idle_add (replay_step, r);
+
+    return Qnil;
+}
+
+void
+Init_lm_capture (VALUE lm_mLM)
+{
+    lm_mCapture = rb_define_module_under (lm_mLM, "Capture");
+
+    rb_define_singleton_method (lm_mCapture, "start", capture_start, 1);
+    rb_define_singleton_method (lm_mCapture, "stop", capture_stop, 0);
+    rb_define_singleton_method (lm_mCapture, "recording?", capture_is_recording, 0);
+    rb_define_singleton_method (lm_mCapture, "replay", capture_replay, -1);
+}
@@ -0,0 +1,35 @@
+/* Capture and replay of inbound stanzas
+ *
+ * While a capture is running every inbound stanza of an evented connection
+ * is appended to a log file from the GLib thread, once, by a handler each
+ * connection registers above LM_HANDLER_PRIORITY_FIRST so that it runs ahead
+ * of anything that could remove the stanza. The log starts with an 8 byte
+ * magic and holds one record per stanza:
+ *
+ *   guint64  arrival time in microseconds, little endian, from the monotonic
+ *            clock so only the gaps between records mean anything
+ *   guint8   LM_CB_MSG, logs of older versions may hold others
+ *   guint32  length of the serialized stanza, little endian
+ *   gchar[]  the stanza as serialized by MessageNode#to_s
+ *
+ * Replay reads a log back on the GLib thread, keeping the original gaps
+ * between records divided by a speed factor, and posts every stanza through
+ * the async queue to each handler block a connection has for its type, in
+ * the order Loudmouth would call them and frozen for frozen handlers, so it
+ * reaches ruby exactly like live traffic does. That makes replay specific
+ * to LM::EventedConnection, LM::Connection does not go through LM::Sink.
+ */
+
+#ifndef _RBLM_CAPTURE_H
+#define	_RBLM_CAPTURE_H
+
+#include "rblm.h"
+#include "rblm-callback.h"
+
+#define RBLM_CAPTURE_MAGIC     "LMCAP\0\0\1"
+#define RBLM_CAPTURE_MAGIC_LEN 8
+
+/* Registers the capturing handler on a new connection */
+void rblm_capture_attach (LmConnection *conn);
+
+#endif	/* _RBLM_CAPTURE_H */
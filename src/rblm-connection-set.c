@@ -0,0 +1,509 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-synchronizer.h"
+#include "rblm-connection-set.h"
+
+#define DEFAULT_CONCURRENCY 32
+#define DEFAULT_RESOURCE    "loudmouth"
+
+extern VALUE lm_cEventedConnection;
+
+static VALUE lm_cConnectionSet;
+
+typedef struct _RbLmConnectionSet RbLmConnectionSet;
+
+/* One connection of the set, only touched on the GLib thread once started */
+typedef struct {
+    RbLmConnectionSet* set;
+    guint              index;
+    LmConnection*      conn;
+    gchar*             user;
+    gchar*             password;
+    gchar*             resource;
+    guint64            started;
+    guint64            opened;
+    guint              timeout_id;
+    gboolean           done;
+} RbLmConnectJob;
+
+/* Referenced by the ruby object and by every callback Loudmouth or the main
+ * loop holds for a job, so it outlives late callbacks of timed out jobs */
+struct _RbLmConnectionSet {
+    gint            ref_count;
+    RbLmHandler*    handler;      /* result block */
+    VALUE           connections;  /* ruby thread only */
+    RbLmConnectJob* jobs;
+    guint           n_jobs;
+    guint           next;         /* first job not started */
+    guint           active;       /* jobs in flight */
+    guint           concurrency;
+    guint           timeout;      /* per job, in ms, 0 for none */
+    gboolean        filling;
+    gboolean        started;      /* connections referenced */
+    volatile gint   pending;      /* jobs without a result */
+};
+
+static guint64
+set_now (void)
+{
+    return (guint64) g_get_monotonic_time ();
+}
+
+static RbLmConnectionSet*
+set_ref (RbLmConnectionSet* set)
+{
+    g_atomic_int_inc (&set->ref_count);
+    return set;
+}
+
+static void
+set_unref (RbLmConnectionSet* set)
+{
+    guint i;
+
+    if (!g_atomic_int_dec_and_test (&set->ref_count))
+        return;
+
+    for (i = 0; i < set->n_jobs; i++)
+    {
+        RbLmConnectJob* job = &set->jobs[i];
+        if (set->started)
+            lm_connection_unref (job->conn);
+        g_free (job->user);
+        g_free (job->password);
+        g_free (job->resource);
+    }
+    rblm_handler_unref (set->handler);
+    g_free (set->jobs);
+    g_free (set);
+}
+
+/* GDestroyNotify for callbacks whose user_data is a job */
+static void
+job_release (gpointer data)
+{
+    set_unref (((RbLmConnectJob*)data)->set);
+}
+
+void
+rblm_connect_result_free (RbLmConnectResult* result)
+{
+    g_free (result->error);
+    g_free (result);
+}
+
+static void set_fill (RbLmConnectionSet* set);
+
+/* Posts the result of job to ruby and lets the next pending job start */
+static void
+job_finish (RbLmConnectJob* job, gboolean success, RbLmConnectStage stage, const gchar* error)
+{
+    RbLmConnectionSet* set = job->set;
+    RbLmConnectResult* result;
+    guint64            now = set_now ();
+
+    if (job->done)
+        return;
+    job->done = TRUE;
+
+    if (job->timeout_id)
+    {
+        g_source_remove (job->timeout_id);
+        job->timeout_id = 0;
+    }
+
+    result = g_new0 (RbLmConnectResult, 1);
+    result->index = job->index;
+    result->success = success;
+    result->stage = stage;
+    result->error = g_strdup (error);
+    if (stage == RBLM_CONNECT_STAGE_OPEN)
+        result->open_usec = now - job->started;
+    else
+    {
+        result->open_usec = job->opened - job->started;
+        result->auth_usec = now - job->opened;
+    }
+
+    set->active--;
+    g_atomic_int_add (&set->pending, -1);
+    notify_ruby_handler (LM_CB_CONNECT, set->handler, result);
+
+    set_fill (set);
+}
+
+static void
+job_auth_cb (LmConnection* conn, gboolean success, gpointer data)
+{
+    job_finish ((RbLmConnectJob*)data, success, RBLM_CONNECT_STAGE_AUTH, NULL);
+}
+
+static void
+job_authenticate (RbLmConnectJob* job)
+{
+    GError* error = NULL;
+
+    job->opened = set_now ();
+
+    /* Loudmouth owns the reference once it has the callback */
+    set_ref (job->set);
+    if (!lm_connection_authenticate (job->conn, job->user, job->password, job->resource,
+                                     job_auth_cb, job, job_release, &error))
+    {
+        job_finish (job, FALSE, RBLM_CONNECT_STAGE_AUTH, error ? error->message : NULL);
+        if (error)
+            g_error_free (error);
+    }
+}
+
+static void
+job_open_cb (LmConnection* conn, gboolean success, gpointer data)
+{
+    RbLmConnectJob* job = data;
+
+    if (job->done)
+        return;
+
+    if (success)
+        job_authenticate (job);
+    else
+        job_finish (job, FALSE, RBLM_CONNECT_STAGE_OPEN, NULL);
+}
+
+static gboolean
+job_timeout (gpointer data)
+{
+    RbLmConnectJob*  job = data;
+    RbLmConnectStage stage = job->opened ? RBLM_CONNECT_STAGE_AUTH : RBLM_CONNECT_STAGE_OPEN;
+
+    job->timeout_id = 0;
+    job_finish (job, FALSE, stage, "timed out");
+    lm_connection_close (job->conn, NULL);
+
+    return FALSE;
+}
+
+static void
+job_start (RbLmConnectJob* job)
+{
+    GError* error = NULL;
+
+    job->started = set_now ();
+
+    if (job->set->timeout)
+        job->timeout_id = g_timeout_add_full (G_PRIORITY_DEFAULT, job->set->timeout,
+                                              job_timeout, job, job_release);
+    if (job->timeout_id)
+        set_ref (job->set);
+
+    /* Connections opened beforehand skip ahead, lm_connection_open would
+     * refuse them without taking the callback */
+    if (lm_connection_is_authenticated (job->conn))
+    {
+        job->opened = job->started;
+        job_finish (job, TRUE, RBLM_CONNECT_STAGE_AUTH, NULL);
+        return;
+    }
+    if (lm_connection_is_open (job->conn))
+    {
+        job_authenticate (job);
+        return;
+    }
+
+    set_ref (job->set);
+    if (!lm_connection_open (job->conn, job_open_cb, job, job_release, &error))
+    {
+        job_finish (job, FALSE, RBLM_CONNECT_STAGE_OPEN, error ? error->message : NULL);
+        if (error)
+            g_error_free (error);
+    }
+}
+
+/* Starts pending jobs up to the concurrency limit. Jobs failing right away
+ * finish from inside job_start, they only count down active here. */
+static void
+set_fill (RbLmConnectionSet* set)
+{
+    if (set->filling)
+        return;
+
+    set_ref (set);
+    set->filling = TRUE;
+    while (set->active < set->concurrency && set->next < set->n_jobs)
+    {
+        set->active++;
+        job_start (&set->jobs[set->next++]);
+    }
+    set->filling = FALSE;
+    set_unref (set);
+}
+
+/* Runs while the GLib loop is paused */
+static void
+set_start (RbLmConnectionSet* set)
+{
+    guint i;
+
+    for (i = 0; i < set->n_jobs; i++)
+        lm_connection_ref (set->jobs[i].conn);
+    set->started = TRUE;
+
+    set_fill (set);
+}
+
+static void
+set_mark (RbLmConnectionSet* set)
+{
+    RBLM_GC_MARK (set->connections);
+    RBLM_GC_MARK (set->handler->block);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+set_compact (RbLmConnectionSet* set)
+{
+    set->connections = RBLM_GC_LOCATION (set->connections);
+    set->handler->block = RBLM_GC_LOCATION (set->handler->block);
+}
+#endif
+
+static void
+set_free (RbLmConnectionSet* set)
+{
+    /* Results still queued for ruby find no block from here on */
+    set->handler->block = Qnil;
+    rblm_release_later ((GDestroyNotify) set_unref, set);
+}
+
+static size_t
+set_memsize (const void* ptr)
+{
+    const RbLmConnectionSet* set = ptr;
+
+    return sizeof (RbLmConnectionSet) + set->n_jobs * sizeof (RbLmConnectJob);
+}
+
+static const rb_data_type_t set_type = {
+    "LM::ConnectionSet",
+    {
+        (RUBY_DATA_FUNC) set_mark,
+        (RUBY_DATA_FUNC) set_free,
+        set_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+        (RUBY_DATA_FUNC) set_compact,
+#endif
+    },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static RbLmConnectionSet*
+rb_lm_connection_set_from_ruby_object (VALUE obj)
+{
+    RbLmConnectionSet* set;
+
+    TypedData_Get_Struct (obj, RbLmConnectionSet, &set_type, set);
+
+    return set;
+}
+
+static gdouble
+usec_to_sec (guint64 usec)
+{
+    return (gdouble)usec / G_USEC_PER_SEC;
+}
+
+VALUE
+rb_lm_connect_result_to_ruby_object (RbLmConnectResult* result)
+{
+    VALUE hash = rb_hash_new ();
+
+    rb_hash_aset (hash, ID2SYM (rb_intern ("index")), UINT2NUM (result->index));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("success")), GBOOL2RVAL (result->success));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("stage")),
+                  ID2SYM (rb_intern (result->stage == RBLM_CONNECT_STAGE_OPEN ? "open" : "auth")));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("error")),
+                  result->error ? rb_str_new2 (result->error) : Qnil);
+    rb_hash_aset (hash, ID2SYM (rb_intern ("open_time")), rb_float_new (usec_to_sec (result->open_usec)));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("auth_time")), rb_float_new (usec_to_sec (result->auth_usec)));
+
+    return hash;
+}
+
+static VALUE
+spec_get (VALUE spec, const char* key)
+{
+    return rb_hash_aref (spec, ID2SYM (rb_intern (key)));
+}
+
+/* Returns the connection for spec, creating and configuring it unless the
+ * spec names one with :connection */
+static VALUE
+spec_connection (VALUE spec)
+{
+    VALUE conn = spec_get (spec, "connection");
+    VALUE value;
+
+    if (NIL_P (conn))
+    {
+        VALUE server = spec_get (spec, "server");
+        conn = rb_class_new_instance (NIL_P (server) ? 0 : 1, &server, lm_cEventedConnection);
+    }
+    else if (!rb_lm__is_kind_of (conn, lm_cEventedConnection))
+        rb_raise (rb_eTypeError, "not a LM::EventedConnection");
+
+    if (!NIL_P (value = spec_get (spec, "jid")))
+        rb_funcall (conn, rb_intern ("jid="), 1, value);
+    if (!NIL_P (value = spec_get (spec, "port")))
+        rb_funcall (conn, rb_intern ("port="), 1, value);
+    if (!NIL_P (value = spec_get (spec, "ssl")))
+        rb_funcall (conn, rb_intern ("ssl="), 1, value);
+    if (!NIL_P (value = spec_get (spec, "proxy")))
+        rb_funcall (conn, rb_intern ("proxy="), 1, value);
+
+    return conn;
+}
+
+/* :user defaults to the node of the jid */
+static gchar*
+spec_user (VALUE spec, VALUE conn)
+{
+    VALUE        user = spec_get (spec, "user");
+    VALUE        jid;
+    const gchar* at;
+
+    if (!NIL_P (user))
+        return g_strdup (StringValueCStr (user));
+
+    jid = spec_get (spec, "jid");
+    if (NIL_P (jid))
+        jid = rb_funcall (conn, rb_intern ("jid"), 0);
+    jid = rb_obj_as_string (jid);
+
+    at = strchr (RSTRING_PTR (jid), '@');
+    if (!at)
+        rb_raise (rb_eArgError, "no :user and no node in jid %s", RSTRING_PTR (jid));
+
+    return g_strndup (RSTRING_PTR (jid), at - RSTRING_PTR (jid));
+}
+
+/* LM::ConnectionSet.connect_all (specs, options = {}) { |result| ... }
+ *
+ * Opens and authenticates an LM::EventedConnection for each spec on the GLib
+ * thread. A spec is a hash with :connection, or :server, :jid, :port, :ssl
+ * and :proxy to create one, plus :user, :password and :resource. Options are
+ * :concurrency, the number of connections in flight (32), and :timeout in
+ * seconds per connection.
+ *
+ * Returns the set right away, the block gets a hash with :index, :success,
+ * :stage, :error, :open_time and :auth_time through LM::Sink as each
+ * connection finishes. */
+static VALUE
+set_connect_all (int argc, VALUE* argv, VALUE klass)
+{
+    VALUE              specs, options, func, self, value;
+    RbLmConnectionSet* set;
+    long               i;
+
+    rb_scan_args (argc, argv, "11&", &specs, &options, &func);
+    Check_Type (specs, T_ARRAY);
+    if (!NIL_P (options))
+        Check_Type (options, T_HASH);
+
+    rblm_init_sync ();
+
+    set = g_new0 (RbLmConnectionSet, 1);
+    set->ref_count = 1;
+    set->handler = rblm_handler_new (func);
+    set->connections = rb_ary_new2 (RARRAY_LEN (specs));
+    set->concurrency = DEFAULT_CONCURRENCY;
+    self = TypedData_Wrap_Struct (klass, &set_type, set);
+
+    if (!NIL_P (options))
+    {
+        if (!NIL_P (value = rb_hash_aref (options, ID2SYM (rb_intern ("concurrency")))))
+            set->concurrency = NUM2UINT (value);
+        if (!NIL_P (value = rb_hash_aref (options, ID2SYM (rb_intern ("timeout")))))
+            set->timeout = (guint)(NUM2DBL (value) * 1000);
+    }
+    if (set->concurrency == 0)
+        rb_raise (rb_eArgError, "concurrency must be positive");
+
+    set->jobs = g_new0 (RbLmConnectJob, RARRAY_LEN (specs));
+    for (i = 0; i < RARRAY_LEN (specs); i++)
+    {
+        RbLmConnectJob* job = &set->jobs[i];
+        VALUE           spec = rb_ary_entry (specs, i);
+        VALUE           conn, password, resource;
+
+        Check_Type (spec, T_HASH);
+        conn = spec_connection (spec);
+        rb_ary_push (set->connections, conn);
+
+        password = spec_get (spec, "password");
+        if (NIL_P (password))
+            rb_raise (rb_eArgError, "no :password in spec %ld", i);
+        StringValueCStr (password);
+        resource = spec_get (spec, "resource");
+        if (!NIL_P (resource))
+            StringValueCStr (resource);
+
+        /* Nothing raises past spec_user, a job is either filled in and
+         * counted in n_jobs or left empty */
+        job->user = spec_user (spec, conn);
+        job->set = set;
+        job->index = (guint)i;
+        job->password = g_strdup (RSTRING_PTR (password));
+        job->resource = g_strdup (NIL_P (resource) ? DEFAULT_RESOURCE : RSTRING_PTR (resource));
+        job->conn = rb_lm_ev_connection_from_ruby_object (conn);
+        set->n_jobs++;
+    }
+    set->pending = set->n_jobs;
+
+    /* As LM::EventedConnection#authenticate does, so that an enabled
+     * reconnect authenticates again */
+    for (i = 0; i < set->n_jobs; i++)
+        rb_lm_ev_connection_remember_credentials (rb_ary_entry (set->connections, i),
+                                                  set->jobs[i].user,
+                                                  set->jobs[i].password,
+                                                  set->jobs[i].resource);
+
+    LM_CALL (set_start (set));
+
+    return self;
+}
+
+static VALUE
+set_get_connections (VALUE self)
+{
+    return rb_ary_dup (rb_lm_connection_set_from_ruby_object (self)->connections);
+}
+
+static VALUE
+set_get_size (VALUE self)
+{
+    return UINT2NUM (rb_lm_connection_set_from_ruby_object (self)->n_jobs);
+}
+
+/* Connections without a result yet */
+static VALUE
+set_get_pending (VALUE self)
+{
+    RbLmConnectionSet* set = rb_lm_connection_set_from_ruby_object (self);
+
+    return INT2NUM (g_atomic_int_get (&set->pending));
+}
+
+void
+Init_lm_connection_set (VALUE lm_mLM)
+{
+    lm_cConnectionSet = rb_define_class_under (lm_mLM, "ConnectionSet", rb_cObject);
+
+    rb_undef_alloc_func (lm_cConnectionSet);
+
+    rb_define_singleton_method (lm_cConnectionSet, "connect_all", set_connect_all, -1);
+
+    rb_define_method (lm_cConnectionSet, "connections", set_get_connections, 0);
+    rb_define_method (lm_cConnectionSet, "size", set_get_size, 0);
+    rb_define_method (lm_cConnectionSet, "pending", set_get_pending, 0);
+}
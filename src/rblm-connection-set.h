@@ -0,0 +1,34 @@
+/* Bulk open and authentication of evented connections
+ *
+ * LM::ConnectionSet.connect_all hands a list of connections to the GLib
+ * thread, which opens and authenticates them there with a bounded number in
+ * flight: the open callback of a job starts its authentication and every
+ * finished job starts the next pending one. The ruby thread only gets one
+ * LM_CB_CONNECT notification per connection, carrying an RbLmConnectResult
+ * with its outcome and timings.
+ */
+
+#ifndef _RBLM_CONNECTION_SET_H
+#define	_RBLM_CONNECTION_SET_H
+
+#include "rblm.h"
+
+typedef enum {
+    RBLM_CONNECT_STAGE_OPEN,
+    RBLM_CONNECT_STAGE_AUTH
+} RbLmConnectStage;
+
+/* Outcome of one connection, posted to ruby as callback data */
+typedef struct {
+    guint            index;       /* position in the specs */
+    gboolean         success;
+    RbLmConnectStage stage;       /* last stage reached */
+    gchar*           error;       /* or NULL */
+    guint64          open_usec;   /* time spent opening, TLS included */
+    guint64          auth_usec;   /* time spent authenticating */
+} RbLmConnectResult;
+
+void  rblm_connect_result_free             (RbLmConnectResult* result);
+VALUE rb_lm_connect_result_to_ruby_object  (RbLmConnectResult* result);
+
+#endif	/* _RBLM_CONNECTION_SET_H */
@@ -1,27 +1,29 @@
 #include "rblm.h"
 #include "rblm-private.h"
+#include "rblm-frozen-message.h"
 
 VALUE lm_cConnection;
 
-static VALUE Copen_block;
-static VALUE Cauth_block;
-static VALUE Cdisconnect_block;
-static VALUE Chandler_blocks;
-static VALUE Csend_blocks;
-
 VALUE conn_set_server (VALUE self, VALUE server);
-VALUE _do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block);
+VALUE _do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block,
+			   RbLmPriority priority);
 static LmHandlerResult
 msg_handler_cb (LmMessageHandler *handler,
 		LmConnection     *connection,
 		LmMessage        *message,
 		gpointer          user_data);
 
+static LmHandlerResult
+frozen_msg_handler_cb (LmMessageHandler *handler,
+		       LmConnection     *connection,
+		       LmMessage        *message,
+		       gpointer          user_data);
+
 static LmHandlerResult
 msg_handler_for_send_cb (LmMessageHandler *handler,
 		LmConnection     *connection,
 		LmMessage        *message,
-		gpointer         *user_data);
+		gpointer          user_data);
 
 /* -- START of GMainContext hack -- 
  * This is a hack to get the GMainContext from a ruby VALUE, this will break if
@@ -44,30 +46,137 @@ rb_lm_hack_get_main_context_from_rval (VALUE ctx_rval)
 }
 /* -- END of GMainContext hack -- */
 
-LmConnection *
-rb_lm_connection_from_ruby_object (VALUE obj)
+void conn_free (RbLmConnection *self);
+
+static void
+conn_mark (RbLmConnection *self)
 {
-	LmConnection *conn;
+	rb_lm_handler_registry_mark (self->handlers);
+	if (self->reconnect) {
+		rb_lm_reconnect_mark (self->reconnect);
+	}
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cConnection)) {
-		rb_raise (rb_eTypeError, "not a LmConnection");
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+conn_compact (RbLmConnection *self)
+{
+	rb_lm_handler_registry_compact (self->handlers);
+	if (self->reconnect) {
+		rb_lm_reconnect_compact (self->reconnect);
 	}
+}
+#endif
 
-	Data_Get_Struct (obj, LmConnection, conn);
+static size_t
+conn_memsize (const void *ptr)
+{
+	const RbLmConnection *self = ptr;
 
-	return conn;
+	return sizeof (RbLmConnection) +
+		rb_lm_handler_registry_memsize (self->handlers);
+}
+
+static const rb_data_type_t conn_type = {
+	"LM::Connection",
+	{
+		(RUBY_DATA_FUNC) conn_mark,
+		(RUBY_DATA_FUNC) conn_free,
+		conn_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+		(RUBY_DATA_FUNC) conn_compact,
+#endif
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static RbLmConnection *
+conn_data_from_ruby_object (VALUE obj)
+{
+	RbLmConnection *data;
+
+	TypedData_Get_Struct (obj, RbLmConnection, &conn_type, data);
+
+	return data;
+}
+
+RbLmConnection *
+rb_lm_connection_data_from_ruby_object (VALUE obj)
+{
+	return conn_data_from_ruby_object (obj);
+}
+
+LmConnection *
+rb_lm_connection_from_ruby_object (VALUE obj)
+{
+	return conn_data_from_ruby_object (obj)->conn;
 }
 
 void
-conn_free (LmConnection *self)
+conn_free (RbLmConnection *self)
 {
-	lm_connection_unref (self);
+	if (self->reconnect) {
+		rblm_reconnect_shutdown (self->reconnect);
+	}
+	rblm_outbound_free (self->outbound);
+	if (self->shaper) {
+		rblm_shaper_free (self->shaper);
+	}
+	if (self->stream_mgmt) {
+		rblm_stream_mgmt_shutdown (self->stream_mgmt);
+	}
+	if (self->roster) {
+		rblm_roster_shutdown (self->roster);
+	}
+	if (self->conn) {
+		rb_lm_handler_registry_unregister (self->handlers, self->conn);
+		lm_connection_unref (self->conn);
+	}
+	if (self->context) {
+		g_main_context_unref (self->context);
+	}
+	if (self->disconnect) {
+		rblm_handler_unref (self->disconnect);
+	}
+
+	rb_lm_handler_registry_free (self->handlers);
+	g_free (self);
 }
 
 VALUE
 conn_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, conn_free, NULL);
+	RbLmConnection *data = g_new0 (RbLmConnection, 1);
+
+	data->handlers = rb_lm_handler_registry_new ();
+	data->outbound = rblm_outbound_new (data);
+
+	return TypedData_Wrap_Struct (klass, &conn_type, data);
+}
+
+/* Opening or closing by hand takes over from a pending reconnect */
+static void
+conn_cancel_reconnect (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (data->reconnect) {
+		rblm_reconnect_cancel (data->reconnect);
+	}
+}
+
+static void
+conn_remember_credentials (VALUE self, VALUE name, VALUE password, VALUE resource)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (data->reconnect) {
+		rblm_reconnect_set_credentials (data->reconnect,
+						StringValuePtr (name),
+						StringValuePtr (password),
+						StringValuePtr (resource));
+	}
 }
 
 VALUE
@@ -76,25 +185,6 @@ conn_initialize (int argc, VALUE *argv, VALUE self)
 	LmConnection *conn;
 	char         *srv_str = NULL;
 	VALUE         server, context;
-	VALUE open_block, auth_block, disconnect_block, handler_blocks, send_blocks;
-
-  /* Initialize some static VALUE's which will point at stuff that will be
-	  accessed repeatedly. */
-	
-	Copen_block = rb_intern("@open_block");
-	Cauth_block = rb_intern("@auth_block");
-	Cdisconnect_block = rb_intern("@disconnect_block");
-	Chandler_blocks = rb_intern("@handler_blocks");
-	Csend_blocks = rb_intern("@send_blocks");
-
-  /* These data structures will track the blocks that are in use so that they
-	  don't get prematurey garbage collected. */
-	
-	rb_ivar_set(self,Copen_block,Qnil);
-	rb_ivar_set(self,Cauth_block,Qnil);
-	rb_ivar_set(self,Cdisconnect_block,Qnil);
-	rb_ivar_set(self,Chandler_blocks,rb_hash_new());
-	rb_ivar_set(self,Csend_blocks,rb_hash_new());
 
 	rb_scan_args (argc, argv, "02", &server, &context);
 
@@ -104,11 +194,12 @@ conn_initialize (int argc, VALUE *argv, VALUE self)
 		ctx = rb_lm_hack_get_main_context_from_rval (context);
 
 		conn = lm_connection_new_with_context (NULL, ctx);
+		conn_data_from_ruby_object (self)->context = g_main_context_ref (ctx);
 	} else {
 		conn = lm_connection_new (NULL);
 	}
 
-	DATA_PTR (self) = conn;
+	conn_data_from_ruby_object (self)->conn = conn;
 
 	if (!NIL_P (server)) {
 		conn_set_server (self, server);
@@ -117,18 +208,23 @@ conn_initialize (int argc, VALUE *argv, VALUE self)
 	return self;
 }
 
+/* Open, auth and disconnect blocks are held by the handler registry, user_data
+ * is the entry */
 static void
 open_callback (LmConnection *conn, gboolean success, gpointer user_data)
 {
-	rb_funcall((VALUE)user_data, rb_intern ("call"), 1,
-		   GBOOL2RVAL (success));
+	VALUE block = ((RbLmHandler *) user_data)->block;
+
+	if (!NIL_P (block)) {
+		rb_funcall (block, rb_intern ("call"), 1, GBOOL2RVAL (success));
+	}
 }
 
 VALUE
 conn_open (int argc, VALUE *argv, VALUE self)
 {
-	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
-	VALUE         func;
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           func;
 
 	rb_scan_args (argc, argv, "0&", &func);
 	if (NIL_P (func)) {
@@ -136,9 +232,12 @@ conn_open (int argc, VALUE *argv, VALUE self)
 		func = rb_block_proc ();
 	}
 
-	rb_ivar_set(self,Copen_block,func);
-	return GBOOL2RVAL (lm_connection_open (conn, open_callback, 
-					       (gpointer) func, NULL, NULL));
+	conn_cancel_reconnect (self);
+
+	return GBOOL2RVAL (lm_connection_open (data->conn, open_callback,
+					       rb_lm_handler_registry_hold (data->handlers, func),
+					       (GDestroyNotify) rblm_handler_unref,
+					       NULL));
 }
 
 VALUE
@@ -146,21 +245,26 @@ conn_close (VALUE self)
 {
 	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
 
+	conn_cancel_reconnect (self);
+
 	return GBOOL2RVAL (lm_connection_close (conn, NULL));
 }
 
 static void
 auth_callback (LmConnection *conn, gboolean success, gpointer user_data)
 {
-	rb_funcall((VALUE)user_data, rb_intern ("call"), 1,
-		   GBOOL2RVAL (success));
+	VALUE block = ((RbLmHandler *) user_data)->block;
+
+	if (!NIL_P (block)) {
+		rb_funcall (block, rb_intern ("call"), 1, GBOOL2RVAL (success));
+	}
 }
 
 VALUE
 conn_auth (int argc, VALUE *argv, VALUE self)
 {
-	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
-	VALUE         name, password, resource, func; 
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           name, password, resource, func;
 
 	rb_scan_args (argc, argv, "21&", &name, &password, &resource, &func);
 	if (NIL_P (func)) {
@@ -168,13 +272,15 @@ conn_auth (int argc, VALUE *argv, VALUE self)
 		func = rb_block_proc ();
 	}
 
-	rb_ivar_set(self,Cauth_block,func);
-	return GBOOL2RVAL (lm_connection_authenticate (conn, 
+	conn_remember_credentials (self, name, password, resource);
+
+	return GBOOL2RVAL (lm_connection_authenticate (data->conn,
 						       StringValuePtr (name),
 						       StringValuePtr (password), 
 						       StringValuePtr (resource),
 						       auth_callback,
-						       (gpointer) func, NULL,
+						       rb_lm_handler_registry_hold (data->handlers, func),
+						       (GDestroyNotify) rblm_handler_unref,
 						       NULL));
 }
 
@@ -186,6 +292,8 @@ conn_auth_and_block (int argc, VALUE *argv, VALUE self)
 
 	rb_scan_args (argc, argv, "21", &name, &password, &resource);
 
+	conn_remember_credentials (self, name, password, resource);
+
 	return GBOOL2RVAL (lm_connection_authenticate_and_block (conn, 
 				StringValuePtr (name),
 				StringValuePtr (password), 
@@ -333,14 +441,36 @@ disconnect_cb (LmConnection       *conn,
 	       LmDisconnectReason  reason, 
 	       gpointer            user_data)
 {
-	rb_funcall((VALUE)user_data, rb_intern ("call"), 1, INT2FIX (reason));
+	VALUE block = ((RbLmHandler *) user_data)->block;
+
+	if (!NIL_P (block)) {
+		rb_funcall (block, rb_intern ("call"), 1, INT2FIX (reason));
+	}
+}
+
+/* The reconnect state owns the disconnect function while enabled */
+static void
+conn_install_disconnect (RbLmConnection *data)
+{
+	RbLmHandler *h = data->disconnect;
+
+	if (data->reconnect) {
+		rblm_reconnect_set_disconnect (data->reconnect,
+					       h ? rblm_handler_ref (h) : NULL);
+		return;
+	}
+
+	lm_connection_set_disconnect_function (data->conn,
+					       h ? disconnect_cb : NULL,
+					       h ? rblm_handler_ref (h) : NULL,
+					       h ? (GDestroyNotify) rblm_handler_unref : NULL);
 }
 
 VALUE
 conn_set_disconnect_handler (int argc, VALUE *argv, VALUE self)
 {
-	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
-	VALUE         func;
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           func;
 
 	rb_scan_args (argc, argv, "0&", &func);
 	if (NIL_P (func)) {
@@ -348,36 +478,453 @@ conn_set_disconnect_handler (int argc, VALUE *argv, VALUE self)
 		func = rb_block_proc ();
 	}
 
-	rb_ivar_set(self,Cdisconnect_block,func);
-	lm_connection_set_disconnect_function (conn, 
-					       disconnect_cb,
-					       (gpointer) func, NULL);
+	if (data->disconnect) {
+		rblm_handler_unref (data->disconnect);
+	}
+	data->disconnect = rb_lm_handler_registry_hold (data->handlers, func);
+	conn_install_disconnect (data);
+
+	return Qnil;
+}
+
+static void
+conn_reconnected (RbLmReconnect *rc, gboolean success)
+{
+	RbLmConnection *data = rc->owner;
+
+	if (success && data->stream_mgmt) {
+		rblm_stream_mgmt_resume (data->stream_mgmt);
+	}
+
+	if (!NIL_P (rc->handler->block)) {
+		rb_funcall (rc->handler->block, rb_intern ("call"), 1,
+			    GBOOL2RVAL (success));
+	}
+}
+
+/* enable_reconnect (options = {}) { |success| ... }
+ *
+ * Reopens and reauthenticates the connection after any disconnect but an
+ * explicit close, waiting initial_delay * multiplier ^ attempt seconds
+ * (capped at max_delay, less up to jitter of it) between attempts. Message
+ * handlers, SSL and proxy stay in place. The block is called with true once
+ * back, or false after max_attempts failed attempts. */
+VALUE
+conn_enable_reconnect (int argc, VALUE *argv, VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	RbLmReconnect  *rc;
+	VALUE           options, func;
+
+	rb_scan_args (argc, argv, "01&", &options, &func);
+
+	rc = rb_lm_reconnect_new (data->conn, data->context, options, func,
+				  disconnect_cb, conn_reconnected);
+	rc->owner = data;
+
+	if (data->reconnect) {
+		rblm_reconnect_shutdown (data->reconnect);
+	}
+	data->reconnect = rc;
+	conn_install_disconnect (data);
+	rblm_reconnect_install (rc);
+
+	return Qnil;
+}
+
+VALUE
+conn_disable_reconnect (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (!data->reconnect) {
+		return Qnil;
+	}
+
+	rblm_reconnect_shutdown (data->reconnect);
+	data->reconnect = NULL;
+	conn_install_disconnect (data);
+
+	return Qnil;
+}
+
+/* Hash of :disconnects, :reconnects, :attempts, :downtime, :last_downtime
+ * and :down, nil unless reconnecting is enabled */
+VALUE
+conn_get_reconnect_stats (VALUE self)
+{
+	RbLmConnection     *data = conn_data_from_ruby_object (self);
+	RbLmReconnectStats  stats;
+
+	if (!data->reconnect) {
+		return Qnil;
+	}
+
+	rblm_reconnect_get_stats (data->reconnect, &stats);
+
+	return rb_lm_reconnect_stats_to_ruby_object (&stats);
+}
+
+/* enable_stream_management (options = {})
+ *
+ * Keeps the last :buffer (256) stanzas sent until the server has
+ * acknowledged them, asking for an acknowledgement every :ack_every (16)
+ * stanzas. Unacknowledged stanzas are sent again after an automatic
+ * reconnect, or on resend_unacked. */
+VALUE
+conn_enable_stream_management (int argc, VALUE *argv, VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           options;
+	guint           buffer, ack_every;
+
+	rb_scan_args (argc, argv, "01", &options);
+
+	rb_lm_stream_mgmt_options (options, &buffer, &ack_every);
+
+	if (data->stream_mgmt) {
+		rblm_stream_mgmt_shutdown (data->stream_mgmt);
+	}
+	data->stream_mgmt = rblm_stream_mgmt_new (data->conn, buffer, ack_every);
+
+	return Qnil;
+}
+
+VALUE
+conn_disable_stream_management (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (data->stream_mgmt) {
+		rblm_stream_mgmt_shutdown (data->stream_mgmt);
+		data->stream_mgmt = NULL;
+	}
+
+	return Qnil;
+}
+
+/* Hash of :sent, :acked, :unacked, :received, :resent and :dropped, nil
+ * unless stream management is enabled */
+VALUE
+conn_get_stream_management_stats (VALUE self)
+{
+	RbLmConnection      *data = conn_data_from_ruby_object (self);
+	RbLmStreamMgmtStats  stats;
+
+	if (!data->stream_mgmt) {
+		return Qnil;
+	}
+
+	rblm_stream_mgmt_get_stats (data->stream_mgmt, &stats);
+
+	return rb_lm_stream_mgmt_stats_to_ruby_object (&stats);
+}
+
+/* Sends every unacknowledged stanza again, returns how many */
+VALUE
+conn_resend_unacked (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (!data->stream_mgmt) {
+		return INT2FIX (0);
+	}
+
+	return UINT2NUM (rblm_stream_mgmt_resume (data->stream_mgmt));
+}
+
+/* enable_rate_limit (options)
+ *
+ * Paces outbound stanzas with token buckets of :bytes_per_sec and
+ * :stanzas_per_sec for the connection and :domain_bytes_per_sec and
+ * :domain_stanzas_per_sec for each destination domain, each holding :burst
+ * (1.0) seconds worth. Stanzas over the limits are queued and sent from the
+ * connection's main loop, send returns right away. */
+VALUE
+conn_enable_rate_limit (VALUE self, VALUE options)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	RbLmShaper     *sh;
+
+	sh = rb_lm_shaper_new (data, data->context, options);
+
+	if (data->shaper) {
+		rblm_shaper_flush (data->shaper);
+	}
+	data->shaper = sh;
+
+	return Qnil;
+}
+
+/* Sends anything still queued right away */
+VALUE
+conn_disable_rate_limit (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	RbLmShaper     *sh = data->shaper;
+
+	if (sh) {
+		data->shaper = NULL;
+		rblm_shaper_flush (sh);
+	}
+
+	return Qnil;
+}
+
+/* Hash of :depth, :max_depth, :domains, :queued, :failed, :delay and
+ * :max_delay, nil unless rate limiting is enabled */
+VALUE
+conn_get_rate_limit_stats (VALUE self)
+{
+	RbLmConnection  *data = conn_data_from_ruby_object (self);
+	RbLmShaperStats  stats;
+
+	if (!data->shaper) {
+		return Qnil;
+	}
+
+	rblm_shaper_get_stats (data->shaper, &stats);
+
+	return rb_lm_shaper_stats_to_ruby_object (&stats);
+}
+
+/* Hash of :sent, :failed, :depth and :max_depth for each of :high, :normal
+ * and :bulk, with the :held and :coalesced presence counts */
+VALUE
+conn_get_outbound_stats (VALUE self)
+{
+	RbLmOutboundStats stats;
+
+	rblm_outbound_get_stats (conn_data_from_ruby_object (self)->outbound, &stats);
+
+	return rb_lm_outbound_stats_to_ruby_object (&stats);
+}
+
+/* enable_presence_coalescing (options = {})
+ *
+ * Holds available and unavailable presences for :window seconds (0.0, the
+ * next main loop iteration) and sends only the latest one to each address.
+ * Subscription and error presences, those carrying anything but show,
+ * status and priority (a MUC join, say) and those sent with :priority =>
+ * :high go out as usual. Anything else sent to an address sends the
+ * presence held for it first. */
+VALUE
+conn_enable_presence_coalescing (int argc, VALUE *argv, VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           options;
+	gdouble         window;
+
+	rb_scan_args (argc, argv, "01", &options);
+
+	window = rb_lm_coalescing_window_from_options (options);
+	rblm_outbound_set_coalescing (data->outbound, TRUE, window);
+
+	return Qnil;
+}
+
+/* Queues whatever presence is still held */
+VALUE
+conn_disable_presence_coalescing (VALUE self)
+{
+	rblm_outbound_set_coalescing (conn_data_from_ruby_object (self)->outbound,
+				      FALSE, 0);
+
+	return Qnil;
+}
+
+/* enable_roster_cache (options = {})
+ *
+ * Keeps the roster and the presence of each contact natively, updated from
+ * roster results, roster pushes and presences before any handler runs.
+ * Roster stanzas from anyone but the server or the account's bare JID are
+ * ignored, and so are presences from MUC occupants. With :consume_presence
+ * => true, available and unavailable presences of roster contacts stop at
+ * the cache and never reach ruby. Request the roster as usual to fill it. */
+VALUE
+conn_enable_roster_cache (int argc, VALUE *argv, VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           options;
+	gboolean        consume = FALSE;
+
+	rb_scan_args (argc, argv, "01", &options);
+
+	if (!NIL_P (options)) {
+		Check_Type (options, T_HASH);
+		consume = RVAL2GBOOL (rb_hash_aref (options,
+						    ID2SYM (rb_intern ("consume_presence"))));
+	}
+
+	if (data->roster) {
+		rblm_roster_shutdown (data->roster);
+	}
+	data->roster = rblm_roster_new (data->conn, consume);
+
+	return Qnil;
 }
 
-/* TODO: Make this function check if an LmMessage or text is passed and use the proper lm_connection_send/lm_connection_send_raw function. */
+VALUE
+conn_disable_roster_cache (VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+
+	if (data->roster) {
+		rblm_roster_shutdown (data->roster);
+		data->roster = NULL;
+	}
+
+	return Qnil;
+}
+
+/* presence_of (jid)
+ *
+ * For a bare JID, a Hash of :jid, :in_roster, :name, :subscription, :ask,
+ * :groups and :resources, the latter mapping each available resource to a
+ * Hash of :show, :status and :priority. For a full JID, that resource's
+ * Hash. nil when nothing is known or the cache isn't enabled. */
+VALUE
+conn_presence_of (VALUE self, VALUE jid)
+{
+	RbLmConnection     *data = conn_data_from_ruby_object (self);
+	RbLmRosterPresence *presence;
+	VALUE               obj;
+
+	if (!data->roster) {
+		return Qnil;
+	}
+
+	presence = rblm_roster_presence_of (data->roster, StringValueCStr (jid));
+	if (!presence) {
+		return Qnil;
+	}
+
+	obj = rb_lm_roster_presence_to_ruby_object (presence);
+	rblm_roster_presence_free (presence);
+
+	return obj;
+}
+
+/* Bare JIDs in the cached roster, nil unless the cache is enabled */
+VALUE
+conn_get_roster (VALUE self)
+{
+	RbLmConnection  *data = conn_data_from_ruby_object (self);
+	gchar          **jids;
+	VALUE            ary;
+
+	if (!data->roster) {
+		return Qnil;
+	}
+
+	jids = rblm_roster_jids (data->roster);
+	ary = rb_lm_roster_jids_to_ruby_object (jids);
+	g_strfreev (jids);
+
+	return ary;
+}
+
+static VALUE
+conn_send_string (VALUE self, VALUE str, RbLmPriority priority)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	GError         *error = NULL;
+	gboolean        res;
+
+	res = rblm_connection_send (data, NULL, NULL, StringValueCStr (str),
+				    priority, &error);
+	if (error) {
+		g_warning ("Could not send raw message: %s\n", error->message);
+		g_error_free (error);
+	}
+
+	return GBOOL2RVAL (res);
+}
+
+/* send_raw (str, options = {}), see send */
+VALUE
+conn_send_raw (int argc, VALUE *argv, VALUE self)
+{
+	VALUE str, options;
+
+	rb_scan_args (argc, argv, "11", &str, &options);
+
+	return conn_send_string (self, str, rb_lm_priority_from_options (options));
+}
+
+/* Sends each String in strs, returns how many went out before a failure */
+VALUE
+conn_send_raw_batch (int argc, VALUE *argv, VALUE self)
+{
+	RbLmConnection *data = conn_data_from_ruby_object (self);
+	VALUE           strs, options;
+	RbLmPriority    priority;
+	GError         *error = NULL;
+	long            i;
+
+	rb_scan_args (argc, argv, "11", &strs, &options);
+
+	Check_Type (strs, T_ARRAY);
+	priority = rb_lm_priority_from_options (options);
+
+	for (i = 0; i < RARRAY_LEN (strs); i++) {
+		VALUE str = rb_ary_entry (strs, i);
+
+		if (!rblm_connection_send (data, NULL, NULL,
+					   StringValueCStr (str), priority,
+					   &error)) {
+			break;
+		}
+	}
+
+	if (error) {
+		g_warning ("Could not send raw message: %s\n", error->message);
+		g_error_free (error);
+	}
+
+	return LONG2NUM (i);
+}
+
+/* send (msg, options = {})
+ *
+ * Sends an LM::Message, or an already serialized stanza when given a String.
+ * options[:priority] is :high for stanzas that must not wait, such as iq
+ * results, :bulk for fan-outs which are queued and fed out from the main
+ * loop a batch at a time, or :normal, the default. Normal stanzas only wait
+ * behind other normal ones or a rate limit backlog, and get four turns for
+ * each bulk one while both wait. */
 VALUE
 conn_send (int argc, VALUE *argv, VALUE self)
 {
-	VALUE msg, block;
+	VALUE        msg, options, block;
+	RbLmPriority priority;
 
-	rb_scan_args(argc, argv, "1&", &msg, &block);
+	rb_scan_args(argc, argv, "11&", &msg, &options, &block);
+	priority = rb_lm_priority_from_options (options);
+
+	if (TYPE (msg) == T_STRING && NIL_P (block)) {
+		return conn_send_string (self, msg, priority);
+	}
 
 	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
 	LmMessage    *m = rb_lm_message_from_ruby_object (msg);
 
 	if (!NIL_P(block)) {
-		return _do_send_with_reply(self,conn,m,block);
+		return _do_send_with_reply(self,conn,m,block,priority);
 	} else {
-		return GBOOL2RVAL (lm_connection_send (conn, m, NULL));
+		return GBOOL2RVAL (rblm_connection_send (conn_data_from_ruby_object (self),
+							 m, NULL, NULL, priority, NULL));
 	}
 }
 
 VALUE
 conn_send_with_reply (int argc, VALUE *argv, VALUE self)
 {
-	VALUE msg, block;
+	VALUE        msg, options, block;
+	RbLmPriority priority;
 
-	rb_scan_args(argc, argv, "1&", &msg, &block);
+	rb_scan_args(argc, argv, "11&", &msg, &options, &block);
+	priority = rb_lm_priority_from_options (options);
 
 	LmConnection *conn = rb_lm_connection_from_ruby_object (self);
 	LmMessage    *m = rb_lm_message_from_ruby_object (msg);
@@ -387,23 +934,21 @@ conn_send_with_reply (int argc, VALUE *argv, VALUE self)
 		block = rb_block_proc ();
 	}
 
-	return _do_send_with_reply(self,conn,m,block);
+	return _do_send_with_reply(self,conn,m,block,priority);
 }
 
 VALUE
-_do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block)
+_do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block,
+		     RbLmPriority priority)
 {
+	RbLmConnection   *data = conn_data_from_ruby_object (self);
 	LmMessageHandler *handler;
-	VALUE *data;
 
-	data = malloc(2*sizeof(VALUE));
-	data[0] = block;
-	data[1] = self;
-
-	rb_hash_aset(rb_ivar_get(self,Csend_blocks),self,block);
-	
-	handler = lm_message_handler_new(msg_handler_for_send_cb, (gpointer) data, NULL);
-	lm_connection_send_with_reply(conn,msg,handler,NULL);
+	handler = lm_message_handler_new (msg_handler_for_send_cb,
+					  rb_lm_handler_registry_hold (data->handlers, block),
+					  (GDestroyNotify) rblm_handler_unref);
+	rblm_connection_send (data, msg, handler, NULL, priority, NULL);
+	lm_message_handler_unref (handler);
 
 	return Qtrue;
 }
@@ -422,8 +967,25 @@ msg_handler_cb (LmMessageHandler *handler,
 		LmMessage        *message,
 		gpointer          user_data)
 {
-	rb_funcall ((VALUE)user_data, rb_intern ("call"), 1, 
-		    LMMESSAGE2RVAL (message));
+	VALUE block = ((RbLmHandler *) user_data)->block;
+
+	rb_funcall (block, rb_intern ("call"), 1, LMMESSAGE2RVAL (message));
+
+	return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+static LmHandlerResult
+frozen_msg_handler_cb (LmMessageHandler *handler,
+		       LmConnection     *connection,
+		       LmMessage        *message,
+		       gpointer          user_data)
+{
+	VALUE              block = ((RbLmHandler *) user_data)->block;
+	RbLmFrozenMessage *fm = rblm_frozen_message_new (message);
+	VALUE              frozen = rb_lm_frozen_message_to_ruby_object (fm);
+
+	rblm_frozen_message_unref (fm);
+	rb_funcall (block, rb_intern ("call"), 1, frozen);
 
 	return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 }
@@ -432,36 +994,58 @@ static LmHandlerResult
 msg_handler_for_send_cb (LmMessageHandler *handler,
 		LmConnection     *connection,
 		LmMessage        *message,
-		gpointer         *user_data)
+		gpointer          user_data)
 {
-	rb_funcall ((VALUE)user_data[0], rb_intern ("call"), 1, 
-		    LMMESSAGE2RVAL (message));
+	VALUE block = ((RbLmHandler *) user_data)->block;
+
+	if (!NIL_P (block)) {
+		rb_funcall (block, rb_intern ("call"), 1, LMMESSAGE2RVAL (message));
+	}
 
 	return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 }
 
+/* Returns an id for remove_message_handler */
 VALUE
 conn_add_msg_handler (int argc, VALUE *argv, VALUE self)
 {
-	LmConnection     *conn = rb_lm_connection_from_ruby_object (self);
-	VALUE             type, func;
-	LmMessageHandler *handler;
+	RbLmConnection   *data = conn_data_from_ruby_object (self);
+	VALUE             type, frozen, func;
+	RbLmHandler      *h;
 
-	rb_scan_args (argc, argv, "1&", &type, &func);
+	rb_scan_args (argc, argv, "11&", &type, &frozen, &func);
 	if (NIL_P (func)) {
 		/* TODO: This is broken; it doesn't do what I think it was thought that it does. */
 		func = rb_block_proc ();
 	}
 
-	handler = lm_message_handler_new (msg_handler_cb, (gpointer) func, NULL);
+	h = rb_lm_handler_registry_add (data->handlers,
+					rb_lm_message_type_from_ruby_object (type),
+					func,
+					RTEST (frozen) ? frozen_msg_handler_cb : msg_handler_cb);
 
-	rb_hash_aset(rb_ivar_get(self,Chandler_blocks),type,func);
-	lm_connection_register_message_handler (conn, handler,
-						rb_lm_message_type_from_ruby_object (type),
+	lm_connection_register_message_handler (data->conn, h->handler, h->type,
 						LM_HANDLER_PRIORITY_NORMAL);
-	lm_message_handler_unref (handler);
+	lm_message_handler_unref (h->handler);
 
-	return Qnil;
+	return UINT2NUM (h->id);
+}
+
+VALUE
+conn_remove_msg_handler (VALUE self, VALUE id)
+{
+	RbLmConnection   *data = conn_data_from_ruby_object (self);
+	RbLmHandler      *h;
+
+	h = rb_lm_handler_registry_remove (data->handlers, NUM2UINT (id));
+	if (!h) {
+		return Qfalse;
+	}
+
+	lm_connection_unregister_message_handler (data->conn, h->handler, h->type);
+	rblm_handler_unref (h);
+
+	return Qtrue;
 }
 
 void
@@ -494,15 +1078,32 @@ Init_lm_connection (VALUE lm_mLM)
 	rb_define_method (lm_cConnection, "proxy=", conn_set_proxy, 1);
 
 	rb_define_method (lm_cConnection, "set_disconnect_handler", conn_set_disconnect_handler, -1);
+	rb_define_method (lm_cConnection, "enable_reconnect", conn_enable_reconnect, -1);
+	rb_define_method (lm_cConnection, "disable_reconnect", conn_disable_reconnect, 0);
+	rb_define_method (lm_cConnection, "reconnect_stats", conn_get_reconnect_stats, 0);
+	rb_define_method (lm_cConnection, "enable_stream_management", conn_enable_stream_management, -1);
+	rb_define_method (lm_cConnection, "disable_stream_management", conn_disable_stream_management, 0);
+	rb_define_method (lm_cConnection, "stream_management_stats", conn_get_stream_management_stats, 0);
+	rb_define_method (lm_cConnection, "resend_unacked", conn_resend_unacked, 0);
+	rb_define_method (lm_cConnection, "enable_rate_limit", conn_enable_rate_limit, 1);
+	rb_define_method (lm_cConnection, "disable_rate_limit", conn_disable_rate_limit, 0);
+	rb_define_method (lm_cConnection, "rate_limit_stats", conn_get_rate_limit_stats, 0);
 
 	/* Use one send message and check if there is a block passed? */
 	rb_define_method (lm_cConnection, "send", conn_send, -1);
 	
 	rb_define_method (lm_cConnection, "send_with_reply", conn_send_with_reply, -1);
-/*
-	rb_define_method (lm_cConnection, "send_raw", conn_send_raw, 1);
-	*/
+	rb_define_method (lm_cConnection, "send_raw", conn_send_raw, -1);
+	rb_define_method (lm_cConnection, "send_raw_batch", conn_send_raw_batch, -1);
+	rb_define_method (lm_cConnection, "outbound_stats", conn_get_outbound_stats, 0);
+	rb_define_method (lm_cConnection, "enable_presence_coalescing", conn_enable_presence_coalescing, -1);
+	rb_define_method (lm_cConnection, "disable_presence_coalescing", conn_disable_presence_coalescing, 0);
+	rb_define_method (lm_cConnection, "enable_roster_cache", conn_enable_roster_cache, -1);
+	rb_define_method (lm_cConnection, "disable_roster_cache", conn_disable_roster_cache, 0);
+	rb_define_method (lm_cConnection, "presence_of", conn_presence_of, 1);
+	rb_define_method (lm_cConnection, "roster", conn_get_roster, 0);
 
 	rb_define_method (lm_cConnection, "state", conn_get_state, 0);
 	rb_define_method (lm_cConnection, "add_message_handler", conn_add_msg_handler, -1);
+	rb_define_method (lm_cConnection, "remove_message_handler", conn_remove_msg_handler, 1);
 }
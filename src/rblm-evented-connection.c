@@ -2,78 +2,167 @@
 #include "rblm-private.h"
 #include "rblm-synchronizer.h"
 #include "rblm-callback.h"
+#include "rblm-capture.h"
 #include <string.h>
 #include <errno.h>
 
 VALUE lm_cEventedConnection;
 
-static VALUE Copen_block;
-static VALUE Cauth_block;
-static VALUE Cdisconnect_block;
-static VALUE Chandler_blocks;
-static VALUE Csend_blocks;
-
 static VALUE Cempty_block;
 
 static VALUE ev_conn_set_server (VALUE self, VALUE server);
-static VALUE _do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block);
+static VALUE _do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block,
+                                  RbLmPriority priority);
 
-LmConnection *
-rb_lm_ev_connection_from_ruby_object (VALUE obj)
+static void ev_conn_free (RbLmConnection *self);
+
+static void
+ev_conn_mark (RbLmConnection *self)
 {
-	LmConnection *conn;
+    rb_lm_handler_registry_mark (self->handlers);
+    if (self->reconnect)
+        rb_lm_reconnect_mark (self->reconnect);
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cEventedConnection)) {
-		rb_raise (rb_eTypeError, "not a LmConnection");
-	}
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+ev_conn_compact (RbLmConnection *self)
+{
+    rb_lm_handler_registry_compact (self->handlers);
+    if (self->reconnect)
+        rb_lm_reconnect_compact (self->reconnect);
+}
+#endif
 
-	Data_Get_Struct (obj, LmConnection, conn);
+static size_t
+ev_conn_memsize (const void *ptr)
+{
+    const RbLmConnection *self = ptr;
+
+    return sizeof (RbLmConnection) +
+           rb_lm_handler_registry_memsize (self->handlers);
+}
+
+static const rb_data_type_t ev_conn_type = {
+	"LM::EventedConnection",
+	{
+		(RUBY_DATA_FUNC) ev_conn_mark,
+		(RUBY_DATA_FUNC) ev_conn_free,
+		ev_conn_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+		(RUBY_DATA_FUNC) ev_conn_compact,
+#endif
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+RbLmConnection *
+rb_lm_ev_connection_data_from_ruby_object (VALUE obj)
+{
+	RbLmConnection *data;
+
+	TypedData_Get_Struct (obj, RbLmConnection, &ev_conn_type, data);
 
-	return conn;
+	return data;
+}
+
+LmConnection *
+rb_lm_ev_connection_from_ruby_object (VALUE obj)
+{
+	return rb_lm_ev_connection_data_from_ruby_object (obj)->conn;
+}
+
+/* Runs on the GLib thread from the release queue */
+static void
+ev_conn_release (RbLmConnection *self)
+{
+    if (self->reconnect)
+        rblm_reconnect_shutdown (self->reconnect);
+    rblm_outbound_free (self->outbound);
+    if (self->shaper)
+        rblm_shaper_free (self->shaper);
+    if (self->stream_mgmt)
+        rblm_stream_mgmt_shutdown (self->stream_mgmt);
+    if (self->roster)
+        rblm_roster_shutdown (self->roster);
+    if (self->conn)
+    {
+        rb_lm_handler_registry_unregister (self->handlers, self->conn);
+        lm_connection_unref (self->conn);
+    }
+    if (self->disconnect)
+        rblm_handler_unref (self->disconnect);
+    rb_lm_handler_registry_free (self->handlers);
+    g_free (self);
 }
 
 static void
-ev_conn_free (LmConnection *self)
+ev_conn_free (RbLmConnection *self)
 {
-    LM_CALL (lm_connection_unref (self));
+    /* Callbacks still queued for ruby find no block from here on */
+    rb_lm_handler_registry_detach (self->handlers);
+    if (self->reconnect)
+        self->reconnect->handler->block = Qnil;
+    rblm_release_later ((GDestroyNotify) ev_conn_release, self);
 }
 
 static VALUE
 ev_conn_allocate (VALUE klass)
 {
+    RbLmConnection *data = g_new0 (RbLmConnection, 1);
+
+    data->handlers = rb_lm_handler_registry_new ();
+    data->outbound = rblm_outbound_new (data);
 
-    return Data_Wrap_Struct (klass, NULL, ev_conn_free, NULL);
+    return TypedData_Wrap_Struct (klass, &ev_conn_type, data);
 }
 
-static VALUE
-ev_conn_initialize (int argc, VALUE *argv, VALUE self)
+/* Opening or closing by hand takes over from a pending reconnect */
+static void
+ev_conn_cancel_reconnect (VALUE self)
 {
-    LmConnection *conn;
-    VALUE         server;
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    if (data->reconnect)
+        LM_CALL (rblm_reconnect_cancel (data->reconnect));
+}
 
-    /* Initialize some static VALUE's which will point at stuff that will be
-       accessed repeatedly. */
+/* Kept for the reconnect state to authenticate again, LM::ConnectionSet
+   authenticates through here too */
+void
+rb_lm_ev_connection_remember_credentials (VALUE        self,
+                                          const gchar *name,
+                                          const gchar *password,
+                                          const gchar *resource)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
 
-    Copen_block       = rb_intern ("@open_block");
-    Cauth_block       = rb_intern ("@auth_block");
-    Cdisconnect_block = rb_intern ("@disconnect_block");
-    Chandler_blocks   = rb_intern ("@handler_blocks");
-    Csend_blocks      = rb_intern ("@send_blocks");
+    if (data->reconnect)
+        LM_CALL (rblm_reconnect_set_credentials (data->reconnect, name, password, resource));
+}
 
-    /* These data structures will track the blocks that are in use so that they
-       don't get prematurey garbage collected. */
+static void
+ev_conn_remember_credentials (VALUE self, VALUE name, VALUE password, VALUE resource)
+{
+    rb_lm_ev_connection_remember_credentials (self,
+                                              StringValuePtr (name),
+                                              StringValuePtr (password),
+                                              StringValuePtr (resource));
+}
 
-    rb_ivar_set (self, Copen_block,       Qnil);
-    rb_ivar_set (self, Cauth_block,       Qnil);
-    rb_ivar_set (self, Cdisconnect_block, Qnil);
-    rb_ivar_set (self, Chandler_blocks,   rb_hash_new());
-    rb_ivar_set (self, Csend_blocks,      rb_hash_new());
+static VALUE
+ev_conn_initialize (int argc, VALUE *argv, VALUE self)
+{
+    LmConnection *conn;
+    VALUE         server;
 
     rb_scan_args (argc, argv, "01", &server);
 
     LM_CALL2 (lm_connection_new_with_context (NULL, g_main_context_default()), conn);
+    LM_CALL (rblm_capture_attach (conn));
 
-    DATA_PTR (self) = conn;
+    rb_lm_ev_connection_data_from_ruby_object (self)->conn = conn;
 
     if (!NIL_P (server)) {
         ev_conn_set_server (self, server);
@@ -82,23 +171,28 @@ ev_conn_initialize (int argc, VALUE *argv, VALUE self)
     return self;
 }
 
+/* Open, auth, disconnect and reply blocks are held by the handler registry,
+   the GLib thread only sees the entries */
 static VALUE
 ev_conn_open (int argc, VALUE *argv, VALUE self)
 {
-    LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
-    VALUE         func;
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           func;
+    RbLmHandler    *h;
 
     rb_scan_args (argc, argv, "0&", &func);
     if (NIL_P (func)) func = Cempty_block; /* Replace current handler with an empty one */
 
-    rb_ivar_set (self, Copen_block, func);
+    ev_conn_cancel_reconnect (self);
+
+    h = rb_lm_handler_registry_hold (data->handlers, func);
     gboolean res;
     GError* error =  NULL;
-    LM_CALL2 (lm_connection_open (conn,
+    LM_CALL2 (lm_connection_open (data->conn,
                                   open_handler,
-                                  (gpointer) func, /* user_data */
-                                  NULL,            /* notify    */
-                                  &error),         /* error     */
+                                  h,                                   /* user_data */
+                                  (GDestroyNotify) rblm_handler_unref, /* notify    */
+                                  &error),                             /* error     */
               res);
     if (error)
     {
@@ -113,6 +207,8 @@ ev_conn_close (VALUE self)
 {
     LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
 
+    ev_conn_cancel_reconnect (self);
+
     gboolean res;
     LM_CALL2 (lm_connection_close (conn, NULL), res);
     return GBOOL2RVAL (res);
@@ -121,23 +217,26 @@ ev_conn_close (VALUE self)
 static VALUE
 ev_conn_auth (int argc, VALUE *argv, VALUE self)
 {
-    LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
-    VALUE         name, password, resource, func;
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           name, password, resource, func;
+    RbLmHandler    *h;
 
     rb_scan_args (argc, argv, "21&", &name, &password, &resource, &func);
     if (NIL_P (func)) func = Cempty_block; /* Replace current handler with an empty one */
 
-    rb_ivar_set(self,Cauth_block,func);
+    ev_conn_remember_credentials (self, name, password, resource);
+
+    h = rb_lm_handler_registry_hold (data->handlers, func);
     gboolean res;
     GError* error = NULL;
-    LM_CALL2 (lm_connection_authenticate (conn,
+    LM_CALL2 (lm_connection_authenticate (data->conn,
                                           StringValuePtr (name),
                                           StringValuePtr (password),
                                           StringValuePtr (resource),
                                           auth_handler,
-                                          (gpointer) func, /* user_data */
-                                          NULL,            /* notify    */
-                                          &error),         /* error     */
+                                          h,                                   /* user_data */
+                                          (GDestroyNotify) rblm_handler_unref, /* notify    */
+                                          &error),                             /* error     */
                res);
     if (error)
     {
@@ -155,6 +254,8 @@ ev_conn_auth_and_block (int argc, VALUE *argv, VALUE self)
 
     rb_scan_args (argc, argv, "21", &name, &password, &resource);
 
+    ev_conn_remember_credentials (self, name, password, resource);
+
     gboolean res;
     GError* error = NULL;
     LM_CALL2 (lm_connection_authenticate_and_block (conn,
@@ -324,40 +425,455 @@ ev_conn_set_proxy (VALUE self, VALUE proxy_rval)
     return Qnil;
 }
 
+/* The reconnect state owns the disconnect function while enabled, call while
+   the GLib loop is paused */
+static void
+ev_conn_install_disconnect (RbLmConnection *data)
+{
+    RbLmHandler *h = data->disconnect;
+
+    if (data->reconnect)
+        rblm_reconnect_set_disconnect (data->reconnect, h ? rblm_handler_ref (h) : NULL);
+    else
+        lm_connection_set_disconnect_function (
+                data->conn,                                      /* connection */
+                h ? disconnect_handler : NULL,                   /* function   */
+                h ? rblm_handler_ref (h) : NULL,                 /* user_data  */
+                h ? (GDestroyNotify) rblm_handler_unref : NULL); /* notify     */
+}
+
 static VALUE
 ev_conn_set_disconnect_handler (int argc, VALUE *argv, VALUE self)
 {
-    LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
-    VALUE         func;
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           func;
+    RbLmHandler    *old = data->disconnect;
 
     rb_scan_args (argc, argv, "0&", &func);
     if (NIL_P (func)) func = Cempty_block; /* Replace current handler with an empty one */
 
-    rb_ivar_set (self, Cdisconnect_block, func);
-    LM_CALL (lm_connection_set_disconnect_function (
-                conn,               /* connection */
-                disconnect_handler, /* function   */
-                (gpointer) func,    /* user_data  */
-                NULL));             /* notify     */
+    data->disconnect = rb_lm_handler_registry_hold (data->handlers, func);
+    LM_CALL (ev_conn_install_disconnect (data));
+    if (old)
+        rblm_handler_unref (old);
+
+    return Qnil;
+}
+
+/* Runs on the GLib thread, the block gets true once back or false when
+   max_attempts ran out */
+static void
+ev_conn_reconnected (RbLmReconnect *rc, gboolean success)
+{
+    RbLmConnection *data = rc->owner;
+
+    if (success && data->stream_mgmt)
+        rblm_stream_mgmt_resume (data->stream_mgmt);
+
+    notify_ruby_handler (LM_CB_CONN_OPEN, rc->handler, GBOOL2GPOINTER (success));
+}
+
+/* Swaps the reconnect state while the GLib loop is paused */
+static void
+ev_conn_set_reconnect (RbLmConnection *data, RbLmReconnect *rc)
+{
+    if (data->reconnect)
+        rblm_reconnect_shutdown (data->reconnect);
+    data->reconnect = rc;
+
+    ev_conn_install_disconnect (data);
+    if (rc)
+        rblm_reconnect_install (rc);
+}
+
+/* enable_reconnect (options = {}) { |success| ... }, see LM::Connection.
+   Attempts run entirely on the GLib thread. */
+static VALUE
+ev_conn_enable_reconnect (int argc, VALUE *argv, VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmReconnect  *rc;
+    VALUE           options, func;
+
+    rb_scan_args (argc, argv, "01&", &options, &func);
+
+    rc = rb_lm_reconnect_new (data->conn, NULL, options, func,
+                              disconnect_handler, ev_conn_reconnected);
+    rc->owner = data;
+
+    LM_CALL (ev_conn_set_reconnect (data, rc));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_disable_reconnect (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    if (!data->reconnect)
+        return Qnil;
+
+    LM_CALL (ev_conn_set_reconnect (data, NULL));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_get_reconnect_stats (VALUE self)
+{
+    RbLmConnection     *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmReconnectStats  stats;
+
+    if (!data->reconnect)
+        return Qnil;
+
+    /* Copied while paused, the Hash is built once the loop runs again */
+    LM_CALL (rblm_reconnect_get_stats (data->reconnect, &stats));
+
+    return rb_lm_reconnect_stats_to_ruby_object (&stats);
+}
+
+/* Swaps the stream management state while the GLib loop is paused */
+static void
+ev_conn_set_stream_mgmt (RbLmConnection *data, guint buffer, guint ack_every)
+{
+    if (data->stream_mgmt)
+        rblm_stream_mgmt_shutdown (data->stream_mgmt);
+    data->stream_mgmt = buffer ? rblm_stream_mgmt_new (data->conn, buffer, ack_every) : NULL;
+}
+
+/* enable_stream_management (options = {}), see LM::Connection */
+static VALUE
+ev_conn_enable_stream_management (int argc, VALUE *argv, VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           options;
+    guint           buffer, ack_every;
+
+    rb_scan_args (argc, argv, "01", &options);
+
+    rb_lm_stream_mgmt_options (options, &buffer, &ack_every);
+
+    LM_CALL (ev_conn_set_stream_mgmt (data, buffer, ack_every));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_disable_stream_management (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    if (data->stream_mgmt)
+        LM_CALL (ev_conn_set_stream_mgmt (data, 0, 0));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_get_stream_management_stats (VALUE self)
+{
+    RbLmConnection      *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmStreamMgmtStats  stats;
+
+    if (!data->stream_mgmt)
+        return Qnil;
+
+    LM_CALL (rblm_stream_mgmt_get_stats (data->stream_mgmt, &stats));
+
+    return rb_lm_stream_mgmt_stats_to_ruby_object (&stats);
+}
+
+static VALUE
+ev_conn_resend_unacked (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    guint           resent;
+
+    if (!data->stream_mgmt)
+        return INT2FIX (0);
+
+    LM_CALL2 (rblm_stream_mgmt_resume (data->stream_mgmt), resent);
+
+    return UINT2NUM (resent);
+}
+
+/* Swaps the shaper while the GLib loop is paused, sending anything still
+   queued on the old one */
+static void
+ev_conn_set_shaper (RbLmConnection *data, RbLmShaper *sh)
+{
+    RbLmShaper *old = data->shaper;
+
+    data->shaper = sh;
+    if (old)
+        rblm_shaper_flush (old);
+}
+
+/* enable_rate_limit (options), see LM::Connection. Queued stanzas are sent
+   from the GLib thread. */
+static VALUE
+ev_conn_enable_rate_limit (VALUE self, VALUE options)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmShaper     *sh = rb_lm_shaper_new (data, NULL, options);
+
+    LM_CALL (ev_conn_set_shaper (data, sh));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_disable_rate_limit (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    if (data->shaper)
+        LM_CALL (ev_conn_set_shaper (data, NULL));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_get_rate_limit_stats (VALUE self)
+{
+    RbLmConnection  *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmShaperStats  stats;
+
+    if (!data->shaper)
+        return Qnil;
+
+    LM_CALL (rblm_shaper_get_stats (data->shaper, &stats));
+
+    return rb_lm_shaper_stats_to_ruby_object (&stats);
+}
+
+static VALUE
+ev_conn_get_outbound_stats (VALUE self)
+{
+    RbLmConnection    *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmOutboundStats  stats;
+
+    LM_CALL (rblm_outbound_get_stats (data->outbound, &stats));
+
+    return rb_lm_outbound_stats_to_ruby_object (&stats);
+}
+
+/* enable_presence_coalescing (options = {}), see LM::Connection */
+static VALUE
+ev_conn_enable_presence_coalescing (int argc, VALUE *argv, VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           options;
+    gdouble         window;
+
+    rb_scan_args (argc, argv, "01", &options);
+
+    window = rb_lm_coalescing_window_from_options (options);
+    LM_CALL (rblm_outbound_set_coalescing (data->outbound, TRUE, window));
+
+    return Qnil;
 }
 
-/* TODO: Make this function check if an LmMessage or text is passed and use the proper lm_connection_send/lm_connection_send_raw function. */
+static VALUE
+ev_conn_disable_presence_coalescing (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    LM_CALL (rblm_outbound_set_coalescing (data->outbound, FALSE, 0));
+
+    return Qnil;
+}
+
+/* Swaps the roster cache while the GLib loop is paused */
+static void
+ev_conn_set_roster (RbLmConnection *data, gboolean enable, gboolean consume)
+{
+    if (data->roster)
+        rblm_roster_shutdown (data->roster);
+    data->roster = enable ? rblm_roster_new (data->conn, consume) : NULL;
+}
+
+/* enable_roster_cache (options = {}), see LM::Connection. The cache is
+   updated on the GLib thread. */
+static VALUE
+ev_conn_enable_roster_cache (int argc, VALUE *argv, VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           options;
+    gboolean        consume = FALSE;
+
+    rb_scan_args (argc, argv, "01", &options);
+
+    if (!NIL_P (options)) {
+        Check_Type (options, T_HASH);
+        consume = RVAL2GBOOL (rb_hash_aref (options,
+                                            ID2SYM (rb_intern ("consume_presence"))));
+    }
+
+    LM_CALL (ev_conn_set_roster (data, TRUE, consume));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_disable_roster_cache (VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+
+    if (data->roster)
+        LM_CALL (ev_conn_set_roster (data, FALSE, FALSE));
+
+    return Qnil;
+}
+
+static VALUE
+ev_conn_presence_of (VALUE self, VALUE jid)
+{
+    RbLmConnection     *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    const gchar        *jid_ptr = StringValueCStr (jid);
+    RbLmRosterPresence *presence;
+    VALUE               obj;
+
+    if (!data->roster)
+        return Qnil;
+
+    /* Only the copy is turned into ruby objects, with the loop running */
+    LM_CALL2 (rblm_roster_presence_of (data->roster, jid_ptr), presence);
+    if (!presence)
+        return Qnil;
+
+    obj = rb_lm_roster_presence_to_ruby_object (presence);
+    rblm_roster_presence_free (presence);
+
+    return obj;
+}
+
+static VALUE
+ev_conn_get_roster (VALUE self)
+{
+    RbLmConnection  *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    gchar          **jids;
+    VALUE            ary;
+
+    if (!data->roster)
+        return Qnil;
+
+    LM_CALL2 (rblm_roster_jids (data->roster), jids);
+    ary = rb_lm_roster_jids_to_ruby_object (jids);
+    g_strfreev (jids);
+
+    return ary;
+}
+
+static VALUE
+ev_conn_send_string (VALUE self, VALUE str, RbLmPriority priority)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    const gchar    *str_ptr = StringValueCStr (str);
+
+    GError* error = NULL;
+    gboolean res;
+    LM_CALL2 (rblm_connection_send (data, NULL, NULL, str_ptr, priority, &error), res);
+    if (error)
+    {
+        g_warning ("Could not send raw message: %s\n", error->message);
+        g_error_free (error);
+    }
+    return GBOOL2RVAL (res);
+}
+
+/* send_raw (str, options = {}), see LM::Connection#send */
+static VALUE
+ev_conn_send_raw (int argc, VALUE *argv, VALUE self)
+{
+    VALUE str, options;
+
+    rb_scan_args (argc, argv, "11", &str, &options);
+
+    return ev_conn_send_string (self, str, rb_lm_priority_from_options (options));
+}
+
+/* Number of stanzas written per pause of the GLib thread */
+#define RAW_BATCH_CHUNK 64
+
+/* Sends each String in strs, pausing GLib once per chunk rather than once per
+ * stanza, returns how many went out before a failure */
+static VALUE
+ev_conn_send_raw_batch (int argc, VALUE *argv, VALUE self)
+{
+    RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE           vals[RAW_BATCH_CHUNK];
+    const gchar    *ptrs[RAW_BATCH_CHUNK];
+    long            n, i, j, sent = 0;
+    gboolean        ok = TRUE;
+    GError*         error = NULL;
+    VALUE           strs, options;
+    RbLmPriority    priority;
+
+    rb_scan_args (argc, argv, "11", &strs, &options);
+
+    Check_Type (strs, T_ARRAY);
+    priority = rb_lm_priority_from_options (options);
+    n = RARRAY_LEN (strs);
+
+    for (i = 0; ok && i < n; i += RAW_BATCH_CHUNK) {
+        long len = MIN (RAW_BATCH_CHUNK, n - i);
+
+        /* Convert the chunk first, nothing may raise while GLib is paused.
+           vals keeps Strings made by to_str alive until they are sent. */
+        for (j = 0; j < len; j++) {
+            vals[j] = rb_ary_entry (strs, i + j);
+            ptrs[j] = StringValueCStr (vals[j]);
+        }
+
+        rb2lm_pause_glib ();
+        for (j = 0; ok && j < len; j++) {
+            ok = rblm_connection_send (data, NULL, NULL, ptrs[j], priority, &error);
+            if (ok)
+                sent++;
+        }
+        rb2lm_resume_glib ();
+
+        for (j = 0; j < len; j++) {
+            RB_GC_GUARD (vals[j]);
+        }
+    }
+
+    if (error)
+    {
+        g_warning ("Could not send raw message: %s\n", error->message);
+        g_error_free (error);
+    }
+    return LONG2NUM (sent);
+}
+
+/* send (msg, options = {}), see LM::Connection. Queued stanzas are fed out
+   from the GLib thread. */
 static VALUE
 ev_conn_send (int argc, VALUE *argv, VALUE self)
 {
-    VALUE msg, block;
+    VALUE        msg, options, block;
+    RbLmPriority priority;
 
-    rb_scan_args(argc, argv, "1&", &msg, &block);
+    rb_scan_args(argc, argv, "11&", &msg, &options, &block);
+    priority = rb_lm_priority_from_options (options);
+
+    if (TYPE (msg) == T_STRING && NIL_P (block)) {
+        return ev_conn_send_string (self, msg, priority);
+    }
 
     LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
     LmMessage    *m = rb_lm_message_from_ruby_object (msg);
 
     if (!NIL_P(block)) {
-        return _do_send_with_reply(self,conn,m,block);
+        return _do_send_with_reply(self,conn,m,block,priority);
     } else {
+        RbLmConnection *data = rb_lm_ev_connection_data_from_ruby_object (self);
         GError* error = NULL;
         gboolean res;
-        LM_CALL2 (lm_connection_send (conn, m, &error), res);
+        LM_CALL2 (rblm_connection_send (data, m, NULL, NULL, priority, &error), res);
         if (error)
         {
             g_warning ("Could not send message: %s\n", strerror (errno));
@@ -370,41 +886,38 @@ ev_conn_send (int argc, VALUE *argv, VALUE self)
 static VALUE
 ev_conn_send_with_reply (int argc, VALUE *argv, VALUE self)
 {
-    VALUE msg, block;
+    VALUE        msg, options, block;
+    RbLmPriority priority;
 
-    rb_scan_args(argc, argv, "1&", &msg, &block);
+    rb_scan_args(argc, argv, "11&", &msg, &options, &block);
+    priority = rb_lm_priority_from_options (options);
 
     LmConnection *conn = rb_lm_ev_connection_from_ruby_object (self);
     LmMessage    *m = rb_lm_message_from_ruby_object (msg);
 
     if (NIL_P (block)) block = Cempty_block; /* Replace current handler with an empty one */
 
-    return _do_send_with_reply(self,conn,m,block);
+    return _do_send_with_reply(self,conn,m,block,priority);
 }
 
 static VALUE
-_do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block)
+_do_send_with_reply (VALUE self, LmConnection *conn, LmMessage *msg, VALUE block,
+                     RbLmPriority priority)
 {
+    RbLmConnection   *data = rb_lm_ev_connection_data_from_ruby_object (self);
     LmMessageHandler *handler;
-    VALUE *data;
-
-    data = malloc(2*sizeof(VALUE));
-    data[0] = block;
-    data[1] = self;
-
-    rb_hash_aset (rb_ivar_get (self, Csend_blocks), self,block);
+    RbLmHandler      *h;
 
+    h = rb_lm_handler_registry_hold (data->handlers, block);
     LM_CALL2 (lm_message_handler_new (
-                   (LmHandleMessageFunction)reply_handler,   /* function  */
-                                            (gpointer) data, /* user_data */
-                                            NULL),           /* notify    */
+                   reply_handler,                                 /* function  */
+                   h,                                             /* user_data */
+                   (GDestroyNotify) rblm_handler_unref),          /* notify    */
               handler);
 
     GError* error = NULL;
-    LM_CALL (lm_connection_send_with_reply (conn,     /* connection */
-                                            msg,      /* message    */
-                                            handler,  /* handler    */
-                                            &error)); /* error      */
+    LM_CALL (rblm_connection_send (data, msg, handler, NULL, priority, &error));
+    LM_CALL (lm_message_handler_unref (handler));
     if (error)
     {
         g_warning ("Could not send message: %s\n", strerror (errno));
@@ -424,32 +937,50 @@ ev_conn_get_state (VALUE self)
     return INT2FIX (state);
 }
 
+/* Returns an id for remove_message_handler */
 static VALUE
 ev_conn_add_msg_handler (int argc, VALUE *argv, VALUE self)
 {
-    LmConnection     *conn = rb_lm_ev_connection_from_ruby_object (self);
-    VALUE             type, func;
-    LmMessageHandler *handler;
+    RbLmConnection   *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    VALUE             type, frozen, func;
+    RbLmHandler      *h;
 
-    rb_scan_args (argc, argv, "1&", &type, &func);
+    rb_scan_args (argc, argv, "11&", &type, &frozen, &func);
     if (NIL_P (func)) func = Cempty_block; /* Replace current handler with an empty one */
 
-    LM_CALL2 (lm_message_handler_new (msg_handler,    /* function  */
-                                      (gpointer)func, /* user_data */
-                                      NULL),          /* notify    */
-              handler);
-
-    rb_hash_aset (rb_ivar_get (self, Chandler_blocks), type, func);
+    /* The GLib thread only ever sees the entry, the block stays with the
+       registry where GC can mark and move it */
+    h = rb_lm_handler_registry_add (data->handlers,
+                                    rb_lm_message_type_from_ruby_object (type),
+                                    func,
+                                    RTEST (frozen) ? frozen_msg_handler : msg_handler);
 
     LM_CALL (lm_connection_register_message_handler (
-                conn,                                       /* connection */
-                handler,                                    /* handler    */
-                rb_lm_message_type_from_ruby_object (type), /* type       */
+                data->conn,                                 /* connection */
+                h->handler,                                 /* handler    */
+                h->type,                                    /* type       */
                 LM_HANDLER_PRIORITY_NORMAL));               /* priority   */
 
-    LM_CALL (lm_message_handler_unref (handler));
+    LM_CALL (lm_message_handler_unref (h->handler));
 
-    return Qnil;
+    return UINT2NUM (h->id);
+}
+
+/* Returns false when no handler has that id. Callbacks already queued for the
+   removed handler come out of LM::Sink with a nil target. */
+static VALUE
+ev_conn_remove_msg_handler (VALUE self, VALUE id)
+{
+    RbLmConnection   *data = rb_lm_ev_connection_data_from_ruby_object (self);
+    RbLmHandler      *h;
+
+    h = rb_lm_handler_registry_remove (data->handlers, NUM2UINT (id));
+    if (!h) return Qfalse;
+
+    LM_CALL (lm_connection_unregister_message_handler (data->conn, h->handler, h->type));
+    rblm_handler_unref (h);
+
+    return Qtrue;
 }
 
 void
@@ -482,17 +1013,34 @@ Init_lm_evented_connection (VALUE lm_mLM)
     rb_define_method (lm_cEventedConnection, "proxy=", ev_conn_set_proxy, 1);
 
     rb_define_method (lm_cEventedConnection, "set_disconnect_handler", ev_conn_set_disconnect_handler, -1);
+    rb_define_method (lm_cEventedConnection, "enable_reconnect", ev_conn_enable_reconnect, -1);
+    rb_define_method (lm_cEventedConnection, "disable_reconnect", ev_conn_disable_reconnect, 0);
+    rb_define_method (lm_cEventedConnection, "reconnect_stats", ev_conn_get_reconnect_stats, 0);
+    rb_define_method (lm_cEventedConnection, "enable_stream_management", ev_conn_enable_stream_management, -1);
+    rb_define_method (lm_cEventedConnection, "disable_stream_management", ev_conn_disable_stream_management, 0);
+    rb_define_method (lm_cEventedConnection, "stream_management_stats", ev_conn_get_stream_management_stats, 0);
+    rb_define_method (lm_cEventedConnection, "resend_unacked", ev_conn_resend_unacked, 0);
+    rb_define_method (lm_cEventedConnection, "enable_rate_limit", ev_conn_enable_rate_limit, 1);
+    rb_define_method (lm_cEventedConnection, "disable_rate_limit", ev_conn_disable_rate_limit, 0);
+    rb_define_method (lm_cEventedConnection, "rate_limit_stats", ev_conn_get_rate_limit_stats, 0);
 
     /* Use one send message and check if there is a block passed? */
     rb_define_method (lm_cEventedConnection, "send", ev_conn_send, -1);
 
     rb_define_method (lm_cEventedConnection, "send_with_reply", ev_conn_send_with_reply, -1);
-/*
-    rb_define_method (lm_cEventedConnection, "send_raw", ev_conn_send_raw, 1);
-    */
+    rb_define_method (lm_cEventedConnection, "send_raw", ev_conn_send_raw, -1);
+    rb_define_method (lm_cEventedConnection, "send_raw_batch", ev_conn_send_raw_batch, -1);
+    rb_define_method (lm_cEventedConnection, "outbound_stats", ev_conn_get_outbound_stats, 0);
+    rb_define_method (lm_cEventedConnection, "enable_presence_coalescing", ev_conn_enable_presence_coalescing, -1);
+    rb_define_method (lm_cEventedConnection, "disable_presence_coalescing", ev_conn_disable_presence_coalescing, 0);
+    rb_define_method (lm_cEventedConnection, "enable_roster_cache", ev_conn_enable_roster_cache, -1);
+    rb_define_method (lm_cEventedConnection, "disable_roster_cache", ev_conn_disable_roster_cache, 0);
+    rb_define_method (lm_cEventedConnection, "presence_of", ev_conn_presence_of, 1);
+    rb_define_method (lm_cEventedConnection, "roster", ev_conn_get_roster, 0);
 
     rb_define_method (lm_cEventedConnection, "state", ev_conn_get_state, 0);
     rb_define_method (lm_cEventedConnection, "add_message_handler", ev_conn_add_msg_handler, -1);
+    rb_define_method (lm_cEventedConnection, "remove_message_handler", ev_conn_remove_msg_handler, 1);
 
     //Cempty_block = rb_class_new_instance (0, NULL, rb_cProc);
 }
@@ -1,45 +1,87 @@
 #include "rblm.h"
 #include "rblm-private.h"
 #include "rblm-synchronizer.h"
+#include "rblm-ssl-policy.h"
 
 VALUE lm_cEventedSSL;
 
-LmSSL *
-rb_lm_ev_ssl_from_ruby_object (VALUE obj)
+void ev_ssl_free (RbLmSSL *self);
+
+static void
+ev_ssl_mark (RbLmSSL *self)
 {
-	LmSSL *ssl;
+	if (self->block) {
+		RBLM_GC_MARK (self->block->block);
+	}
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cEventedSSL)) {
-		rb_raise (rb_eTypeError, "not a EventedSSL");
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+ev_ssl_compact (RbLmSSL *self)
+{
+	if (self->block) {
+		self->block->block = RBLM_GC_LOCATION (self->block->block);
 	}
+}
+#endif
+
+static const rb_data_type_t ev_ssl_type = {
+	"LM::EventedSSL",
+	{
+		(RUBY_DATA_FUNC) ev_ssl_mark,
+		(RUBY_DATA_FUNC) ev_ssl_free,
+		NULL,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+		(RUBY_DATA_FUNC) ev_ssl_compact,
+#endif
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+LmSSL *
+rb_lm_ev_ssl_from_ruby_object (VALUE obj)
+{
+	RbLmSSL *data;
 
-	Data_Get_Struct (obj, LmSSL, ssl);
+	TypedData_Get_Struct (obj, RbLmSSL, &ev_ssl_type, data);
 
-	return ssl;
+	return data->ssl;
 }
 
+/* SSL callbacks still queued for ruby find no block from here on */
 void
-ev_ssl_free (LmSSL *ssl)
+ev_ssl_free (RbLmSSL *self)
 {
-	LM_CALL (lm_ssl_unref (ssl));
+	if (self->block) {
+		self->block->block = Qnil;
+		rblm_handler_unref (self->block);
+	}
+	if (self->ssl) {
+		rblm_release_later ((GDestroyNotify) lm_ssl_unref, self->ssl);
+	}
+	g_free (self);
 }
 
 VALUE
 rb_lm_ev_ssl_to_ruby_object (LmSSL *ssl)
 {
-	if (ssl) {
-		lm_ssl_ref (ssl);
-		return Data_Wrap_Struct (lm_cEventedSSL, NULL,
-					 ev_ssl_free, ssl);
-	} else {
+	RbLmSSL *data;
+
+	if (!ssl) {
 		return Qnil;
 	}
+
+	data = g_new0 (RbLmSSL, 1);
+	data->ssl = lm_ssl_ref (ssl);
+
+	return TypedData_Wrap_Struct (lm_cEventedSSL, &ev_ssl_type, data);
 }
 
 VALUE
 ev_ssl_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, ev_ssl_free, NULL);
+	return TypedData_Wrap_Struct (klass, &ev_ssl_type, g_new0 (RbLmSSL, 1));
 }
 
 static VALUE
@@ -50,19 +92,27 @@ ev_ssl_is_supported (VALUE self)
         return GBOOL2RVAL (res);
 }
 
+/* LM::EventedSSL.new (fingerprint = nil, policy = nil) { |status| ... }
+ *
+ * Takes the same policy as LM::SSL. The handshake runs on the GLib thread
+ * and cannot wait for the block, which is only told about statuses; with a
+ * policy they are decided there and the block only hears about rejections. */
 static VALUE
 ev_ssl_initialize (int argc, VALUE *argv, VALUE self)
 {
-	LmSSL    *ssl;
-	VALUE     fingerprint;
-	VALUE     func;
-	char     *fingerprint_str = NULL;
-	gpointer  func_ptr = NULL;
-
-	rb_scan_args (argc, argv, "01&", &fingerprint, &func);
-
-	if (!NIL_P (func)) {
-		func_ptr = (gpointer) func;
+	RbLmSSL       *data;
+	LmSSL         *ssl;
+	VALUE          fingerprint;
+	VALUE          options;
+	VALUE          func;
+	const char    *fingerprint_str = NULL;
+	RbLmSSLPolicy *policy;
+
+	rb_scan_args (argc, argv, "02&", &fingerprint, &options, &func);
+
+	if (NIL_P (options) && TYPE (fingerprint) == T_HASH) {
+		options = fingerprint;
+		fingerprint = Qnil;
 	}
 
 	if (!NIL_P (fingerprint)) {
@@ -77,13 +127,29 @@ ev_ssl_initialize (int argc, VALUE *argv, VALUE self)
 		fingerprint_str = StringValuePtr (str_val);
 	}
 
+	policy = rb_lm_ssl_policy_from_ruby_object (options, func);
+	if (!fingerprint_str) {
+		fingerprint_str = rblm_ssl_policy_get_expected (policy);
+	}
+
+	/* initialize may be called again on an SSL object */
+	TypedData_Get_Struct (self, RbLmSSL, &ev_ssl_type, data);
+	if (data->block) {
+		data->block->block = Qnil;
+		rblm_handler_unref (data->block);
+	}
+	if (data->ssl) {
+		LM_CALL (lm_ssl_unref (data->ssl));
+	}
+
+	data->block = rblm_handler_ref (policy->handler);
 	LM_CALL2 (lm_ssl_new (fingerprint_str, /* expected_fingerprint */
                           ssl_handler,         /* ssl_function         */
-			  func_ptr,            /* user_data            */
-                          NULL),               /* notify               */
+			  policy,              /* user_data            */
+                          (GDestroyNotify) rblm_ssl_policy_free), /* notify */
                   ssl);
 
-	DATA_PTR (self) = ssl;
+	data->ssl = ssl;
 
 	return self;
 }
@@ -0,0 +1,471 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-frozen-message.h"
+
+VALUE lm_cFrozenMessage;
+
+typedef struct {
+	RbLmFrozenMessage *fm;
+	GHashTable        *offsets;	/* string contents -> offset + 1 */
+	guint32            n_nodes;
+	guint32            n_attrs;
+	guint32            strings_len;
+} FrozenBuild;
+
+static void
+frozen_count_string (FrozenBuild *b, const gchar *str)
+{
+	if (!str || g_hash_table_lookup (b->offsets, str)) {
+		return;
+	}
+
+	g_hash_table_insert (b->offsets, (gpointer) str,
+			     GUINT_TO_POINTER (b->strings_len + 1));
+	b->strings_len += strlen (str) + 1;
+}
+
+static void
+frozen_count (FrozenBuild *b, LmMessageNode *node)
+{
+	LmMessageNode *child;
+	GSList        *l;
+
+	b->n_nodes++;
+	frozen_count_string (b, node->name);
+	frozen_count_string (b, node->value);
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		b->n_attrs++;
+		frozen_count_string (b, kvp->key);
+		frozen_count_string (b, kvp->value);
+	}
+
+	for (child = node->children; child; child = child->next) {
+		frozen_count (b, child);
+	}
+}
+
+static guint32
+frozen_offset (FrozenBuild *b, const gchar *str)
+{
+	if (!str) {
+		return RBLM_FROZEN_NONE;
+	}
+
+	return GPOINTER_TO_UINT (g_hash_table_lookup (b->offsets, str)) - 1;
+}
+
+static void
+frozen_copy_string (gpointer key, gpointer value, gpointer user_data)
+{
+	RbLmFrozenMessage *fm = user_data;
+	const gchar       *str = key;
+
+	memcpy (fm->strings + GPOINTER_TO_UINT (value) - 1, str, strlen (str) + 1);
+}
+
+/* Fills the tables in document order, returns the index given to node */
+static guint32
+frozen_fill (FrozenBuild *b, LmMessageNode *node, guint32 parent)
+{
+	RbLmFrozenMessage *fm = b->fm;
+	guint32            index = b->n_nodes++;
+	RbLmFrozenNode    *fn = &fm->nodes[index];
+	guint32            prev = RBLM_FROZEN_NONE;
+	LmMessageNode     *child;
+	GSList            *l;
+
+	fn->name = frozen_offset (b, node->name);
+	fn->value = frozen_offset (b, node->value);
+	fn->parent = parent;
+	fn->first_child = RBLM_FROZEN_NONE;
+	fn->next_sibling = RBLM_FROZEN_NONE;
+	fn->first_attr = b->n_attrs;
+	fn->n_attrs = 0;
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+		RbLmFrozenAttr   *fa = &fm->attrs[b->n_attrs++];
+
+		fa->key = frozen_offset (b, kvp->key);
+		fa->value = frozen_offset (b, kvp->value);
+		fn->n_attrs++;
+	}
+
+	for (child = node->children; child; child = child->next) {
+		guint32 child_index = frozen_fill (b, child, index);
+
+		if (prev == RBLM_FROZEN_NONE) {
+			fm->nodes[index].first_child = child_index;
+		} else {
+			fm->nodes[prev].next_sibling = child_index;
+		}
+		prev = child_index;
+	}
+
+	return index;
+}
+
+RbLmFrozenMessage *
+rblm_frozen_message_new (LmMessage *m)
+{
+	FrozenBuild        b = { NULL, NULL, 0, 0, 0 };
+	RbLmFrozenMessage *fm;
+	gsize              nodes_size, attrs_size;
+
+	/* Keys point into the message, which outlives the build */
+	b.offsets = g_hash_table_new (g_str_hash, g_str_equal);
+	frozen_count (&b, m->node);
+
+	nodes_size = b.n_nodes * sizeof (RbLmFrozenNode);
+	attrs_size = b.n_attrs * sizeof (RbLmFrozenAttr);
+
+	fm = g_malloc (sizeof (RbLmFrozenMessage) + nodes_size + attrs_size +
+		       b.strings_len);
+	fm->ref_count = 1;
+	fm->type = lm_message_get_type (m);
+	fm->sub_type = lm_message_get_sub_type (m);
+	fm->n_nodes = b.n_nodes;
+	fm->n_attrs = b.n_attrs;
+	fm->strings_len = b.strings_len;
+	fm->nodes = (RbLmFrozenNode *) (fm + 1);
+	fm->attrs = (RbLmFrozenAttr *) ((gchar *) fm->nodes + nodes_size);
+	fm->strings = (gchar *) fm->attrs + attrs_size;
+
+	g_hash_table_foreach (b.offsets, frozen_copy_string, fm);
+
+	b.fm = fm;
+	b.n_nodes = 0;
+	b.n_attrs = 0;
+	frozen_fill (&b, m->node, RBLM_FROZEN_NONE);
+
+	g_hash_table_destroy (b.offsets);
+
+	return fm;
+}
+
+RbLmFrozenMessage *
+rblm_frozen_message_ref (RbLmFrozenMessage *fm)
+{
+	fm->ref_count++;
+
+	return fm;
+}
+
+void
+rblm_frozen_message_unref (RbLmFrozenMessage *fm)
+{
+	if (fm && --fm->ref_count == 0) {
+		g_free (fm);
+	}
+}
+
+gsize
+rblm_frozen_message_memsize (RbLmFrozenMessage *fm)
+{
+	return sizeof (RbLmFrozenMessage) +
+		fm->n_nodes * sizeof (RbLmFrozenNode) +
+		fm->n_attrs * sizeof (RbLmFrozenAttr) +
+		fm->strings_len;
+}
+
+static size_t
+frozen_msg_memsize (const void *fm)
+{
+	return rblm_frozen_message_memsize ((RbLmFrozenMessage *) fm);
+}
+
+/* Each wrapper reports the snapshot to the GC while it holds it */
+static void
+frozen_msg_hold (RbLmFrozenMessage *fm)
+{
+	RBLM_GC_ADJUST_MEMORY (rblm_frozen_message_memsize (fm));
+}
+
+static void
+frozen_msg_free (RbLmFrozenMessage *fm)
+{
+	if (fm) {
+		RBLM_GC_ADJUST_MEMORY (-(gssize) rblm_frozen_message_memsize (fm));
+		rblm_frozen_message_unref (fm);
+	}
+}
+
+static const rb_data_type_t frozen_msg_type = {
+	"LM::FrozenMessage",
+	{
+		NULL,
+		(RUBY_DATA_FUNC) frozen_msg_free,
+		frozen_msg_memsize,
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static RbLmFrozenMessage *
+rb_lm_frozen_message_from_ruby_object (VALUE obj)
+{
+	RbLmFrozenMessage *fm;
+
+	TypedData_Get_Struct (obj, RbLmFrozenMessage, &frozen_msg_type, fm);
+
+	if (!fm) {
+		rb_raise (rb_eArgError, "uninitialized LM::FrozenMessage");
+	}
+
+	return fm;
+}
+
+VALUE
+rb_lm_frozen_message_to_ruby_object (RbLmFrozenMessage *fm)
+{
+	if (fm) {
+		frozen_msg_hold (fm);
+		return TypedData_Wrap_Struct (lm_cFrozenMessage, &frozen_msg_type,
+					      rblm_frozen_message_ref (fm));
+	} else {
+		return Qnil;
+	}
+}
+
+static VALUE
+frozen_msg_allocate (VALUE klass)
+{
+	return TypedData_Wrap_Struct (klass, &frozen_msg_type, NULL);
+}
+
+static VALUE
+frozen_msg_initialize (VALUE self, VALUE msg)
+{
+	LmMessage *m = rb_lm_message_from_ruby_object (msg);
+
+	frozen_msg_free (DATA_PTR (self));
+	DATA_PTR (self) = rblm_frozen_message_new (m);
+	frozen_msg_hold (DATA_PTR (self));
+
+	return self;
+}
+
+/* Node index argument, the root when omitted */
+static RbLmFrozenNode *
+frozen_msg_node_arg (RbLmFrozenMessage *fm, VALUE index)
+{
+	long i = NIL_P (index) ? 0 : NUM2LONG (index);
+
+	if (i < 0 || i >= (long) fm->n_nodes) {
+		rb_raise (rb_eIndexError, "node index %ld out of range", i);
+	}
+
+	return &fm->nodes[i];
+}
+
+static VALUE
+frozen_msg_index_to_ruby (guint32 index)
+{
+	return index == RBLM_FROZEN_NONE ? Qnil : UINT2NUM (index);
+}
+
+/* String at offset in the string table, nil for RBLM_FROZEN_NONE */
+static VALUE
+frozen_msg_string_to_ruby (RbLmFrozenMessage *fm, guint32 offset)
+{
+	return offset == RBLM_FROZEN_NONE ? Qnil : rb_str_new2 (fm->strings + offset);
+}
+
+static VALUE
+frozen_msg_get_type (VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return INT2FIX (fm->type);
+}
+
+static VALUE
+frozen_msg_get_sub_type (VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return INT2FIX (fm->sub_type);
+}
+
+static VALUE
+frozen_msg_get_size (VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return UINT2NUM (fm->n_nodes);
+}
+
+static VALUE
+frozen_msg_get_name (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	VALUE              index;
+
+	rb_scan_args (argc, argv, "01", &index);
+
+	return rb_lm__interned_str (fm->strings +
+				    frozen_msg_node_arg (fm, index)->name);
+}
+
+static VALUE
+frozen_msg_get_value (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	RbLmFrozenNode    *fn;
+	VALUE              index;
+
+	rb_scan_args (argc, argv, "01", &index);
+	fn = frozen_msg_node_arg (fm, index);
+
+	return frozen_msg_string_to_ruby (fm, fn->value);
+}
+
+/* attribute (name) on the root or attribute (index, name) */
+static VALUE
+frozen_msg_get_attribute (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	RbLmFrozenNode    *fn;
+	VALUE              index, name;
+	const gchar       *name_str;
+	guint32            i;
+
+	rb_scan_args (argc, argv, "11", &index, &name);
+	if (argc == 1) {
+		name = index;
+		index = Qnil;
+	}
+
+	fn = frozen_msg_node_arg (fm, index);
+	name_str = StringValueCStr (name);
+
+	for (i = fn->first_attr; i < fn->first_attr + fn->n_attrs; i++) {
+		if (strcmp (fm->strings + fm->attrs[i].key, name_str) == 0) {
+			return frozen_msg_string_to_ruby (fm, fm->attrs[i].value);
+		}
+	}
+
+	return Qnil;
+}
+
+static VALUE
+frozen_msg_get_attributes (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	RbLmFrozenNode    *fn;
+	VALUE              index, attrs;
+	guint32            i;
+
+	rb_scan_args (argc, argv, "01", &index);
+	fn = frozen_msg_node_arg (fm, index);
+
+	attrs = rb_hash_new ();
+	for (i = fn->first_attr; i < fn->first_attr + fn->n_attrs; i++) {
+		rb_hash_aset (attrs,
+			      rb_lm__interned_str (fm->strings + fm->attrs[i].key),
+			      frozen_msg_string_to_ruby (fm, fm->attrs[i].value));
+	}
+
+	return attrs;
+}
+
+static VALUE
+frozen_msg_get_parent (VALUE self, VALUE index)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return frozen_msg_index_to_ruby (frozen_msg_node_arg (fm, index)->parent);
+}
+
+static VALUE
+frozen_msg_get_first_child (VALUE self, VALUE index)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return frozen_msg_index_to_ruby (frozen_msg_node_arg (fm, index)->first_child);
+}
+
+static VALUE
+frozen_msg_get_next_sibling (VALUE self, VALUE index)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+
+	return frozen_msg_index_to_ruby (frozen_msg_node_arg (fm, index)->next_sibling);
+}
+
+/* each_child (index = 0, name = nil) yields the indexes of the children */
+static VALUE
+frozen_msg_each_child (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	VALUE              index, name;
+	const gchar       *name_str = NULL;
+	guint32            i;
+
+	RETURN_ENUMERATOR (self, argc, argv);
+
+	rb_scan_args (argc, argv, "02", &index, &name);
+	if (!NIL_P (name)) {
+		name_str = StringValueCStr (name);
+	}
+
+	for (i = frozen_msg_node_arg (fm, index)->first_child;
+	     i != RBLM_FROZEN_NONE;
+	     i = fm->nodes[i].next_sibling) {
+		if (name_str && strcmp (fm->strings + fm->nodes[i].name, name_str) != 0) {
+			continue;
+		}
+
+		rb_yield (UINT2NUM (i));
+	}
+
+	return self;
+}
+
+/* find (name, from = 0), index of the first element named name at or after
+ * from in document order */
+static VALUE
+frozen_msg_find (int argc, VALUE *argv, VALUE self)
+{
+	RbLmFrozenMessage *fm = rb_lm_frozen_message_from_ruby_object (self);
+	VALUE              name, from;
+	const gchar       *name_str;
+	guint32            i;
+
+	rb_scan_args (argc, argv, "11", &name, &from);
+	name_str = StringValueCStr (name);
+
+	for (i = NIL_P (from) ? 0 : NUM2UINT (from); i < fm->n_nodes; i++) {
+		if (strcmp (fm->strings + fm->nodes[i].name, name_str) == 0) {
+			return UINT2NUM (i);
+		}
+	}
+
+	return Qnil;
+}
+
+extern void
+Init_lm_frozen_message (VALUE lm_mLM)
+{
+	lm_cFrozenMessage = rb_define_class_under (lm_mLM, "FrozenMessage",
+						   rb_cObject);
+
+	rb_define_alloc_func (lm_cFrozenMessage, frozen_msg_allocate);
+
+	rb_define_method (lm_cFrozenMessage, "initialize", frozen_msg_initialize, 1);
+	rb_define_method (lm_cFrozenMessage, "type", frozen_msg_get_type, 0);
+	rb_define_method (lm_cFrozenMessage, "sub_type", frozen_msg_get_sub_type, 0);
+	rb_define_method (lm_cFrozenMessage, "size", frozen_msg_get_size, 0);
+	rb_define_method (lm_cFrozenMessage, "name", frozen_msg_get_name, -1);
+	rb_define_method (lm_cFrozenMessage, "value", frozen_msg_get_value, -1);
+	rb_define_method (lm_cFrozenMessage, "attribute", frozen_msg_get_attribute, -1);
+	rb_define_method (lm_cFrozenMessage, "attributes", frozen_msg_get_attributes, -1);
+	rb_define_method (lm_cFrozenMessage, "parent", frozen_msg_get_parent, 1);
+	rb_define_method (lm_cFrozenMessage, "first_child", frozen_msg_get_first_child, 1);
+	rb_define_method (lm_cFrozenMessage, "next_sibling", frozen_msg_get_next_sibling, 1);
+	rb_define_method (lm_cFrozenMessage, "each_child", frozen_msg_each_child, -1);
+	rb_define_method (lm_cFrozenMessage, "find", frozen_msg_find, -1);
+}
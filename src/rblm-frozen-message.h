@@ -0,0 +1,55 @@
+/*
+ * Immutable flattened copies of inbound messages
+ *
+ * A frozen message is built from an LmMessage in a single allocation holding
+ * the node table, the attribute table and a string table in which every
+ * distinct name and value appears once. Nodes are stored in document order
+ * and refer to each other by index, so walking the tree is a linear scan over
+ * one block of memory. Building one only uses GLib, so it can be done on the
+ * GLib thread before the message is handed over to Ruby.
+ */
+
+#ifndef _RBLM_FROZEN_MESSAGE_H
+#define	_RBLM_FROZEN_MESSAGE_H
+
+#include "rblm.h"
+
+#define RBLM_FROZEN_NONE ((guint32) -1)
+
+typedef struct {
+	guint32 name;		/* offset in the string table */
+	guint32 value;		/* offset in the string table or RBLM_FROZEN_NONE */
+	guint32 parent;		/* node indexes or RBLM_FROZEN_NONE */
+	guint32 first_child;
+	guint32 next_sibling;
+	guint32 first_attr;	/* index in the attribute table */
+	guint32 n_attrs;
+} RbLmFrozenNode;
+
+typedef struct {
+	guint32 key;
+	guint32 value;		/* RBLM_FROZEN_NONE for an attribute without value */
+} RbLmFrozenAttr;
+
+typedef struct {
+	gint              ref_count;
+	LmMessageType     type;
+	LmMessageSubType  sub_type;
+	guint32           n_nodes;
+	guint32           n_attrs;
+	guint32           strings_len;
+	RbLmFrozenNode   *nodes;	/* these point into the same block */
+	RbLmFrozenAttr   *attrs;
+	gchar            *strings;
+} RbLmFrozenMessage;
+
+/* Flatten m, safe to call from the GLib thread */
+RbLmFrozenMessage * rblm_frozen_message_new   (LmMessage         *m);
+RbLmFrozenMessage * rblm_frozen_message_ref   (RbLmFrozenMessage *fm);
+void                rblm_frozen_message_unref (RbLmFrozenMessage *fm);
+gsize               rblm_frozen_message_memsize (RbLmFrozenMessage *fm);
+
+/* Wrap as LM::FrozenMessage, call from the ruby thread */
+VALUE               rb_lm_frozen_message_to_ruby_object (RbLmFrozenMessage *fm);
+
+#endif	/* _RBLM_FROZEN_MESSAGE_H */
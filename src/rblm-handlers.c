@@ -0,0 +1,222 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-handlers.h"
+
+/* Entry outside of any registry, for blocks owned by other objects */
+RbLmHandler *
+rblm_handler_new (VALUE block)
+{
+	RbLmHandler *h = g_new0 (RbLmHandler, 1);
+
+	h->ref_count = 1;
+	h->block = block;
+	h->type = LM_MESSAGE_TYPE_UNKNOWN;
+
+	return h;
+}
+
+RbLmHandler *
+rblm_handler_ref (RbLmHandler *h)
+{
+	g_atomic_int_inc (&h->ref_count);
+
+	return h;
+}
+
+void
+rblm_handler_unref (RbLmHandler *h)
+{
+	if (g_atomic_int_dec_and_test (&h->ref_count)) {
+		g_free (h);
+	}
+}
+
+RbLmHandlerRegistry *
+rb_lm_handler_registry_new (void)
+{
+	RbLmHandlerRegistry *reg = g_new0 (RbLmHandlerRegistry, 1);
+
+	reg->handlers = g_ptr_array_new ();
+	reg->held = g_ptr_array_new ();
+
+	return reg;
+}
+
+/* Drops every block, entries still queued for dispatch then have no target.
+ * Call from the ruby thread before the registry goes away */
+void
+rb_lm_handler_registry_detach (RbLmHandlerRegistry *reg)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i);
+
+		h->block = Qnil;
+	}
+
+	for (i = 0; i < reg->held->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->held, i);
+
+		h->block = Qnil;
+	}
+}
+
+/* Unregisters every handler from conn, in case something else still holds a
+ * reference to the connection once the registry is freed */
+void
+rb_lm_handler_registry_unregister (RbLmHandlerRegistry *reg, LmConnection *conn)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i);
+
+		lm_connection_unregister_message_handler (conn, h->handler, h->type);
+	}
+}
+
+void
+rb_lm_handler_registry_free (RbLmHandlerRegistry *reg)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		rblm_handler_unref (g_ptr_array_index (reg->handlers, i));
+	}
+
+	for (i = 0; i < reg->held->len; i++) {
+		rblm_handler_unref (g_ptr_array_index (reg->held, i));
+	}
+
+	g_ptr_array_free (reg->handlers, TRUE);
+	g_ptr_array_free (reg->held, TRUE);
+	g_free (reg);
+}
+
+void
+rb_lm_handler_registry_mark (RbLmHandlerRegistry *reg)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i);
+
+		RBLM_GC_MARK (h->block);
+	}
+
+	for (i = 0; i < reg->held->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->held, i);
+
+		RBLM_GC_MARK (h->block);
+	}
+}
+
+void
+rb_lm_handler_registry_compact (RbLmHandlerRegistry *reg)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i);
+
+		h->block = RBLM_GC_LOCATION (h->block);
+	}
+
+	for (i = 0; i < reg->held->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->held, i);
+
+		h->block = RBLM_GC_LOCATION (h->block);
+	}
+}
+
+gsize
+rb_lm_handler_registry_memsize (RbLmHandlerRegistry *reg)
+{
+	return sizeof (RbLmHandlerRegistry) +
+		(reg->handlers->len + reg->held->len) *
+		(sizeof (gpointer) + sizeof (RbLmHandler));
+}
+
+RbLmHandler *
+rb_lm_handler_registry_add (RbLmHandlerRegistry     *reg,
+			    LmMessageType            type,
+			    VALUE                    block,
+			    LmHandleMessageFunction  function)
+{
+	RbLmHandler *h = rblm_handler_new (block);
+
+	h->id = ++reg->last_id;
+	h->type = type;
+	h->function = function;
+	h->handler = lm_message_handler_new (function, h, NULL);
+
+	g_ptr_array_add (reg->handlers, h);
+
+	return h;
+}
+
+RbLmHandler *
+rb_lm_handler_registry_remove (RbLmHandlerRegistry *reg, guint id)
+{
+	guint i;
+
+	for (i = 0; i < reg->handlers->len; i++) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i);
+
+		if (h->id == id) {
+			g_ptr_array_remove_index (reg->handlers, i);
+			h->block = Qnil;
+			return h;
+		}
+	}
+
+	return NULL;
+}
+
+GPtrArray *
+rb_lm_handler_registry_lookup (RbLmHandlerRegistry *reg, LmMessageType type)
+{
+	GPtrArray *found = g_ptr_array_new ();
+	guint      i;
+
+	for (i = reg->handlers->len; i > 0; i--) {
+		RbLmHandler *h = g_ptr_array_index (reg->handlers, i - 1);
+
+		if (h->type == type) {
+			g_ptr_array_add (found, rblm_handler_ref (h));
+		}
+	}
+
+	return found;
+}
+
+/* Drops entries only the registry still references, Loudmouth and the queue
+ * of the GLib thread have let go of those and can't take them up again */
+static void
+registry_prune_held (RbLmHandlerRegistry *reg)
+{
+	guint i = 0;
+
+	while (i < reg->held->len) {
+		RbLmHandler *h = g_ptr_array_index (reg->held, i);
+
+		if (g_atomic_int_get (&h->ref_count) == 1) {
+			g_ptr_array_remove_index_fast (reg->held, i);
+			rblm_handler_unref (h);
+		} else {
+			i++;
+		}
+	}
+}
+
+RbLmHandler *
+rb_lm_handler_registry_hold (RbLmHandlerRegistry *reg, VALUE block)
+{
+	RbLmHandler *h = rblm_handler_new (block);
+
+	registry_prune_held (reg);
+	g_ptr_array_add (reg->held, h);
+
+	return rblm_handler_ref (h);
+}
@@ -0,0 +1,71 @@
+/*
+ * Message handler blocks registered on a connection
+ *
+ * Loudmouth only keeps an opaque user_data pointer for every LmMessageHandler,
+ * so each handler gets an RbLmHandler entry holding its block and the entry
+ * is what Loudmouth sees. The connection owns a registry of its entries and
+ * marks and updates their blocks from its own mark and compact functions, so
+ * blocks stay alive exactly while registered and may be moved by GC.compact.
+ * Callbacks queued for the ruby thread reference the entry rather than the
+ * block and read the block when they are dispatched.
+ *
+ * Open, authenticate, disconnect and reply blocks are held the same way. The
+ * registry keeps a reference to each of those entries and hands another to
+ * Loudmouth, which drops it through the destroy notify. Entries nobody else
+ * references any more are pruned when the next one is held.
+ */
+
+#ifndef _RBLM_HANDLERS_H
+#define	_RBLM_HANDLERS_H
+
+#include "rblm.h"
+
+typedef struct {
+	gint              ref_count;	/* registry and queued callbacks */
+	guint             id;
+	VALUE             block;	/* Qnil once removed */
+	LmMessageHandler *handler;	/* owned by the connection */
+	LmHandleMessageFunction function;	/* what handler calls */
+	LmMessageType     type;
+} RbLmHandler;
+
+typedef struct {
+	GPtrArray *handlers;	/* registration order */
+	GPtrArray *held;	/* open, auth, disconnect and reply blocks */
+	guint      last_id;
+} RbLmHandlerRegistry;
+
+/* Entry references, safe from any thread */
+RbLmHandler *         rblm_handler_new   (VALUE block);
+RbLmHandler *         rblm_handler_ref   (RbLmHandler *h);
+void                  rblm_handler_unref (RbLmHandler *h);
+
+RbLmHandlerRegistry * rb_lm_handler_registry_new     (void);
+void                  rb_lm_handler_registry_free    (RbLmHandlerRegistry *reg);
+void                  rb_lm_handler_registry_detach  (RbLmHandlerRegistry *reg);
+void                  rb_lm_handler_registry_unregister (RbLmHandlerRegistry *reg,
+							 LmConnection        *conn);
+void                  rb_lm_handler_registry_mark    (RbLmHandlerRegistry *reg);
+void                  rb_lm_handler_registry_compact (RbLmHandlerRegistry *reg);
+gsize                 rb_lm_handler_registry_memsize (RbLmHandlerRegistry *reg);
+
+/* Creates the entry and its LmMessageHandler, registering it with the
+ * connection is left to the caller */
+RbLmHandler *         rb_lm_handler_registry_add     (RbLmHandlerRegistry     *reg,
+						      LmMessageType            type,
+						      VALUE                    block,
+						      LmHandleMessageFunction  function);
+/* Takes the entry out of the registry, the caller unregisters the handler
+ * and drops the returned reference */
+RbLmHandler *         rb_lm_handler_registry_remove  (RbLmHandlerRegistry     *reg,
+						      guint                    id);
+/* Referenced entries for type in the order Loudmouth calls them, most
+ * recently added first, the caller unrefs them and frees the array */
+GPtrArray *           rb_lm_handler_registry_lookup  (RbLmHandlerRegistry     *reg,
+						      LmMessageType            type);
+/* Entry for a block Loudmouth calls back once or until replaced, referenced
+ * for the caller to pass on with rblm_handler_unref as destroy notify */
+RbLmHandler *         rb_lm_handler_registry_hold    (RbLmHandlerRegistry     *reg,
+						      VALUE                    block);
+
+#endif	/* _RBLM_HANDLERS_H */
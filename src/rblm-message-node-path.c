@@ -0,0 +1,421 @@
+/*
+ * Compact path expressions over LmMessageNode trees
+ *
+ *   query/item             children named item of children named query
+ *   //item                 item elements anywhere below the context node
+ *   item[@subscription]    items having a subscription attribute
+ *   item[@type='chat']     items whose type attribute is 'chat'
+ *   query/item@jid         jid attribute of every item below query
+ *   query/item/@jid        same as query/item@jid, * matches any element
+ *   query//@jid            jid attribute of query and every element below
+ *   //item@jid             jid attribute of every item, not of their children
+ *
+ * A node is returned once even when several branches of the expression
+ * reach it, in the order it was first reached.
+ *
+ * Expressions are compiled once and kept in a small cache keyed by the
+ * expression string, matching then runs over the node tree without touching
+ * Ruby until results are collected.
+ */
+
+#include "rblm.h"
+#include "rblm-private.h"
+
+#define PATH_CACHE_MAX_ENTRIES 256
+
+typedef enum {
+	PATH_AXIS_CHILD,
+	PATH_AXIS_DESCENDANT
+} PathAxis;
+
+typedef struct {
+	gchar *attr;
+	gchar *value;		/* NULL when only presence is tested */
+} PathPredicate;
+
+typedef struct {
+	PathAxis       axis;
+	gchar         *name;	/* NULL matches any element */
+	guint          n_predicates;
+	PathPredicate *predicates;
+} PathStep;
+
+typedef struct {
+	guint     n_steps;
+	PathStep *steps;
+	gchar    *attr;		/* attribute to extract, or NULL for nodes */
+	gboolean  attr_descendant;	/* attr taken from the whole subtree */
+	gboolean  dedupe;	/* more than one descendant axis */
+} NodePath;
+
+typedef struct {
+	NodePath   *path;
+	VALUE       owner;
+	VALUE       results;
+	gboolean    first;
+	gboolean    done;
+	GHashTable *seen;	/* nodes already reached, when path->dedupe */
+} PathMatch;
+
+static GHashTable *path_cache = NULL;
+
+static void
+node_path_free (NodePath *path)
+{
+	guint i, j;
+
+	for (i = 0; i < path->n_steps; i++) {
+		for (j = 0; j < path->steps[i].n_predicates; j++) {
+			g_free (path->steps[i].predicates[j].attr);
+			g_free (path->steps[i].predicates[j].value);
+		}
+		g_free (path->steps[i].predicates);
+		g_free (path->steps[i].name);
+	}
+
+	g_free (path->steps);
+	g_free (path->attr);
+	g_free (path);
+}
+
+static gboolean
+path_is_name_char (gchar c)
+{
+	return (c != '\0' && c != '/' && c != '[' && c != ']' &&
+		c != '@' && c != '=' && c != '\'' && c != '"');
+}
+
+static gchar *
+path_parse_name (const gchar **p)
+{
+	const gchar *start = *p;
+
+	while (path_is_name_char (**p)) {
+		(*p)++;
+	}
+
+	if (*p == start) {
+		return NULL;
+	}
+
+	return g_strndup (start, *p - start);
+}
+
+static gboolean
+path_parse_predicate (const gchar **p, PathPredicate *pred)
+{
+	gchar quote;
+	const gchar *start;
+
+	/* Called with *p on '[' */
+	(*p)++;
+	if (**p != '@') {
+		return FALSE;
+	}
+	(*p)++;
+
+	pred->attr = path_parse_name (p);
+	if (!pred->attr) {
+		return FALSE;
+	}
+
+	if (**p == '=') {
+		(*p)++;
+		quote = **p;
+		if (quote != '\'' && quote != '"') {
+			return FALSE;
+		}
+		(*p)++;
+
+		start = *p;
+		while (**p && **p != quote) {
+			(*p)++;
+		}
+		if (**p != quote) {
+			return FALSE;
+		}
+		pred->value = g_strndup (start, *p - start);
+		(*p)++;
+	}
+
+	if (**p != ']') {
+		return FALSE;
+	}
+	(*p)++;
+
+	return TRUE;
+}
+
+/* Returns NULL if expr is not a valid path expression */
+static NodePath *
+node_path_compile (const gchar *expr)
+{
+	NodePath    *path = g_new0 (NodePath, 1);
+	GArray      *steps = g_array_new (FALSE, TRUE, sizeof (PathStep));
+	const gchar *p = expr;
+	PathAxis     axis = PATH_AXIS_CHILD;
+	gboolean     after_descendant = FALSE;	/* right behind a '//' */
+	gboolean     ok = TRUE;
+	guint        n_descendant = 0;
+	guint        i;
+
+	if (strncmp (p, "//", 2) == 0) {
+		axis = PATH_AXIS_DESCENDANT;
+		after_descendant = TRUE;
+		p += 2;
+	} else if (*p == '/') {
+		p++;
+	}
+
+	while (ok && *p) {
+		PathStep  step = { axis, NULL, 0, NULL };
+		GArray   *preds;
+
+		if (*p == '@') {
+			p++;
+			/* item@jid is the attribute of item itself, only
+			 * item//@jid looks below it */
+			path->attr_descendant = after_descendant;
+			path->attr = path_parse_name (&p);
+			ok = (path->attr != NULL && *p == '\0');
+			break;
+		}
+
+		after_descendant = FALSE;
+
+		if (*p == '.' && (p[1] == '/' || p[1] == '\0')) {
+			/* The context node itself, nothing to match */
+			p++;
+		} else {
+			step.name = path_parse_name (&p);
+			if (!step.name) {
+				ok = FALSE;
+				break;
+			}
+			if (strcmp (step.name, "*") == 0) {
+				g_free (step.name);
+				step.name = NULL;
+			}
+
+			preds = g_array_new (FALSE, TRUE, sizeof (PathPredicate));
+			while (ok && *p == '[') {
+				PathPredicate pred = { NULL, NULL };
+
+				ok = path_parse_predicate (&p, &pred);
+				g_array_append_val (preds, pred);
+			}
+			step.n_predicates = preds->len;
+			step.predicates = (PathPredicate *) g_array_free (preds, FALSE);
+
+			g_array_append_val (steps, step);
+		}
+
+		if (strncmp (p, "//", 2) == 0) {
+			axis = PATH_AXIS_DESCENDANT;
+			after_descendant = TRUE;
+			p += 2;
+			ok = ok && *p != '\0';
+		} else if (*p == '/') {
+			axis = PATH_AXIS_CHILD;
+			p++;
+			ok = ok && *p != '\0';
+		} else if (*p != '@' && *p != '\0') {
+			ok = FALSE;
+		}
+	}
+
+	path->n_steps = steps->len;
+	path->steps = (PathStep *) g_array_free (steps, FALSE);
+
+	for (i = 0; i < path->n_steps; i++) {
+		if (path->steps[i].axis == PATH_AXIS_DESCENDANT) {
+			n_descendant++;
+		}
+	}
+	if (path->attr_descendant) {
+		n_descendant++;
+	}
+	/* Nested matches of one descendant step each walk the subtree below,
+	 * a second descendant step then reaches the same nodes again */
+	path->dedupe = (n_descendant > 1);
+
+	if (!ok) {
+		node_path_free (path);
+		return NULL;
+	}
+
+	return path;
+}
+
+static NodePath *
+node_path_lookup (VALUE expr, gboolean *cached)
+{
+	const gchar *expr_str = StringValueCStr (expr);
+	NodePath    *path;
+
+	if (!path_cache) {
+		path_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    g_free,
+						    (GDestroyNotify) node_path_free);
+	}
+
+	path = g_hash_table_lookup (path_cache, expr_str);
+	if (path) {
+		*cached = TRUE;
+		return path;
+	}
+
+	path = node_path_compile (expr_str);
+	if (!path) {
+		rb_raise (rb_eArgError, "invalid path expression: %s", expr_str);
+	}
+
+	*cached = g_hash_table_size (path_cache) < PATH_CACHE_MAX_ENTRIES;
+	if (*cached) {
+		g_hash_table_insert (path_cache, g_strdup (expr_str), path);
+	}
+
+	return path;
+}
+
+static gboolean
+path_step_matches (PathStep *step, LmMessageNode *node)
+{
+	guint i;
+
+	if (step->name && strcmp (step->name, node->name) != 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < step->n_predicates; i++) {
+		PathPredicate *pred = &step->predicates[i];
+		const gchar   *value;
+
+		value = lm_message_node_get_attribute (node, pred->attr);
+		if (!value) {
+			return FALSE;
+		}
+		if (pred->value && strcmp (pred->value, value) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void path_match_from (PathMatch *match, guint i, LmMessageNode *context);
+
+static void
+path_emit (PathMatch *match, LmMessageNode *node)
+{
+	if (match->path->attr) {
+		const gchar *value;
+
+		value = lm_message_node_get_attribute (node, match->path->attr);
+		if (!value) {
+			return;
+		}
+		rb_ary_push (match->results, rb_str_new2 (value));
+	} else {
+		rb_ary_push (match->results,
+			     LMMESSAGENODE2RVAL_IN (node, match->owner));
+	}
+
+	match->done = match->first;
+}
+
+/* Applies step i to node and, for the descendant axis, to everything below */
+static void
+path_match_node (PathMatch *match, guint i, LmMessageNode *node)
+{
+	PathStep      *step = &match->path->steps[i];
+	LmMessageNode *child;
+
+	if (path_step_matches (step, node)) {
+		path_match_from (match, i + 1, node);
+	}
+
+	if (step->axis == PATH_AXIS_DESCENDANT) {
+		for (child = node->children; child && !match->done; child = child->next) {
+			path_match_node (match, i, child);
+		}
+	}
+}
+
+/* context matched step i - 1, continue with step i on its children */
+static void
+path_match_from (PathMatch *match, guint i, LmMessageNode *context)
+{
+	LmMessageNode *child;
+
+	if (match->done) {
+		return;
+	}
+
+	if (i == match->path->n_steps) {
+		/* A node seen before had its subtree walked already too */
+		if (match->seen) {
+			if (g_hash_table_lookup (match->seen, context)) {
+				return;
+			}
+			g_hash_table_insert (match->seen, context, context);
+		}
+
+		path_emit (match, context);
+
+		if (match->path->attr_descendant) {
+			for (child = context->children; child && !match->done; child = child->next) {
+				path_match_from (match, i, child);
+			}
+		}
+		return;
+	}
+
+	for (child = context->children; child && !match->done; child = child->next) {
+		path_match_node (match, i, child);
+	}
+}
+
+/* Evaluates expr below node. With include_self the first step is matched
+ * against node itself, which is how LM::Message exposes its root element.
+ * Returns an Array, or the first result (or nil) when first is set. */
+VALUE
+rb_lm_message_node_select (LmMessageNode *node,
+			   VALUE          owner,
+			   VALUE          expr,
+			   gboolean       include_self,
+			   gboolean       first)
+{
+	PathMatch match;
+	gboolean  cached;
+
+	match.path = node_path_lookup (expr, &cached);
+	match.owner = owner;
+	match.results = rb_ary_new ();
+	match.first = first;
+	match.done = FALSE;
+	match.seen = NULL;
+
+	if (match.path->dedupe) {
+		match.seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	if (include_self && match.path->n_steps > 0) {
+		path_match_node (&match, 0, node);
+	} else {
+		path_match_from (&match, 0, node);
+	}
+
+	if (match.seen) {
+		g_hash_table_destroy (match.seen);
+	}
+	if (!cached) {
+		node_path_free (match.path);
+	}
+
+	if (first) {
+		return rb_ary_entry (match.results, 0);
+	}
+
+	return match.results;
+}
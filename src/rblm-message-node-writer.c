@@ -0,0 +1,211 @@
+/*
+ * Streams a serialized LmMessageNode tree into an IO
+ *
+ * Output is collected in a fixed size chunk and flushed whenever it fills up,
+ * so memory use does not depend on the size of the stanza. Chunks go straight
+ * to write(2) with the GVL released for an Integer file descriptor, or for an
+ * IO on a regular file without an external encoding. Pipes, sockets and
+ * everything else (StringIO and friends) get them as UTF-8 Strings through
+ * their write method, which knows about non-blocking mode, buffering and
+ * encoding conversion. Those Strings always end on a whole character.
+ */
+
+#include "rblm.h"
+#include "rblm-private.h"
+#include <ruby/encoding.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#define WRITER_CHUNK_SIZE 16384
+
+typedef struct {
+	gchar  chunk[WRITER_CHUNK_SIZE];
+	gsize  len;
+	int    fd;		/* -1 when writing through io */
+	VALUE  io;
+	gsize  total;
+} NodeWriter;
+
+typedef struct {
+	int          fd;
+	const gchar *buf;
+	gsize        len;
+	int          error;
+} WriterFdWrite;
+
+static void *
+writer_fd_write_nogvl (void *data)
+{
+	WriterFdWrite *w = data;
+
+	while (w->len > 0) {
+		ssize_t n = write (w->fd, w->buf, w->len);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* Also EAGAIN, the caller waits for the fd with the GVL */
+			w->error = errno;
+			break;
+		}
+
+		w->buf += n;
+		w->len -= n;
+	}
+
+	return NULL;
+}
+
+/* Length of the leading part of buf that ends on a whole UTF-8 character */
+static gsize
+writer_complete_len (const gchar *buf, gsize len)
+{
+	gsize  start = len;
+	guchar lead;
+	gsize  need;
+
+	/* Back up over continuation bytes to the start of the last character */
+	while (start > 0 && len - start < 4 &&
+	       ((guchar) buf[start - 1] & 0xC0) == 0x80) {
+		start--;
+	}
+
+	if (start == 0) {
+		return len;
+	}
+
+	start--;
+	lead = (guchar) buf[start];
+	need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+
+	/* Invalid input is passed on as it is */
+	if (len - start >= need || start == 0) {
+		return len;
+	}
+
+	return start;
+}
+
+/* Writes out the chunk. Unless last, a character cut off at the end of a full
+ * chunk stays behind for the next one, so that an IO converting encodings
+ * never gets half of it. */
+static void
+writer_flush (NodeWriter *writer, gboolean last)
+{
+	gsize n;
+
+	if (writer->len == 0) {
+		return;
+	}
+
+	n = writer->len;
+
+	if (writer->fd >= 0) {
+		WriterFdWrite w = { writer->fd, writer->chunk, writer->len, 0 };
+
+		while (w.len > 0) {
+			w.error = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+			rb_thread_call_without_gvl (writer_fd_write_nogvl, &w,
+						    RUBY_UBF_IO, NULL);
+#else
+			writer_fd_write_nogvl (&w);
+#endif
+			if (w.error == EAGAIN || w.error == EWOULDBLOCK) {
+				/* Non-blocking fd, the rest goes once it drains */
+				rb_thread_fd_writable (writer->fd);
+			} else if (w.error) {
+				errno = w.error;
+				rb_sys_fail ("write");
+			}
+		}
+	} else {
+		if (!last) {
+			n = writer_complete_len (writer->chunk, writer->len);
+		}
+
+		rb_io_write (writer->io,
+			     rb_enc_str_new (writer->chunk, n,
+					     rb_utf8_encoding ()));
+	}
+
+	writer->total += n;
+	writer->len -= n;
+	memmove (writer->chunk, writer->chunk + n, writer->len);
+}
+
+/* Whether io may be bypassed with write(2) on fd */
+static gboolean
+writer_fd_is_direct (VALUE io, int fd)
+{
+	struct stat st;
+
+	if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+		return FALSE;
+	}
+
+	if (rb_respond_to (io, rb_intern ("external_encoding")) &&
+	    !NIL_P (rb_funcall (io, rb_intern ("external_encoding"), 0))) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+writer_write (gpointer sink, const gchar *str, gsize len)
+{
+	NodeWriter *writer = sink;
+
+	while (len > 0) {
+		gsize n = MIN (len, WRITER_CHUNK_SIZE - writer->len);
+
+		memcpy (writer->chunk + writer->len, str, n);
+		writer->len += n;
+		str += n;
+		len -= n;
+
+		if (writer->len == WRITER_CHUNK_SIZE) {
+			writer_flush (writer, FALSE);
+		}
+	}
+}
+
+/* Writes node to io, an IO, an Integer file descriptor or anything with a
+ * write method. Returns the number of bytes written. */
+VALUE
+rb_lm_message_node_write_to (LmMessageNode *node, VALUE io)
+{
+	NodeWriter writer;
+
+	writer.fd = -1;
+
+	if (FIXNUM_P (io)) {
+		writer.fd = FIX2INT (io);
+	} else if (rb_respond_to (io, rb_intern ("fileno"))) {
+		VALUE fileno = rb_funcall (io, rb_intern ("fileno"), 0);
+
+		/* StringIO has a fileno, it is nil */
+		if (!NIL_P (fileno) && writer_fd_is_direct (io, NUM2INT (fileno))) {
+			/* Anything already buffered in the IO has to go out first */
+			if (rb_respond_to (io, rb_intern ("flush"))) {
+				rb_funcall (io, rb_intern ("flush"), 0);
+			}
+			writer.fd = NUM2INT (fileno);
+		}
+	}
+
+	writer.len = 0;
+	writer.io = io;
+	writer.total = 0;
+
+	rb_lm_message_node_serialize (node, writer_write, &writer);
+	writer_flush (&writer, TRUE);
+
+	return ULONG2NUM (writer.total);
+}
@@ -3,42 +3,258 @@
 
 VALUE lm_cMessageNode;
 
+static ID id_name;
+static ID id_value;
+static ID id_attributes;
+static ID id_children;
+static ID id_depth;
+static ID id_only;
+static ID id_view_owner;
+
+/* Buffers of a node that were replaced while views on it existed. Every
+ * wrapper that handed out a view holds a ref, the views keep their wrapper
+ * alive, so the buffers go once the last of those wrappers is collected.
+ * Mutating the node through any wrapper finds this through node_views. */
+struct _RbLmNodeViews {
+	LmMessageNode *node;
+	guint          ref_count;
+	GSList        *orphans;
+};
+
+static GHashTable *node_views = NULL;
+
+static void   msg_node_mark    (RbLmMessageNode *data);
+static void   msg_node_free    (RbLmMessageNode *data);
+static size_t msg_node_memsize (const RbLmMessageNode *data);
+
+static const rb_data_type_t msg_node_type = {
+	"LM::MessageNode",
+	{
+		(RUBY_DATA_FUNC) msg_node_mark,
+		(RUBY_DATA_FUNC) msg_node_free,
+		(size_t (*) (const void *)) msg_node_memsize,
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static RbLmMessageNode *
+msg_node_data_from_ruby_object (VALUE obj)
+{
+	RbLmMessageNode *data;
+
+	TypedData_Get_Struct (obj, RbLmMessageNode, &msg_node_type, data);
+
+	return data;
+}
+
 LmMessageNode *
 rb_lm_message_node_from_ruby_object (VALUE obj)
 {
-	LmMessageNode *node;
+	return msg_node_data_from_ruby_object (obj)->node;
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cMessageNode)) {
-		rb_raise (rb_eTypeError, "not a LmMessageNode");
+static void
+msg_node_mark (RbLmMessageNode *data)
+{
+	rb_gc_mark (data->owner);
+}
+
+static RbLmNodeViews *
+node_views_ref (LmMessageNode *node)
+{
+	RbLmNodeViews *views;
+
+	if (!node_views) {
+		node_views = g_hash_table_new (g_direct_hash, g_direct_equal);
 	}
 
-	Data_Get_Struct (obj, LmMessageNode, node);
+	views = g_hash_table_lookup (node_views, node);
+	if (!views) {
+		views = g_new0 (RbLmNodeViews, 1);
+		views->node = node;
+		g_hash_table_insert (node_views, node, views);
+	}
+	views->ref_count++;
 
-	return node;
+	return views;
 }
 
-void
-msg_node_free (LmMessageNode *node)
+static void
+node_views_unref (RbLmNodeViews *views)
+{
+	GSList *l;
+
+	if (--views->ref_count > 0) {
+		return;
+	}
+
+	g_hash_table_remove (node_views, views->node);
+
+	for (l = views->orphans; l; l = l->next) {
+		g_free (l->data);
+	}
+	g_slist_free (views->orphans);
+	g_free (views);
+}
+
+static void
+msg_node_free (RbLmMessageNode *data)
 {
-	lm_message_node_unref (node);
+	RBLM_GC_ADJUST_MEMORY (-(gssize) data->tree_size);
+
+	if (data->views) {
+		node_views_unref (data->views);
+	}
+
+	if (data->node) {
+		lm_message_node_unref (data->node);
+	}
+
+	g_free (data);
+}
+
+/* Rough native footprint of node itself, without its children */
+gsize
+rb_lm_message_node_own_memsize (LmMessageNode *node)
+{
+	GSList *l;
+	gsize   size = sizeof (LmMessageNode);
+
+	if (node->name) {
+		size += strlen (node->name) + 1;
+	}
+	if (node->value) {
+		size += strlen (node->value) + 1;
+	}
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		size += sizeof (GSList) + sizeof (RbLmKeyValuePair);
+		if (kvp->key) {
+			size += strlen (kvp->key) + 1;
+		}
+		if (kvp->value) {
+			size += strlen (kvp->value) + 1;
+		}
+	}
+
+	return size;
+}
+
+/* Rough native footprint of node and everything below it */
+gsize
+rb_lm_message_node_memsize (LmMessageNode *node)
+{
+	LmMessageNode *child;
+	gsize          size = rb_lm_message_node_own_memsize (node);
+
+	for (child = node->children; child; child = child->next) {
+		size += rb_lm_message_node_memsize (child);
+	}
+
+	return size;
+}
+
+/* Nodes reached from a message are accounted to it, detached ones carry
+ * their own subtree */
+static size_t
+msg_node_memsize (const RbLmMessageNode *data)
+{
+	return sizeof (RbLmMessageNode) + data->tree_size;
+}
+
+/* Reports delta bytes added to (or removed from) the tree below self, to
+ * the message it belongs to or to self when detached */
+static void
+msg_node_adjust_tree (VALUE self, gssize delta)
+{
+	RbLmMessageNode *data = msg_node_data_from_ruby_object (self);
+
+	if (!NIL_P (data->owner)) {
+		rb_lm_message_adjust_tree (data->owner, delta);
+		return;
+	}
+
+	data->tree_size += delta;
+	RBLM_GC_ADJUST_MEMORY (delta);
+}
+
+static VALUE
+msg_node_wrap (LmMessageNode *node, VALUE owner)
+{
+	RbLmMessageNode *data;
+
+	VALUE            self;
+
+	data = g_new0 (RbLmMessageNode, 1);
+	data->node = lm_message_node_ref (node);
+	data->owner = owner;
+
+	self = TypedData_Wrap_Struct (lm_cMessageNode, &msg_node_type, data);
+	if (NIL_P (owner)) {
+		msg_node_adjust_tree (self, rb_lm_message_node_memsize (node));
+	}
+
+	return self;
 }
 
 VALUE
 rb_lm_message_node_to_ruby_object (LmMessageNode *node)
 {
-	if (node) {
-		lm_message_node_ref (node);
-		return Data_Wrap_Struct (lm_cMessageNode, NULL, 
-					 msg_node_free, node);
-	} else {
+	return rb_lm_message_node_to_ruby_object_in (node, Qnil);
+}
+
+/* Returns the wrapper for node, reusing the one already cached on the
+ * owning LM::Message so that walking the tree allocates nothing after the
+ * first visit */
+VALUE
+rb_lm_message_node_to_ruby_object_in (LmMessageNode *node, VALUE owner)
+{
+	RbLmMessage *msg;
+	VALUE        rval;
+
+	if (!node) {
 		return Qnil;
 	}
+
+	if (NIL_P (owner)) {
+		return msg_node_wrap (node, Qnil);
+	}
+
+	msg = rb_lm_message_data_from_ruby_object (owner);
+	if (!msg->nodes) {
+		msg->nodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	rval = (VALUE) g_hash_table_lookup (msg->nodes, node);
+	if (!rval) {
+		rval = msg_node_wrap (node, owner);
+		g_hash_table_insert (msg->nodes, node, (gpointer) rval);
+	}
+
+	return rval;
+}
+
+/* Wraps a node reached from self, sharing self's wrapper cache */
+static VALUE
+msg_node_related_to_ruby_object (VALUE self, LmMessageNode *node)
+{
+	RbLmMessageNode *data = msg_node_data_from_ruby_object (self);
+
+	return LMMESSAGENODE2RVAL_IN (node, data->owner);
 }
 
 VALUE
 msg_node_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, msg_node_free, NULL);
+	RbLmMessageNode *data;
+
+	data = g_new0 (RbLmMessageNode, 1);
+	data->owner = Qnil;
+
+	return TypedData_Wrap_Struct (klass, &msg_node_type, data);
 }
 
 VALUE
@@ -46,7 +262,7 @@ msg_node_get_name (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	return rb_str_new2 (node->name);
+	return rb_lm__interned_str (node->name);
 }
 
 VALUE
@@ -54,18 +270,80 @@ msg_node_get_value (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	if (lm_message_node_get_value (node)) {
-		return rb_str_new2 (lm_message_node_get_value (node));
+	if (node->value) {
+		return rb_str_new2 (node->value);
 	} 
 
 	return Qnil;
 }
 
+/* Returns a frozen String sharing str's memory instead of copying it.
+ *
+ * The memory belongs to a hidden frozen root String that references self,
+ * which holds a ref on the node and on its RbLmNodeViews. The String handed
+ * out shares the root, and so does anything Ruby derives from it (dup,
+ * slices, byteslice), so the root and self stay alive as long as any of
+ * them. Short strings are copied by Ruby anyway. */
+static VALUE
+msg_node_str_view (VALUE self, const gchar *str)
+{
+#ifdef HAVE_RB_STR_NEW_STATIC
+	RbLmMessageNode *data = msg_node_data_from_ruby_object (self);
+	VALUE            root;
+
+	if (!data->views) {
+		data->views = node_views_ref (data->node);
+	}
+
+	root = rb_str_new_static (str, strlen (str));
+	rb_ivar_set (root, id_view_owner, self);
+	rb_obj_freeze (root);
+
+	return rb_obj_freeze (rb_str_new_shared (root));
+#else
+	return rb_obj_freeze (rb_str_new2 (str));
+#endif
+}
+
+/* Keeps buf alive, instead of letting the node free it, when views on node
+ * may point at it. Works whichever wrapper of node is being mutated. */
+static gboolean
+msg_node_orphan_for_views (LmMessageNode *node, gchar *buf)
+{
+	RbLmNodeViews *views;
+
+	if (!buf || !node_views) {
+		return FALSE;
+	}
+
+	views = g_hash_table_lookup (node_views, node);
+	if (!views) {
+		return FALSE;
+	}
+
+	views->orphans = g_slist_prepend (views->orphans, buf);
+
+	return TRUE;
+}
+
+VALUE
+msg_node_get_value_view (VALUE self)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+
+	if (node->value) {
+		return msg_node_str_view (self, node->value);
+	}
+
+	return Qnil;
+}
+
 VALUE
 msg_node_set_value (VALUE self, VALUE value)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);	
 	char          *value_str = NULL;
+	gsize          before;
 	
 	if (!rb_respond_to (value, rb_intern ("to_s"))) {
 		rb_raise (rb_eArgError, "value should respond to to_s");
@@ -74,7 +352,17 @@ msg_node_set_value (VALUE self, VALUE value)
 		value_str = StringValuePtr (str_val);
 	}
 
+	before = rb_lm_message_node_own_memsize (node);
+
+	if (msg_node_orphan_for_views (node, node->value)) {
+		node->value = NULL;
+	}
+
 	lm_message_node_set_value (node, value_str);
+	msg_node_adjust_tree (self, (gssize) rb_lm_message_node_own_memsize (node) -
+			      (gssize) before);
+
+	return Qnil;
 }
 
 VALUE
@@ -98,21 +386,50 @@ msg_node_add_child (int argc, VALUE *argv, VALUE self)
 
 	child = lm_message_node_add_child (node, StringValuePtr (name),
 					   value_str);
+	msg_node_adjust_tree (self, rb_lm_message_node_own_memsize (child));
 
-	return LMMESSAGENODE2RVAL (child);
+	return msg_node_related_to_ruby_object (self, child);
+}
+
+/* Attributes whose values come from a small fixed vocabulary, these are
+ * returned as shared frozen strings instead of fresh copies */
+static gboolean
+msg_node_attribute_is_enumerated (const gchar *attr)
+{
+	return (strcmp (attr, "type") == 0 || strcmp (attr, "xmlns") == 0);
 }
 
 VALUE
 msg_node_get_attribute (VALUE self, VALUE attr)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	const gchar   *attr_str = StringValueCStr (attr);
+	const gchar   *value;
+
+	value = lm_message_node_get_attribute (node, attr_str);
+	if (!value) {
+		return Qnil;
+	}
 
-	if (lm_message_node_get_attribute (node, StringValuePtr (attr))) {
-	    return rb_str_new2 (lm_message_node_get_attribute (node, 
-							       StringValuePtr (attr)));
+	if (msg_node_attribute_is_enumerated (attr_str)) {
+		return rb_lm__interned_str (value);
 	}
 
-	return Qnil;
+	return rb_str_new2 (value);
+}
+
+VALUE
+msg_node_get_attribute_view (VALUE self, VALUE attr)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	const gchar   *value;
+
+	value = lm_message_node_get_attribute (node, StringValueCStr (attr));
+	if (!value) {
+		return Qnil;
+	}
+
+	return msg_node_str_view (self, value);
 }
 
 VALUE
@@ -120,12 +437,31 @@ msg_node_set_attribute (VALUE self, VALUE attr, VALUE value)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 	char          *value_str = NULL;
+	GSList        *l;
+	gsize          before;
 
 	if (!NIL_P (value)) {
 		value_str = StringValuePtr (value);
 	}
+
+	before = rb_lm_message_node_own_memsize (node);
+
+	/* Loudmouth frees the old value of an existing attribute, detach it
+	 * first if views may point at it */
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		if (strcmp (kvp->key, StringValueCStr (attr)) == 0) {
+			if (msg_node_orphan_for_views (node, kvp->value)) {
+				kvp->value = NULL;
+			}
+			break;
+		}
+	}
 	
 	lm_message_node_set_attribute (node, StringValuePtr (attr), value_str);
+	msg_node_adjust_tree (self, (gssize) rb_lm_message_node_own_memsize (node) -
+			      (gssize) before);
 	 
 	return Qnil;
 }
@@ -138,7 +474,7 @@ msg_node_get_child (VALUE self, VALUE name)
 
 	child = lm_message_node_get_child (node, StringValuePtr (name));
 	
-	return LMMESSAGENODE2RVAL (child);
+	return msg_node_related_to_ruby_object (self, child);
 }
 
 VALUE
@@ -149,7 +485,7 @@ msg_node_find_child (VALUE self, VALUE name)
 
 	child = lm_message_node_find_child (node, StringValuePtr (name));
 
-	return LMMESSAGENODE2RVAL (child);
+	return msg_node_related_to_ruby_object (self, child);
 }
 
 VALUE
@@ -170,12 +506,105 @@ msg_node_set_is_raw_mode (VALUE self, VALUE raw_mode)
 	return Qnil;
 }
 
+#define NODE_WRITE_LITERAL(write, sink, lit) \
+	write (sink, lit, sizeof (lit) - 1)
+
+static void
+node_write_text (const gchar   *text,
+		 gboolean       raw_mode,
+		 RbLmWriteFunc  write,
+		 gpointer       sink)
+{
+	if (raw_mode) {
+		write (sink, text, strlen (text));
+	} else {
+		rb_lm__xml_escape_write (text, strlen (text), write, sink);
+	}
+}
+
+/* Serializes node and everything below it the way lm_message_node_to_string
+ * does, but hands the output to write piece by piece instead of building and
+ * returning a heap string */
+void
+rb_lm_message_node_serialize (LmMessageNode *node,
+			      RbLmWriteFunc  write,
+			      gpointer       sink)
+{
+	LmMessageNode *child;
+	GSList        *l;
+	gsize          name_len = strlen (node->name);
+
+	NODE_WRITE_LITERAL (write, sink, "<");
+	write (sink, node->name, name_len);
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		NODE_WRITE_LITERAL (write, sink, " ");
+		write (sink, kvp->key, strlen (kvp->key));
+		NODE_WRITE_LITERAL (write, sink, "=\"");
+		if (kvp->value) {
+			node_write_text (kvp->value, node->raw_mode, write, sink);
+		}
+		NODE_WRITE_LITERAL (write, sink, "\"");
+	}
+
+	NODE_WRITE_LITERAL (write, sink, ">");
+
+	if (node->value) {
+		node_write_text (node->value, node->raw_mode, write, sink);
+	}
+
+	for (child = node->children; child; child = child->next) {
+		rb_lm_message_node_serialize (child, write, sink);
+	}
+
+	NODE_WRITE_LITERAL (write, sink, "</");
+	write (sink, node->name, name_len);
+	NODE_WRITE_LITERAL (write, sink, ">");
+}
+
+/* Serialized copy of node, for stanzas that are sent after a wait and
+ * shouldn't pick up changes made to the message meanwhile */
+gchar *
+rb_lm_message_node_to_raw (LmMessageNode *node)
+{
+	GString *xml = g_string_sized_new (256);
+
+	rb_lm_message_node_serialize (node, rb_lm__gstring_write, xml);
+
+	return g_string_free (xml, FALSE);
+}
+
+/* to_s (buf = nil), serializes into buf when given so the same String can be
+ * reused across calls */
 VALUE
-msg_node_to_string (VALUE self)
+msg_node_to_string (int argc, VALUE *argv, VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	VALUE          buf;
+
+	rb_scan_args (argc, argv, "01", &buf);
 
-	return rb_str_new2 (lm_message_node_to_string (node));
+	if (NIL_P (buf)) {
+		buf = rb_str_buf_new (256);
+	} else {
+		StringValue (buf);
+		rb_str_modify (buf);
+		rb_str_set_len (buf, 0);
+	}
+
+	rb_lm_message_node_serialize (node, rb_lm__rstring_write, (gpointer) buf);
+
+	return buf;
+}
+
+VALUE
+msg_node_write_to (VALUE self, VALUE io)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+
+	return rb_lm_message_node_write_to (node, io);
 }
 
 VALUE
@@ -183,7 +612,7 @@ msg_node_get_next (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	return LMMESSAGENODE2RVAL (node->next);
+	return msg_node_related_to_ruby_object (self, node->next);
 }
 
 VALUE
@@ -191,7 +620,7 @@ msg_node_get_prev (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	return LMMESSAGENODE2RVAL (node->prev);
+	return msg_node_related_to_ruby_object (self, node->prev);
 }
 
 VALUE
@@ -199,7 +628,7 @@ msg_node_get_parent (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	return LMMESSAGENODE2RVAL (node->parent);
+	return msg_node_related_to_ruby_object (self, node->parent);
 }
 
 VALUE 
@@ -207,7 +636,286 @@ msg_node_get_children (VALUE self)
 {
 	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
 
-	return LMMESSAGENODE2RVAL (node->children);
+	return msg_node_related_to_ruby_object (self, node->children);
+}
+
+VALUE
+msg_node_each_child (int argc, VALUE *argv, VALUE self)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	LmMessageNode *child;
+	VALUE          name;
+	const gchar   *name_str = NULL;
+
+	RETURN_ENUMERATOR (self, argc, argv);
+
+	rb_scan_args (argc, argv, "01", &name);
+
+	if (!NIL_P (name)) {
+		name_str = StringValueCStr (name);
+	}
+
+	for (child = node->children; child; child = child->next) {
+		if (name_str && strcmp (name_str, child->name) != 0) {
+			continue;
+		}
+
+		rb_yield (msg_node_related_to_ruby_object (self, child));
+	}
+
+	return self;
+}
+
+VALUE
+msg_node_each_attribute (VALUE self)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	GSList        *l;
+
+	RETURN_ENUMERATOR (self, 0, 0);
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		rb_yield_values (2, rb_lm__interned_str (kvp->key),
+				 kvp->value ? rb_str_new2 (kvp->value) : Qnil);
+	}
+
+	return self;
+}
+
+static VALUE
+node_attributes_to_hash (LmMessageNode *node)
+{
+	VALUE   attrs = rb_hash_new ();
+	GSList *l;
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		rb_hash_aset (attrs, rb_lm__interned_str (kvp->key),
+			      kvp->value ? rb_str_new2 (kvp->value) : Qnil);
+	}
+
+	return attrs;
+}
+
+VALUE
+msg_node_get_attributes (VALUE self)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+
+	return node_attributes_to_hash (node);
+}
+
+/* Deepest nesting to_h follows, hostile trees could otherwise exhaust the
+ * C stack */
+#define NODE_HASH_MAX_DEPTH 256
+
+typedef struct {
+	gint   max_depth;	/* -1 for the whole tree */
+	VALUE  only;		/* element names to descend into, or Qnil */
+} NodeHashOptions;
+
+static gboolean
+node_hash_wants_child (NodeHashOptions *opts, LmMessageNode *child)
+{
+	long i;
+
+	if (NIL_P (opts->only)) {
+		return TRUE;
+	}
+
+	for (i = 0; i < RARRAY_LEN (opts->only); i++) {
+		VALUE name = RARRAY_PTR (opts->only)[i];
+
+		if (strcmp (RSTRING_PTR (name), child->name) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static VALUE
+node_to_hash (LmMessageNode *node, NodeHashOptions *opts, gint depth)
+{
+	VALUE          hash = rb_hash_new ();
+	LmMessageNode *child;
+
+	rb_hash_aset (hash, ID2SYM (id_name), rb_lm__interned_str (node->name));
+
+	if (node->value) {
+		rb_hash_aset (hash, ID2SYM (id_value), rb_str_new2 (node->value));
+	}
+
+	if (node->attributes) {
+		rb_hash_aset (hash, ID2SYM (id_attributes),
+			      node_attributes_to_hash (node));
+	}
+
+	if (node->children && (opts->max_depth < 0 || depth < opts->max_depth)) {
+		VALUE children = Qnil;
+
+		if (depth >= NODE_HASH_MAX_DEPTH) {
+			rb_raise (rb_eArgError,
+				  "tree nested deeper than %d levels, pass :depth",
+				  NODE_HASH_MAX_DEPTH);
+		}
+
+		for (child = node->children; child; child = child->next) {
+			if (!node_hash_wants_child (opts, child)) {
+				continue;
+			}
+
+			if (NIL_P (children)) {
+				children = rb_ary_new ();
+			}
+
+			rb_ary_push (children, node_to_hash (child, opts, depth + 1));
+		}
+
+		if (!NIL_P (children)) {
+			rb_hash_aset (hash, ID2SYM (id_children), children);
+		}
+	}
+
+	return hash;
+}
+
+/* Converts the tree below node to nested Hashes in one pass. Each element
+ * becomes {:name, :value, :attributes, :children} with the keys only present
+ * when there is something to report. options may limit the :depth and the
+ * names of the elements descended into (:only). Trees nested deeper than
+ * NODE_HASH_MAX_DEPTH raise unless :depth stops short of that. */
+VALUE
+rb_lm_message_node_to_hash (LmMessageNode *node, VALUE options)
+{
+	NodeHashOptions opts;
+	VALUE           depth, only;
+	long            i;
+
+	opts.max_depth = -1;
+	opts.only = Qnil;
+
+	if (!NIL_P (options)) {
+		Check_Type (options, T_HASH);
+
+		depth = rb_hash_aref (options, ID2SYM (id_depth));
+		if (!NIL_P (depth)) {
+			opts.max_depth = NUM2INT (depth);
+		}
+
+		only = rb_hash_aref (options, ID2SYM (id_only));
+		if (!NIL_P (only)) {
+			only = rb_Array (only);
+			opts.only = rb_ary_new ();
+			for (i = 0; i < RARRAY_LEN (only); i++) {
+				rb_ary_push (opts.only,
+					     rb_String (rb_ary_entry (only, i)));
+			}
+		}
+	}
+
+	return node_to_hash (node, &opts, 0);
+}
+
+VALUE
+msg_node_to_hash (int argc, VALUE *argv, VALUE self)
+{
+	LmMessageNode *node = rb_lm_message_node_from_ruby_object (self);
+	VALUE          options;
+
+	rb_scan_args (argc, argv, "01", &options);
+
+	return rb_lm_message_node_to_hash (node, options);
+}
+
+static int
+node_build_attribute (VALUE key, VALUE value, VALUE arg)
+{
+	LmMessageNode *node = (LmMessageNode *) arg;
+	VALUE          key_str, value_str;
+
+	/* Loudmouth would store a NULL value, which most readers can't take */
+	if (NIL_P (value)) {
+		return ST_CONTINUE;
+	}
+
+	key_str = rb_obj_as_string (key);
+	value_str = rb_obj_as_string (value);
+	lm_message_node_set_attribute (node, StringValueCStr (key_str),
+				       StringValueCStr (value_str));
+
+	return ST_CONTINUE;
+}
+
+/* Fills node from a spec in the format produced by to_h: a Hash with
+ * optional :value, :attributes and :children, each child carrying its own
+ * :name. Values are converted with to_s, attributes set to nil are left
+ * out. */
+void
+rb_lm_message_node_build (LmMessageNode *node, VALUE spec)
+{
+	VALUE value, attrs, children;
+	long  i;
+
+	Check_Type (spec, T_HASH);
+
+	value = rb_hash_aref (spec, ID2SYM (id_value));
+	if (!NIL_P (value)) {
+		VALUE value_str = rb_obj_as_string (value);
+
+		lm_message_node_set_value (node, StringValueCStr (value_str));
+	}
+
+	attrs = rb_hash_aref (spec, ID2SYM (id_attributes));
+	if (!NIL_P (attrs)) {
+		Check_Type (attrs, T_HASH);
+		rb_hash_foreach (attrs, node_build_attribute, (VALUE) node);
+	}
+
+	children = rb_hash_aref (spec, ID2SYM (id_children));
+	if (!NIL_P (children)) {
+		Check_Type (children, T_ARRAY);
+
+		for (i = 0; i < RARRAY_LEN (children); i++) {
+			VALUE          child_spec = rb_ary_entry (children, i);
+			VALUE          name;
+			LmMessageNode *child;
+
+			Check_Type (child_spec, T_HASH);
+
+			name = rb_hash_aref (child_spec, ID2SYM (id_name));
+			if (NIL_P (name)) {
+				rb_raise (rb_eArgError, "child spec without :name");
+			}
+			name = rb_obj_as_string (name);
+
+			child = lm_message_node_add_child (node,
+							   StringValueCStr (name),
+							   NULL);
+			rb_lm_message_node_build (child, child_spec);
+		}
+	}
+}
+
+VALUE
+msg_node_select (VALUE self, VALUE path)
+{
+	RbLmMessageNode *data = msg_node_data_from_ruby_object (self);
+
+	return rb_lm_message_node_select (data->node, data->owner, path,
+					  FALSE, FALSE);
+}
+
+VALUE
+msg_node_at (VALUE self, VALUE path)
+{
+	RbLmMessageNode *data = msg_node_data_from_ruby_object (self);
+
+	return rb_lm_message_node_select (data->node, data->owner, path,
+					  FALSE, TRUE);
 }
 
 extern void 
@@ -218,26 +926,43 @@ Init_lm_message_node (VALUE lm_mLM)
 
 	rb_define_alloc_func (lm_cMessageNode, msg_node_allocate);
 
+	id_name = rb_intern ("name");
+	id_value = rb_intern ("value");
+	id_attributes = rb_intern ("attributes");
+	id_children = rb_intern ("children");
+	id_depth = rb_intern ("depth");
+	id_only = rb_intern ("only");
+	id_view_owner = rb_intern ("__lm_view_owner__");
+
 	rb_define_method (lm_cMessageNode, "name", msg_node_get_name, 0);
 	rb_define_method (lm_cMessageNode, "value", msg_node_get_value, 0);
 	rb_define_method (lm_cMessageNode, "value=", msg_node_set_value, 1);
+	rb_define_method (lm_cMessageNode, "value_view", msg_node_get_value_view, 0);
 
 	rb_define_method (lm_cMessageNode, "add_child", msg_node_add_child, -1);
 	rb_define_method (lm_cMessageNode, "get_attribute", msg_node_get_attribute, 1);
         rb_define_method (lm_cMessageNode, "[]", msg_node_get_attribute, 1);
 	rb_define_method (lm_cMessageNode, "set_attribute", msg_node_set_attribute, 2);
 	rb_define_method (lm_cMessageNode, "[]=", msg_node_set_attribute, 2);
+	rb_define_method (lm_cMessageNode, "attribute_view", msg_node_get_attribute_view, 1);
 	rb_define_method (lm_cMessageNode, "get_child", msg_node_get_child, 1);
 	rb_define_method (lm_cMessageNode, "find_child", msg_node_find_child, 1);
+	rb_define_method (lm_cMessageNode, "select", msg_node_select, 1);
+	rb_define_method (lm_cMessageNode, "at", msg_node_at, 1);
 
 	rb_define_method (lm_cMessageNode, "raw_mode", msg_node_get_is_raw_mode, 0);
 	rb_define_method (lm_cMessageNode, "raw_mode=", msg_node_set_is_raw_mode, 1);
 
-	rb_define_method (lm_cMessageNode, "to_s", msg_node_to_string, 0);
+	rb_define_method (lm_cMessageNode, "to_s", msg_node_to_string, -1);
+	rb_define_method (lm_cMessageNode, "to_h", msg_node_to_hash, -1);
+	rb_define_method (lm_cMessageNode, "write_to", msg_node_write_to, 1);
 
 	rb_define_method (lm_cMessageNode, "next", msg_node_get_next, 0);
 	rb_define_method (lm_cMessageNode, "prev", msg_node_get_prev, 0);
 	rb_define_method (lm_cMessageNode, "parent", msg_node_get_parent, 0);
 	rb_define_method (lm_cMessageNode, "children", msg_node_get_children, 0);
 	rb_define_method (lm_cMessageNode, "child", msg_node_get_children, 0);
+	rb_define_method (lm_cMessageNode, "each_child", msg_node_each_child, -1);
+	rb_define_method (lm_cMessageNode, "each_attribute", msg_node_each_attribute, 0);
+	rb_define_method (lm_cMessageNode, "attributes", msg_node_get_attributes, 0);
 }	
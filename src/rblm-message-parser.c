@@ -0,0 +1,529 @@
+/*
+ * Building LM::Message objects from serialized stanzas
+ *
+ *   msg = LM::Message.parse ("<message to='a@b' type='chat'><body>hi</body></message>")
+ *   LM::Message.parse_many (File.open ('archive.xml')) { |m| conn.send (m) }
+ *
+ * The parser in Loudmouth is private, so stanzas are read with GMarkup and
+ * the LmMessage trees are built directly from its callbacks. Input is wrapped
+ * in a synthetic root element so any number of stanzas can follow each other,
+ * and an enclosing <stream:stream> is skipped so raw stream captures work too.
+ *
+ * Whitespace-only text is kept as the value of an element without children,
+ * so <body> </body> round trips, and dropped as indentation once an element
+ * has children.
+ */
+
+#include "rblm.h"
+#include "rblm-private.h"
+
+#define PARSER_WRAPPER        "lm:parse"
+#define PARSER_STREAM         "stream:stream"
+#define PARSER_READ_CHUNK     65536
+
+/* Raised from the callbacks to stop GMarkup after the first stanza */
+#define PARSER_STOP           g_quark_from_static_string ("lm-parse-stop")
+
+extern VALUE lm_cMessage;
+
+typedef struct {
+	GMarkupParseContext *context;
+	gint                 depth;		/* open elements, wrapper included */
+	gint                 stanza_depth;	/* 2, or 3 inside <stream:stream> */
+	LmMessage           *message;	/* stanza being built */
+	LmMessageNode       *node;		/* innermost open element */
+	GQueue              *done;		/* completed LmMessage */
+	gboolean             first_only;	/* stop after one stanza */
+	gboolean             stopped;
+} MessageParser;
+
+typedef struct {
+	const gchar   *name;
+	LmMessageType  type;
+} ParserTypeName;
+
+typedef struct {
+	const gchar      *name;
+	LmMessageSubType  sub_type;
+} ParserSubTypeName;
+
+static const ParserTypeName parser_types[] = {
+	{ "message",         LM_MESSAGE_TYPE_MESSAGE },
+	{ "presence",        LM_MESSAGE_TYPE_PRESENCE },
+	{ "iq",              LM_MESSAGE_TYPE_IQ },
+	{ "stream:error",    LM_MESSAGE_TYPE_STREAM_ERROR },
+	{ "stream:features", LM_MESSAGE_TYPE_STREAM_FEATURES },
+	{ "auth",            LM_MESSAGE_TYPE_AUTH },
+	{ "challenge",       LM_MESSAGE_TYPE_CHALLENGE },
+	{ "response",        LM_MESSAGE_TYPE_RESPONSE },
+	{ "success",         LM_MESSAGE_TYPE_SUCCESS },
+	{ "failure",         LM_MESSAGE_TYPE_FAILURE },
+	{ "proceed",         LM_MESSAGE_TYPE_PROCEED },
+	{ "starttls",        LM_MESSAGE_TYPE_STARTTLS },
+	{ NULL,              LM_MESSAGE_TYPE_UNKNOWN }
+};
+
+static const ParserSubTypeName parser_sub_types[] = {
+	{ "normal",       LM_MESSAGE_SUB_TYPE_NORMAL },
+	{ "chat",         LM_MESSAGE_SUB_TYPE_CHAT },
+	{ "groupchat",    LM_MESSAGE_SUB_TYPE_GROUPCHAT },
+	{ "headline",     LM_MESSAGE_SUB_TYPE_HEADLINE },
+	{ "unavailable",  LM_MESSAGE_SUB_TYPE_UNAVAILABLE },
+	{ "probe",        LM_MESSAGE_SUB_TYPE_PROBE },
+	{ "subscribe",    LM_MESSAGE_SUB_TYPE_SUBSCRIBE },
+	{ "unsubscribe",  LM_MESSAGE_SUB_TYPE_UNSUBSCRIBE },
+	{ "subscribed",   LM_MESSAGE_SUB_TYPE_SUBSCRIBED },
+	{ "unsubscribed", LM_MESSAGE_SUB_TYPE_UNSUBSCRIBED },
+	{ "get",          LM_MESSAGE_SUB_TYPE_GET },
+	{ "set",          LM_MESSAGE_SUB_TYPE_SET },
+	{ "result",       LM_MESSAGE_SUB_TYPE_RESULT },
+	{ "error",        LM_MESSAGE_SUB_TYPE_ERROR },
+	{ NULL,           LM_MESSAGE_SUB_TYPE_NOT_SET }
+};
+
+static ID id_read;
+
+static LmMessageType
+parser_type_from_name (const gchar *name)
+{
+	const ParserTypeName *t;
+
+	for (t = parser_types; t->name; t++) {
+		if (strcmp (t->name, name) == 0) {
+			break;
+		}
+	}
+
+	return t->type;
+}
+
+static LmMessageSubType
+parser_sub_type_from_attributes (LmMessageType  type,
+				 const gchar  **attr_names,
+				 const gchar  **attr_values)
+{
+	const ParserSubTypeName *s;
+	const gchar             *value = NULL;
+	gint                     i;
+
+	for (i = 0; attr_names[i]; i++) {
+		if (strcmp (attr_names[i], "type") == 0) {
+			value = attr_values[i];
+			break;
+		}
+	}
+
+	if (!value) {
+		return type == LM_MESSAGE_TYPE_PRESENCE ?
+			LM_MESSAGE_SUB_TYPE_AVAILABLE : LM_MESSAGE_SUB_TYPE_NOT_SET;
+	}
+
+	for (s = parser_sub_types; s->name; s++) {
+		if (strcmp (s->name, value) == 0) {
+			break;
+		}
+	}
+
+	return s->sub_type;
+}
+
+/* Drops the id and type lm_message_new added, so the stanza keeps exactly
+ * the attributes it was serialized with, in the same order */
+static void
+parser_clear_attributes (LmMessageNode *node)
+{
+	GSList *l;
+
+	for (l = node->attributes; l; l = l->next) {
+		RbLmKeyValuePair *kvp = l->data;
+
+		g_free (kvp->key);
+		g_free (kvp->value);
+		g_free (kvp);
+	}
+
+	g_slist_free (node->attributes);
+	node->attributes = NULL;
+}
+
+static gboolean
+parser_is_blank (const gchar *text, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len && g_ascii_isspace (text[i]); i++);
+
+	return i == len;
+}
+
+static void
+parser_start_element (GMarkupParseContext  *context,
+		      const gchar          *name,
+		      const gchar         **attr_names,
+		      const gchar         **attr_values,
+		      gpointer              user_data,
+		      GError              **error)
+{
+	MessageParser *parser = user_data;
+	gint           i;
+
+	parser->depth++;
+
+	if (parser->depth < parser->stanza_depth) {
+		return;
+	}
+
+	if (parser->depth == parser->stanza_depth) {
+		LmMessageType type;
+
+		if (!parser->message && parser->stanza_depth == 2 &&
+		    strcmp (name, PARSER_STREAM) == 0) {
+			/* Stanzas are the children of the stream element */
+			parser->stanza_depth = 3;
+			return;
+		}
+
+		type = parser_type_from_name (name);
+		parser->message = lm_message_new_with_sub_type (NULL, type,
+								parser_sub_type_from_attributes (type, attr_names, attr_values));
+		parser->node = parser->message->node;
+
+		parser_clear_attributes (parser->node);
+		if (strcmp (parser->node->name, name) != 0) {
+			g_free (parser->node->name);
+			parser->node->name = g_strdup (name);
+		}
+	} else {
+		/* Whitespace before the first child was indentation after all */
+		if (parser->node->value &&
+		    parser_is_blank (parser->node->value, strlen (parser->node->value))) {
+			g_free (parser->node->value);
+			parser->node->value = NULL;
+		}
+		parser->node = lm_message_node_add_child (parser->node, name, NULL);
+	}
+
+	for (i = 0; attr_names[i]; i++) {
+		lm_message_node_set_attribute (parser->node,
+					       attr_names[i], attr_values[i]);
+	}
+}
+
+static void
+parser_end_element (GMarkupParseContext  *context,
+		    const gchar          *name,
+		    gpointer              user_data,
+		    GError              **error)
+{
+	MessageParser *parser = user_data;
+
+	if (parser->depth == parser->stanza_depth) {
+		g_queue_push_tail (parser->done, parser->message);
+		parser->message = NULL;
+		parser->node = NULL;
+
+		if (parser->first_only) {
+			parser->stopped = TRUE;
+			g_set_error (error, PARSER_STOP, 0, "first stanza complete");
+		}
+	} else if (parser->depth > parser->stanza_depth) {
+		parser->node = parser->node->parent;
+	} else if (parser->stanza_depth == 3 && parser->depth == 2) {
+		/* </stream:stream> */
+		parser->stanza_depth = 2;
+	}
+
+	parser->depth--;
+}
+
+static void
+parser_text (GMarkupParseContext  *context,
+	     const gchar          *text,
+	     gsize                 text_len,
+	     gpointer              user_data,
+	     GError              **error)
+{
+	MessageParser *parser = user_data;
+	gchar         *value;
+
+	if (!parser->node) {
+		return;
+	}
+
+	/* Indentation between elements is not content */
+	if (parser->node->children && parser_is_blank (text, text_len)) {
+		return;
+	}
+
+	if (parser->node->value) {
+		gchar *tail = g_strndup (text, text_len);
+
+		value = g_strconcat (parser->node->value, tail, NULL);
+		g_free (tail);
+	} else {
+		value = g_strndup (text, text_len);
+	}
+
+	lm_message_node_set_value (parser->node, value);
+	g_free (value);
+}
+
+static const GMarkupParser parser_callbacks = {
+	parser_start_element,
+	parser_end_element,
+	parser_text,
+	NULL,
+	NULL
+};
+
+static void
+parser_free (MessageParser *parser)
+{
+	LmMessage *m;
+
+	if (parser->context) {
+		g_markup_parse_context_free (parser->context);
+	}
+
+	if (parser->message) {
+		lm_message_unref (parser->message);
+	}
+
+	while ((m = g_queue_pop_head (parser->done))) {
+		lm_message_unref (m);
+	}
+	g_queue_free (parser->done);
+
+	g_free (parser);
+}
+
+static void
+parser_raise (GError *error)
+{
+	VALUE message = rb_str_new2 (error->message);
+
+	g_error_free (error);
+	rb_raise (rb_eArgError, "could not parse stanza: %s",
+		  StringValueCStr (message));
+}
+
+static void
+parser_feed (MessageParser *parser, const gchar *data, gssize len)
+{
+	GError *error = NULL;
+
+	if (parser->stopped) {
+		return;
+	}
+
+	if (!g_markup_parse_context_parse (parser->context, data, len, &error)) {
+		if (parser->stopped) {
+			g_error_free (error);
+			return;
+		}
+		parser_raise (error);
+	}
+}
+
+static MessageParser *
+parser_create (void)
+{
+	MessageParser *parser = g_new0 (MessageParser, 1);
+
+	parser->stanza_depth = 2;
+	parser->done = g_queue_new ();
+	parser->context = g_markup_parse_context_new (&parser_callbacks,
+						      G_MARKUP_TREAT_CDATA_AS_TEXT,
+						      parser, NULL);
+
+	return parser;
+}
+
+static MessageParser *
+parser_new (void)
+{
+	MessageParser *parser = parser_create ();
+
+	parser_feed (parser, "<" PARSER_WRAPPER ">", -1);
+
+	return parser;
+}
+
+/* Parses the first stanza in xml without touching ruby, so it can be used
+ * from the GLib thread. Returns NULL and sets error on malformed input. */
+LmMessage *
+rblm_message_parse (const gchar *xml, gssize len, GError **error)
+{
+	MessageParser *parser = parser_create ();
+	LmMessage     *m = NULL;
+	GError        *parse_error = NULL;
+
+	parser->first_only = TRUE;
+
+	if (g_markup_parse_context_parse (parser->context, "<" PARSER_WRAPPER ">", -1, &parse_error) &&
+	    g_markup_parse_context_parse (parser->context, xml, len, &parse_error) &&
+	    g_markup_parse_context_parse (parser->context, "</" PARSER_WRAPPER ">", -1, &parse_error)) {
+		g_markup_parse_context_end_parse (parser->context, &parse_error);
+	}
+
+	if (parser->stopped) {
+		g_clear_error (&parse_error);
+	}
+
+	if (parse_error) {
+		g_propagate_error (error, parse_error);
+	} else {
+		m = g_queue_pop_head (parser->done);
+	}
+
+	parser_free (parser);
+
+	return m;
+}
+
+static void
+parser_finish (MessageParser *parser)
+{
+	GError *error = NULL;
+
+	if (parser->stopped) {
+		return;
+	}
+
+	if (parser->stanza_depth == 3 && parser->depth == 2) {
+		/* Captures usually end before the stream is closed */
+		parser_feed (parser, "</" PARSER_STREAM ">", -1);
+	}
+
+	parser_feed (parser, "</" PARSER_WRAPPER ">", -1);
+
+	if (!g_markup_parse_context_end_parse (parser->context, &error)) {
+		parser_raise (error);
+	}
+}
+
+typedef struct {
+	MessageParser *parser;
+	VALUE          source;
+	VALUE          results;	/* Qnil when yielding */
+	long           count;
+	gboolean       first_only;
+} ParseManyArgs;
+
+/* Hands over the stanzas completed so far */
+static void
+parser_flush (ParseManyArgs *args)
+{
+	LmMessage *m;
+
+	while ((m = g_queue_pop_head (args->parser->done))) {
+		VALUE msg = LMMESSAGE2RVAL (m);
+
+		lm_message_unref (m);
+		args->count++;
+
+		if (NIL_P (args->results)) {
+			rb_yield (msg);
+		} else {
+			rb_ary_push (args->results, msg);
+		}
+	}
+}
+
+static VALUE
+parse_many_body (VALUE data)
+{
+	ParseManyArgs *args = (ParseManyArgs *) data;
+
+	args->parser = parser_new ();
+	args->parser->first_only = args->first_only;
+
+	if (TYPE (args->source) == T_STRING) {
+		parser_feed (args->parser, RSTRING_PTR (args->source),
+			     RSTRING_LEN (args->source));
+		parser_flush (args);
+	} else {
+		VALUE chunk, size = INT2FIX (PARSER_READ_CHUNK);
+
+		while (!args->parser->stopped &&
+		       !NIL_P (chunk = rb_funcall (args->source, id_read, 1, size))) {
+			StringValue (chunk);
+			parser_feed (args->parser, RSTRING_PTR (chunk),
+				     RSTRING_LEN (chunk));
+			parser_flush (args);
+		}
+	}
+
+	parser_finish (args->parser);
+	parser_flush (args);
+
+	return Qnil;
+}
+
+static VALUE
+parse_many_cleanup (VALUE data)
+{
+	ParseManyArgs *args = (ParseManyArgs *) data;
+
+	if (args->parser) {
+		parser_free (args->parser);
+		args->parser = NULL;
+	}
+
+	return Qnil;
+}
+
+static void
+parse_many_run (ParseManyArgs *args)
+{
+	if (TYPE (args->source) != T_STRING && !rb_respond_to (args->source, id_read)) {
+		rb_raise (rb_eTypeError, "expected a String or an IO");
+	}
+
+	rb_ensure (parse_many_body, (VALUE) args,
+		   parse_many_cleanup, (VALUE) args);
+}
+
+/* LM::Message.parse_many (source) reads every stanza from a String or an
+ * object responding to read. Yields each message as soon as it is complete
+ * and returns the number of messages, or returns them all without a block. */
+static VALUE
+msg_parse_many (VALUE klass, VALUE source)
+{
+	ParseManyArgs args = { NULL, source, Qnil, 0, FALSE };
+
+	if (!rb_block_given_p ()) {
+		args.results = rb_ary_new ();
+	}
+
+	parse_many_run (&args);
+
+	return NIL_P (args.results) ? LONG2NUM (args.count) : args.results;
+}
+
+/* LM::Message.parse (xml) returns the first stanza in xml, anything after
+ * it is not looked at */
+static VALUE
+msg_parse (VALUE klass, VALUE xml)
+{
+	ParseManyArgs args = { NULL, xml, Qnil, 0, TRUE };
+
+	StringValue (xml);
+	args.results = rb_ary_new ();
+	parse_many_run (&args);
+
+	if (args.count == 0) {
+		rb_raise (rb_eArgError, "no stanza found");
+	}
+
+	return rb_ary_entry (args.results, 0);
+}
+
+extern void
+Init_lm_message_parser (VALUE lm_mLM)
+{
+	id_read = rb_intern ("read");
+
+	rb_define_singleton_method (lm_cMessage, "parse", msg_parse, 1);
+	rb_define_singleton_method (lm_cMessage, "parse_many", msg_parse_many, 1);
+}
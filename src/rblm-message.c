@@ -5,33 +5,123 @@
 
 VALUE lm_cMessage;
 
+static void   msg_mark  (RbLmMessage *msg);
+static void   msg_free  (RbLmMessage *msg);
+static size_t msg_memsize (const RbLmMessage *msg);
+
+static const rb_data_type_t msg_type = {
+	"LM::Message",
+	{
+		(RUBY_DATA_FUNC) msg_mark,
+		(RUBY_DATA_FUNC) msg_free,
+		(size_t (*) (const void *)) msg_memsize,
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+RbLmMessage *
+rb_lm_message_data_from_ruby_object (VALUE obj)
+{
+	RbLmMessage *msg;
+
+	TypedData_Get_Struct (obj, RbLmMessage, &msg_type, msg);
+
+	return msg;
+}
+
 LmMessage *
 rb_lm_message_from_ruby_object (VALUE obj)
 {
-	LmMessage *m;
+	return rb_lm_message_data_from_ruby_object (obj)->message;
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cMessage)) {
-		rb_raise (rb_eTypeError, "not a LmMessage");
+static void
+msg_mark_node (gpointer key, gpointer value, gpointer user_data)
+{
+	rb_gc_mark ((VALUE) value);
+}
+
+static void
+msg_mark (RbLmMessage *msg)
+{
+	if (msg->nodes) {
+		g_hash_table_foreach (msg->nodes, msg_mark_node, NULL);
+	}
+}
+
+static void
+msg_free (RbLmMessage *msg)
+{
+	RBLM_GC_ADJUST_MEMORY (-(gssize) msg->tree_size);
+
+	if (msg->nodes) {
+		g_hash_table_destroy (msg->nodes);
 	}
 
-	Data_Get_Struct (obj, LmMessage, m);
+	if (msg->message) {
+		lm_message_unref (msg->message);
+	}
 
-	return m;
+	g_free (msg);
 }
 
+/* The whole node tree is accounted to the message, node wrappers handed out
+ * from it only count their own struct. The tree is measured when it is
+ * wrapped or built and kept up to date by the node setters, so this does
+ * not walk it. */
+static size_t
+msg_memsize (const RbLmMessage *msg)
+{
+	size_t size = sizeof (RbLmMessage) + msg->tree_size;
+
+	if (msg->nodes) {
+		size += g_hash_table_size (msg->nodes) * 4 * sizeof (gpointer);
+	}
+
+	return size;
+}
+
+/* Measures the whole tree of self again and reports the difference */
 void
-msg_free (LmMessage *m)
+rb_lm_message_account_tree (VALUE self)
 {
-	lm_message_unref (m);
+	RbLmMessage *msg = rb_lm_message_data_from_ruby_object (self);
+	gsize        size = 0;
+
+	if (msg->message) {
+		size = rb_lm_message_node_memsize (msg->message->node);
+	}
+
+	rb_lm_message_adjust_tree (self, (gssize) size - (gssize) msg->tree_size);
+}
+
+/* Reports delta bytes added to (or removed from) the tree of self */
+void
+rb_lm_message_adjust_tree (VALUE self, gssize delta)
+{
+	RbLmMessage *msg = rb_lm_message_data_from_ruby_object (self);
+
+	if (delta == 0) {
+		return;
+	}
+
+	msg->tree_size += delta;
+	RBLM_GC_ADJUST_MEMORY (delta);
 }
 
 VALUE
 rb_lm_message_to_ruby_object (LmMessage *m)
 {
+	RbLmMessage *msg;
+	VALUE        self;
+
 	if (m) {
-		lm_message_ref (m);
-		return Data_Wrap_Struct (lm_cMessage, NULL,
-					 msg_free, m);
+		msg = g_new0 (RbLmMessage, 1);
+		msg->message = lm_message_ref (m);
+		self = TypedData_Wrap_Struct (lm_cMessage, &msg_type, msg);
+		rb_lm_message_account_tree (self);
+		return self;
 	} else {
 		return Qnil;
 	}
@@ -40,15 +130,16 @@ rb_lm_message_to_ruby_object (LmMessage *m)
 VALUE
 msg_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, msg_free, NULL);
+	return TypedData_Wrap_Struct (klass, &msg_type, g_new0 (RbLmMessage, 1));
 }
 
 VALUE
 msg_initialize (int argc, VALUE *argv, VALUE self)
 {
-	LmMessage  *m;
-	VALUE       to, type, sub_type;
-	char       *to_str = NULL;
+	RbLmMessage *msg;
+	LmMessage   *m;
+	VALUE        to, type, sub_type;
+	char        *to_str = NULL;
 
 	rb_scan_args (argc, argv, "21", &to, &type, &sub_type);
 
@@ -71,7 +162,9 @@ msg_initialize (int argc, VALUE *argv, VALUE self)
 						  FIX2INT (sub_type));
 	}
 
-	DATA_PTR (self) = m;
+	msg = rb_lm_message_data_from_ruby_object (self);
+	msg->message = m;
+	rb_lm_message_account_tree (self);
 
 	return self;
 }
@@ -97,7 +190,78 @@ msg_get_root_node (VALUE self)
 {
 	LmMessage *m = rb_lm_message_from_ruby_object (self);
 
-	return LMMESSAGENODE2RVAL (m->node);
+	return LMMESSAGENODE2RVAL_IN (m->node, self);
+}
+
+VALUE
+msg_to_hash (int argc, VALUE *argv, VALUE self)
+{
+	LmMessage *m = rb_lm_message_from_ruby_object (self);
+	VALUE      options;
+
+	rb_scan_args (argc, argv, "01", &options);
+
+	return rb_lm_message_node_to_hash (m->node, options);
+}
+
+VALUE
+msg_write_to (VALUE self, VALUE io)
+{
+	LmMessage *m = rb_lm_message_from_ruby_object (self);
+
+	return rb_lm_message_node_write_to (m->node, io);
+}
+
+/* Paths start at the root element, as in msg.select ('iq/query/item@jid') */
+VALUE
+msg_select (VALUE self, VALUE path)
+{
+	LmMessage *m = rb_lm_message_from_ruby_object (self);
+
+	return rb_lm_message_node_select (m->node, self, path, TRUE, FALSE);
+}
+
+VALUE
+msg_at (VALUE self, VALUE path)
+{
+	LmMessage *m = rb_lm_message_from_ruby_object (self);
+
+	return rb_lm_message_node_select (m->node, self, path, TRUE, TRUE);
+}
+
+/* LM::Message.build (to, type, sub_type, tree) creates the message and its
+ * whole node tree in one call, tree uses the same layout as Message#to_h */
+VALUE
+msg_build (VALUE klass, VALUE to, VALUE type, VALUE sub_type, VALUE tree)
+{
+	LmMessage *m;
+	VALUE      self, to_str;
+	char      *to_cstr = NULL;
+
+	if (!NIL_P (to)) {
+		to_str = rb_obj_as_string (to);
+		to_cstr = StringValueCStr (to_str);
+	}
+
+	if (NIL_P (sub_type)) {
+		m = lm_message_new (to_cstr,
+				    rb_lm_message_type_from_ruby_object (type));
+	} else {
+		m = lm_message_new_with_sub_type (to_cstr,
+						  rb_lm_message_type_from_ruby_object (type),
+						  rb_lm_message_sub_type_from_ruby_object (sub_type));
+	}
+
+	/* Wrap first so the message is released if the tree spec is bad */
+	self = LMMESSAGE2RVAL (m);
+	lm_message_unref (m);
+
+	if (!NIL_P (tree)) {
+		rb_lm_message_node_build (m->node, tree);
+		rb_lm_message_account_tree (self);
+	}
+
+	return self;
 }
 
 extern void 
@@ -106,11 +270,17 @@ Init_lm_message (VALUE lm_mLM)
 	lm_cMessage = rb_define_class_under (lm_mLM, "Message", rb_cObject);
 
 	rb_define_alloc_func (lm_cMessage, msg_allocate);
+
+	rb_define_singleton_method (lm_cMessage, "build", msg_build, 4);
 	
 	rb_define_method (lm_cMessage, "initialize", msg_initialize, -1);
 	rb_define_method (lm_cMessage, "type", msg_get_type, 0);
 	rb_define_method (lm_cMessage, "sub_type", msg_get_sub_type, 0);
 	rb_define_method (lm_cMessage, "root_node", msg_get_root_node, 0);
+	rb_define_method (lm_cMessage, "to_h", msg_to_hash, -1);
+	rb_define_method (lm_cMessage, "write_to", msg_write_to, 1);
+	rb_define_method (lm_cMessage, "select", msg_select, 1);
+	rb_define_method (lm_cMessage, "at", msg_at, 1);
 
 	rb_define_alias (lm_cMessage, "node", "root_node");
 }
@@ -0,0 +1,645 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-outbound.h"
+
+/* Stanzas sent per run of the idle source before yielding to the loop */
+#define DRAIN_BATCH 32
+
+/* Turns each waiting class gets per round, high never waits */
+static const guint outbound_weights[RBLM_PRIORITY_COUNT] = { 0, 4, 1 };
+
+static const char *outbound_names[RBLM_PRIORITY_COUNT] = {
+	"high", "normal", "bulk"
+};
+
+/* Children a presence may have and still only carry state */
+static const char *outbound_state_children[] = {
+	"show", "status", "priority", NULL
+};
+
+typedef struct {
+	LmMessage        *message;	/* either a message with its reply */
+	LmMessageHandler *reply;
+	gchar            *raw;		/* or a serialized stanza */
+
+	gchar            *key;		/* to of a coalesced presence */
+	RbLmPriority      priority;
+	guint64           due;		/* usec, end of its hold */
+} RbLmOutboundItem;
+
+struct _RbLmOutbound {
+	RbLmConnection *owner;
+	GQueue          queues[RBLM_PRIORITY_COUNT];
+	guint           credits[RBLM_PRIORITY_COUNT];
+	GSource        *source;		/* pending drain */
+
+	gboolean        coalesce;
+	guint64         window;		/* usec a presence is held */
+	GHashTable     *presences;	/* key -> item, held or queued */
+	GQueue          held;
+	GSource        *hold_source;
+
+	guint64         sent[RBLM_PRIORITY_COUNT];
+	guint64         failed[RBLM_PRIORITY_COUNT];
+	guint           max_depth[RBLM_PRIORITY_COUNT];
+	guint64         coalesced;
+};
+
+static guint64
+outbound_now (void)
+{
+	return (guint64) g_get_monotonic_time ();
+}
+
+RbLmPriority
+rb_lm_priority_from_options (VALUE options)
+{
+	VALUE priority;
+	int   i;
+
+	if (NIL_P (options)) {
+		return RBLM_PRIORITY_NORMAL;
+	}
+
+	Check_Type (options, T_HASH);
+
+	priority = rb_hash_aref (options, ID2SYM (rb_intern ("priority")));
+	if (NIL_P (priority)) {
+		return RBLM_PRIORITY_NORMAL;
+	}
+
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		if (priority == ID2SYM (rb_intern (outbound_names[i]))) {
+			return (RbLmPriority) i;
+		}
+	}
+
+	rb_raise (rb_eArgError, "priority should be :high, :normal or :bulk");
+}
+
+gdouble
+rb_lm_coalescing_window_from_options (VALUE options)
+{
+	VALUE   value;
+	gdouble window;
+
+	if (NIL_P (options)) {
+		return 0;
+	}
+
+	Check_Type (options, T_HASH);
+
+	value = rb_hash_aref (options, ID2SYM (rb_intern ("window")));
+	window = NIL_P (value) ? 0 : NUM2DBL (value);
+	if (window < 0) {
+		rb_raise (rb_eArgError, "window can't be negative");
+	}
+
+	return window;
+}
+
+static void
+outbound_item_free (RbLmOutboundItem *item)
+{
+	if (item->message) {
+		lm_message_unref (item->message);
+	}
+	if (item->reply) {
+		lm_message_handler_unref (item->reply);
+	}
+	g_free (item->raw);
+	g_free (item->key);
+	g_free (item);
+}
+
+/* Takes the item out of the coalescing table once it leaves the queues */
+static void
+outbound_item_done (RbLmOutbound *ob, RbLmOutboundItem *item)
+{
+	if (item->key && g_hash_table_lookup (ob->presences, item->key) == item) {
+		g_hash_table_remove (ob->presences, item->key);
+	}
+	outbound_item_free (item);
+}
+
+RbLmOutbound *
+rblm_outbound_new (gpointer owner)
+{
+	RbLmOutbound *ob = g_new0 (RbLmOutbound, 1);
+	int           i;
+
+	ob->owner = owner;
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		g_queue_init (&ob->queues[i]);
+	}
+	ob->presences = g_hash_table_new (g_str_hash, g_str_equal);
+	g_queue_init (&ob->held);
+
+	return ob;
+}
+
+void
+rblm_outbound_free (RbLmOutbound *ob)
+{
+	RbLmOutboundItem *item;
+	int               i;
+
+	if (ob->source) {
+		g_source_destroy (ob->source);
+		g_source_unref (ob->source);
+	}
+	if (ob->hold_source) {
+		g_source_destroy (ob->hold_source);
+		g_source_unref (ob->hold_source);
+	}
+
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		while ((item = g_queue_pop_head (&ob->queues[i]))) {
+			outbound_item_free (item);
+		}
+	}
+	while ((item = g_queue_pop_head (&ob->held))) {
+		outbound_item_free (item);
+	}
+	g_hash_table_destroy (ob->presences);
+	g_free (ob);
+}
+
+static gboolean
+outbound_empty (RbLmOutbound *ob)
+{
+	int i;
+
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		if (!g_queue_is_empty (&ob->queues[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+outbound_backlogged (RbLmOutbound *ob)
+{
+	return ob->owner->shaper && rblm_shaper_depth (ob->owner->shaper) > 0;
+}
+
+gboolean
+rblm_outbound_holds (RbLmOutbound *ob, RbLmPriority priority)
+{
+	switch (priority) {
+	case RBLM_PRIORITY_HIGH:
+		return FALSE;
+	case RBLM_PRIORITY_NORMAL:
+		return !g_queue_is_empty (&ob->queues[priority]) ||
+			outbound_backlogged (ob);
+	default:
+		return TRUE;
+	}
+}
+
+void
+rblm_outbound_count (RbLmOutbound *ob, RbLmPriority priority)
+{
+	ob->sent[priority]++;
+}
+
+/* Weighted round robin over the classes with stanzas waiting */
+static RbLmPriority
+outbound_next (RbLmOutbound *ob)
+{
+	int round, i;
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+			if (ob->credits[i] > 0 && !g_queue_is_empty (&ob->queues[i])) {
+				ob->credits[i]--;
+				return (RbLmPriority) i;
+			}
+		}
+
+		for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+			ob->credits[i] = outbound_weights[i];
+		}
+	}
+
+	return RBLM_PRIORITY_COUNT;
+}
+
+static gboolean
+outbound_drain (gpointer user_data)
+{
+	RbLmOutbound *ob = user_data;
+	guint         n;
+
+	for (n = 0; n < DRAIN_BATCH && !outbound_backlogged (ob); n++) {
+		RbLmPriority      priority = outbound_next (ob);
+		RbLmOutboundItem *item;
+		gboolean          res;
+
+		if (priority == RBLM_PRIORITY_COUNT) {
+			break;
+		}
+
+		item = g_queue_pop_head (&ob->queues[priority]);
+		if (ob->owner->shaper) {
+			res = rblm_shaper_send (ob->owner->shaper, item->message,
+						item->reply, item->raw, FALSE, NULL);
+		} else {
+			res = rblm_connection_transmit (ob->owner, item->message,
+							item->reply, item->raw, NULL);
+		}
+
+		ob->sent[priority]++;
+		if (!res) {
+			ob->failed[priority]++;
+		}
+		outbound_item_done (ob, item);
+	}
+
+	/* The shaper resumes us once its backlog is gone */
+	if (outbound_backlogged (ob) || outbound_empty (ob)) {
+		g_source_unref (ob->source);
+		ob->source = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+rblm_outbound_resume (RbLmOutbound *ob)
+{
+	if (ob->source || outbound_empty (ob)) {
+		return;
+	}
+
+	ob->source = g_idle_source_new ();
+	g_source_set_callback (ob->source, outbound_drain, ob, NULL);
+	g_source_attach (ob->source, ob->owner->context);
+}
+
+static void
+outbound_enqueue (RbLmOutbound *ob, RbLmOutboundItem *item)
+{
+	RbLmPriority priority = item->priority;
+
+	g_queue_push_tail (&ob->queues[priority], item);
+
+	ob->max_depth[priority] = MAX (ob->max_depth[priority],
+				       g_queue_get_length (&ob->queues[priority]));
+
+	if (!outbound_backlogged (ob)) {
+		rblm_outbound_resume (ob);
+	}
+}
+
+void
+rblm_outbound_push (RbLmOutbound     *ob,
+		    RbLmPriority      priority,
+		    LmMessage        *m,
+		    LmMessageHandler *reply,
+		    const gchar      *raw)
+{
+	RbLmOutboundItem *item = g_new0 (RbLmOutboundItem, 1);
+
+	/* Queued as it is now, only a reply handler needs the message itself */
+	if (m && !reply) {
+		item->raw = rb_lm_message_node_to_raw (m->node);
+	} else {
+		item->message = m ? lm_message_ref (m) : NULL;
+		item->reply = reply ? lm_message_handler_ref (reply) : NULL;
+		item->raw = g_strdup (raw);
+	}
+	item->priority = priority;
+
+	outbound_enqueue (ob, item);
+}
+
+static gboolean outbound_hold_timeout (gpointer user_data);
+
+/* Queues held presences whose window is over, then waits for the next */
+static void
+outbound_release (RbLmOutbound *ob, guint64 now)
+{
+	RbLmOutboundItem *item;
+
+	while ((item = g_queue_peek_head (&ob->held)) && item->due <= now) {
+		g_queue_pop_head (&ob->held);
+		outbound_enqueue (ob, item);
+	}
+
+	if (item && !ob->hold_source) {
+		ob->hold_source = g_timeout_source_new ((guint) ((item->due - now + 999) / 1000));
+		g_source_set_callback (ob->hold_source, outbound_hold_timeout, ob, NULL);
+		g_source_attach (ob->hold_source, ob->owner->context);
+	}
+}
+
+static gboolean
+outbound_hold_timeout (gpointer user_data)
+{
+	RbLmOutbound *ob = user_data;
+
+	g_source_unref (ob->hold_source);
+	ob->hold_source = NULL;
+
+	outbound_release (ob, outbound_now ());
+
+	return FALSE;
+}
+
+static gboolean
+outbound_state_child (const gchar *name, gsize len)
+{
+	int i;
+
+	for (i = 0; outbound_state_children[i]; i++) {
+		if (strlen (outbound_state_children[i]) == len &&
+		    strncmp (outbound_state_children[i], name, len) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Whether every element below the first of a serialized stanza is a show,
+ * status or priority. Comments and CDATA count as anything else. */
+static gboolean
+outbound_raw_state_only (const gchar *raw)
+{
+	const gchar *p = strchr (raw, '>');
+
+	while (p && (p = strchr (p, '<'))) {
+		p++;
+		if (*p == '/') {
+			continue;
+		}
+		if (!outbound_state_child (p, strcspn (p, " \t\r\n/>"))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Address a stanza goes to, "" for none */
+static gchar *
+outbound_to (LmMessage *m, const gchar *raw)
+{
+	gchar *to;
+
+	if (m) {
+		to = g_strdup (lm_message_node_get_attribute (m->node, "to"));
+	} else {
+		to = rb_lm__raw_attribute (raw, "to");
+	}
+
+	return to ? to : g_strdup ("");
+}
+
+/* Key of a presence that only carries state, so that a newer one to the
+ * same address makes it pointless. Subscriptions, errors and presences
+ * with anything but show, status and priority, like MUC joins, never are. */
+static gchar *
+outbound_presence_key (LmMessage *m, const gchar *raw)
+{
+	LmMessageNode *child;
+	gchar         *type;
+
+	if (m) {
+		if (lm_message_get_type (m) != LM_MESSAGE_TYPE_PRESENCE) {
+			return NULL;
+		}
+		switch (lm_message_get_sub_type (m)) {
+		case LM_MESSAGE_SUB_TYPE_AVAILABLE:
+		case LM_MESSAGE_SUB_TYPE_UNAVAILABLE:
+			break;
+		default:
+			return NULL;
+		}
+		for (child = m->node->children; child; child = child->next) {
+			if (child->children ||
+			    !outbound_state_child (child->name, strlen (child->name))) {
+				return NULL;
+			}
+		}
+
+		return outbound_to (m, NULL);
+	}
+
+	if (!rb_lm__raw_is_element (raw, "presence") || !outbound_raw_state_only (raw)) {
+		return NULL;
+	}
+	type = rb_lm__raw_attribute (raw, "type");
+	if (type && strcmp (type, "unavailable") != 0) {
+		g_free (type);
+		return NULL;
+	}
+	g_free (type);
+
+	return outbound_to (NULL, raw);
+}
+
+gboolean
+rblm_outbound_coalesce (RbLmOutbound *ob,
+			RbLmPriority  priority,
+			LmMessage    *m,
+			const gchar  *raw)
+{
+	RbLmOutboundItem *item;
+	gchar            *key;
+	guint64           now;
+
+	if (!ob->coalesce || priority == RBLM_PRIORITY_HIGH ||
+	    !(key = outbound_presence_key (m, raw))) {
+		return FALSE;
+	}
+
+	/* Latest wins, in the place of the one it replaces */
+	item = g_hash_table_lookup (ob->presences, key);
+	if (item) {
+		g_free (key);
+		g_free (item->raw);
+		item->raw = m ? rb_lm_message_node_to_raw (m->node) : g_strdup (raw);
+		ob->coalesced++;
+
+		return TRUE;
+	}
+
+	now = outbound_now ();
+
+	item = g_new0 (RbLmOutboundItem, 1);
+	item->raw = m ? rb_lm_message_node_to_raw (m->node) : g_strdup (raw);
+	item->key = key;
+	item->priority = priority;
+	item->due = now + ob->window;
+	g_hash_table_insert (ob->presences, item->key, item);
+	g_queue_push_tail (&ob->held, item);
+
+	outbound_release (ob, now);
+
+	return TRUE;
+}
+
+void
+rblm_outbound_set_coalescing (RbLmOutbound *ob, gboolean coalesce, gdouble window)
+{
+	ob->coalesce = coalesce;
+	ob->window = (guint64) (window * G_USEC_PER_SEC);
+
+	if (!coalesce) {
+		if (ob->hold_source) {
+			g_source_destroy (ob->hold_source);
+			g_source_unref (ob->hold_source);
+			ob->hold_source = NULL;
+		}
+		outbound_release (ob, G_MAXUINT64);
+	}
+}
+
+void
+rblm_outbound_get_stats (RbLmOutbound *ob, RbLmOutboundStats *stats)
+{
+	int i;
+
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		stats->sent[i] = ob->sent[i];
+		stats->failed[i] = ob->failed[i];
+		stats->depth[i] = g_queue_get_length (&ob->queues[i]);
+		stats->max_depth[i] = ob->max_depth[i];
+	}
+
+	stats->held = g_queue_get_length (&ob->held);
+	stats->coalesced = ob->coalesced;
+}
+
+VALUE
+rb_lm_outbound_stats_to_ruby_object (const RbLmOutboundStats *stats)
+{
+	VALUE hash = rb_hash_new ();
+	int   i;
+
+	for (i = 0; i < RBLM_PRIORITY_COUNT; i++) {
+		VALUE queue = rb_hash_new ();
+
+		rb_hash_aset (queue, ID2SYM (rb_intern ("sent")), ULL2NUM (stats->sent[i]));
+		rb_hash_aset (queue, ID2SYM (rb_intern ("failed")), ULL2NUM (stats->failed[i]));
+		rb_hash_aset (queue, ID2SYM (rb_intern ("depth")), UINT2NUM (stats->depth[i]));
+		rb_hash_aset (queue, ID2SYM (rb_intern ("max_depth")), UINT2NUM (stats->max_depth[i]));
+
+		rb_hash_aset (hash, ID2SYM (rb_intern (outbound_names[i])), queue);
+	}
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("held")), UINT2NUM (stats->held));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("coalesced")), ULL2NUM (stats->coalesced));
+
+	return hash;
+}
+
+gboolean
+rblm_connection_transmit (RbLmConnection   *data,
+			  LmMessage        *m,
+			  LmMessageHandler *reply,
+			  const gchar      *raw,
+			  GError          **error)
+{
+	gboolean res;
+
+	if (!m) {
+		res = lm_connection_send_raw (data->conn, raw, error);
+	} else if (reply) {
+		res = lm_connection_send_with_reply (data->conn, m, reply, error);
+	} else {
+		res = lm_connection_send (data->conn, m, error);
+	}
+
+	if (res && data->stream_mgmt) {
+		if (m) {
+			rblm_stream_mgmt_sent (data->stream_mgmt, m);
+		} else {
+			rblm_stream_mgmt_sent_raw (data->stream_mgmt, raw);
+		}
+	}
+
+	return res;
+}
+
+/* Takes the presence held or queued for the address m or raw goes to out
+ * of the queues, or returns NULL */
+static RbLmOutboundItem *
+outbound_take_presence (RbLmOutbound *ob, LmMessage *m, const gchar *raw)
+{
+	RbLmOutboundItem *item;
+	gchar            *to;
+
+	if (g_hash_table_size (ob->presences) == 0) {
+		return NULL;
+	}
+
+	to = outbound_to (m, raw);
+	item = g_hash_table_lookup (ob->presences, to);
+	g_free (to);
+
+	if (item) {
+		g_hash_table_remove (ob->presences, item->key);
+		if (!g_queue_remove (&ob->held, item)) {
+			g_queue_remove (&ob->queues[item->priority], item);
+		}
+	}
+
+	return item;
+}
+
+/* Queues the stanza behind others of its class, or sends it */
+static gboolean
+outbound_dispatch (RbLmConnection   *data,
+		   LmMessage        *m,
+		   LmMessageHandler *reply,
+		   const gchar      *raw,
+		   RbLmPriority      priority,
+		   GError          **error)
+{
+	if (rblm_outbound_holds (data->outbound, priority)) {
+		rblm_outbound_push (data->outbound, priority, m, reply, raw);
+		return TRUE;
+	}
+
+	rblm_outbound_count (data->outbound, priority);
+
+	if (data->shaper) {
+		return rblm_shaper_send (data->shaper, m, reply, raw,
+					 priority == RBLM_PRIORITY_HIGH, error);
+	}
+
+	return rblm_connection_transmit (data, m, reply, raw, error);
+}
+
+gboolean
+rblm_connection_send (RbLmConnection   *data,
+		      LmMessage        *m,
+		      LmMessageHandler *reply,
+		      const gchar      *raw,
+		      RbLmPriority      priority,
+		      GError          **error)
+{
+	RbLmOutboundItem *presence;
+
+	if (!reply && rblm_outbound_coalesce (data->outbound, priority, m, raw)) {
+		return TRUE;
+	}
+
+	/* A presence held for the same address goes first, the same way, so
+	 * that whatever is sent to it next never overtakes it */
+	presence = outbound_take_presence (data->outbound, m, raw);
+	if (presence) {
+		if (!outbound_dispatch (data, NULL, NULL, presence->raw, priority, NULL)) {
+			data->outbound->failed[priority]++;
+		}
+		outbound_item_free (presence);
+	}
+
+	return outbound_dispatch (data, m, reply, raw, priority, error);
+}
@@ -0,0 +1,87 @@
+/*
+ * Priority classes for outbound stanzas
+ *
+ * High priority stanzas are handed to Loudmouth (or the shaper) as soon as
+ * they are sent. Bulk stanzas are always queued, and normal ones are queued
+ * while others of their class wait or the shaper is backlogged. Queued
+ * stanzas are drained from an idle source on the connection's main context,
+ * a batch at a time in weighted turns, so replies and other I/O get through
+ * between batches instead of landing behind a whole fan-out in Loudmouth's
+ * output buffer. While the shaper holds a backlog, draining stops until it
+ * is empty.
+ *
+ * With coalescing on, presences that only carry state (available or
+ * unavailable, with nothing but show, status and priority below) are held
+ * for a window, one per to address, and a newer one replaces the held or
+ * still queued one in place. Only the latest is sent. Any other stanza to
+ * that address takes the presence out and sends it first.
+ *
+ * Call from the thread running the connection's main loop, or with the
+ * GLib thread paused for evented connections.
+ */
+
+#ifndef _RBLM_OUTBOUND_H
+#define	_RBLM_OUTBOUND_H
+
+#include "rblm.h"
+
+typedef enum {
+	RBLM_PRIORITY_HIGH,
+	RBLM_PRIORITY_NORMAL,
+	RBLM_PRIORITY_BULK,
+	RBLM_PRIORITY_COUNT
+} RbLmPriority;
+
+typedef struct _RbLmOutbound RbLmOutbound;
+
+/* Counters copied out of the queues */
+typedef struct {
+	guint64 sent[RBLM_PRIORITY_COUNT];
+	guint64 failed[RBLM_PRIORITY_COUNT];
+	guint   depth[RBLM_PRIORITY_COUNT];
+	guint   max_depth[RBLM_PRIORITY_COUNT];
+	guint   held;
+	guint64 coalesced;
+} RbLmOutboundStats;
+
+/* :high, :normal or :bulk from the :priority of options, which may be nil */
+RbLmPriority   rb_lm_priority_from_options (VALUE options);
+/* Seconds from the :window of options, which may be nil */
+gdouble        rb_lm_coalescing_window_from_options (VALUE options);
+
+/* owner is the RbLmConnection the stanzas are sent through */
+RbLmOutbound * rblm_outbound_new    (gpointer          owner);
+/* Drops whatever is still queued */
+void           rblm_outbound_free   (RbLmOutbound     *ob);
+
+/* Whether a stanza of this class has to wait */
+gboolean       rblm_outbound_holds  (RbLmOutbound     *ob,
+				     RbLmPriority      priority);
+/* Takes a serialized copy of m or raw, or a ref on m with its reply
+ * handler, so changes made to m afterwards don't show */
+void           rblm_outbound_push   (RbLmOutbound     *ob,
+				     RbLmPriority      priority,
+				     LmMessage        *m,
+				     LmMessageHandler *reply,
+				     const gchar      *raw);
+/* Carries on draining, after the shaper emptied its backlog */
+void           rblm_outbound_resume (RbLmOutbound     *ob);
+/* Holds or replaces a state presence when coalescing, FALSE for anything
+ * that should be sent as usual */
+gboolean       rblm_outbound_coalesce (RbLmOutbound   *ob,
+				       RbLmPriority    priority,
+				       LmMessage      *m,
+				       const gchar    *raw);
+/* Turning it off queues whatever is held right away */
+void           rblm_outbound_set_coalescing (RbLmOutbound *ob,
+					     gboolean      coalesce,
+					     gdouble       window);
+/* Counts a stanza that went out without waiting */
+void           rblm_outbound_count  (RbLmOutbound     *ob,
+				     RbLmPriority      priority);
+
+void           rblm_outbound_get_stats (RbLmOutbound      *ob,
+					RbLmOutboundStats *stats);
+VALUE          rb_lm_outbound_stats_to_ruby_object (const RbLmOutboundStats *stats);
+
+#endif	/* _RBLM_OUTBOUND_H */
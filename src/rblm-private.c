@@ -1,8 +1,158 @@
 #include "rblm-private.h"
 
+#ifndef HAVE_RB_INTERNED_STR_CSTR
+/* Upper bounds for the interned string cache, names and enumerated attribute
+ * values are short and few so anything beyond this is not worth keeping */
+#define INTERN_MAX_ENTRIES 1024
+#define INTERN_MAX_LENGTH  64
+
+static GHashTable *intern_table = NULL;
+#endif
+
 gboolean
 rb_lm__is_kind_of (VALUE object, VALUE klass)
 {
 	return RVAL2GBOOL (rb_obj_is_kind_of (object, klass));
 }
 
+/* Returns a frozen String for str, shared between all callers asking for the
+ * same contents. Rubies with an fstring table do the sharing themselves,
+ * older ones go through a bounded cache whose Strings are pinned so that
+ * compaction can't move them under the table. */
+VALUE
+rb_lm__interned_str (const gchar *str)
+{
+#ifdef HAVE_RB_INTERNED_STR_CSTR
+	if (!str) {
+		return Qnil;
+	}
+
+	return rb_interned_str_cstr (str);
+#else
+	VALUE rval;
+
+	if (!str) {
+		return Qnil;
+	}
+
+	if (!intern_table) {
+		intern_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, NULL);
+	}
+
+	rval = (VALUE) g_hash_table_lookup (intern_table, str);
+	if (rval) {
+		return rval;
+	}
+
+	rval = rb_obj_freeze (rb_str_new2 (str));
+
+	if (strlen (str) <= INTERN_MAX_LENGTH &&
+	    g_hash_table_size (intern_table) < INTERN_MAX_ENTRIES) {
+		rb_gc_register_mark_object (rval);
+		g_hash_table_insert (intern_table, g_strdup (str),
+				     (gpointer) rval);
+	}
+
+	return rval;
+#endif
+}
+
+/* Passes len bytes of str to write with the five XML special characters
+ * escaped, runs of plain bytes are written in one go */
+void
+rb_lm__xml_escape_write (const gchar   *str,
+			 gsize          len,
+			 RbLmWriteFunc  write,
+			 gpointer       sink)
+{
+	const gchar *run = str;
+	const gchar *end = str + len;
+	const gchar *p;
+
+	for (p = str; p < end; p++) {
+		const gchar *entity;
+
+		switch (*p) {
+		case '&':  entity = "&amp;";  break;
+		case '<':  entity = "&lt;";   break;
+		case '>':  entity = "&gt;";   break;
+		case '"':  entity = "&quot;"; break;
+		case '\'': entity = "&apos;"; break;
+		default:
+			continue;
+		}
+
+		if (p > run) {
+			write (sink, run, p - run);
+		}
+		write (sink, entity, strlen (entity));
+		run = p + 1;
+	}
+
+	if (end > run) {
+		write (sink, run, end - run);
+	}
+}
+
+/* RbLmWriteFunc appending to the GString given as sink */
+void
+rb_lm__gstring_write (gpointer sink, const gchar *str, gsize len)
+{
+	g_string_append_len ((GString *) sink, str, len);
+}
+
+void
+rb_lm__xml_escape_append (GString *buf, const gchar *str, gsize len)
+{
+	rb_lm__xml_escape_write (str, len, rb_lm__gstring_write, buf);
+}
+
+/* RbLmWriteFunc appending to the Ruby String given as sink */
+void
+rb_lm__rstring_write (gpointer sink, const gchar *str, gsize len)
+{
+	rb_str_buf_cat ((VALUE) sink, str, len);
+}
+
+/* Whether a serialized stanza starts with an element called name */
+gboolean
+rb_lm__raw_is_element (const gchar *raw, const gchar *name)
+{
+	gsize len = strlen (name);
+
+	while (g_ascii_isspace (*raw)) {
+		raw++;
+	}
+
+	return raw[0] == '<' && strncmp (raw + 1, name, len) == 0 &&
+		(raw[len + 1] == '>' || raw[len + 1] == '/' ||
+		 g_ascii_isspace (raw[len + 1]));
+}
+
+/* Value of attribute name on the first element of a serialized stanza, or
+ * NULL. Entities are left as they are. */
+gchar *
+rb_lm__raw_attribute (const gchar *raw, const gchar *name)
+{
+	const gchar *end = strchr (raw, '>');
+	const gchar *p = raw;
+	gsize        len = strlen (name);
+
+	while (end && (p = strstr (p, name)) && p < end) {
+		const gchar *start, *stop;
+
+		if (p == raw || !g_ascii_isspace (p[-1]) || p[len] != '=') {
+			p += len;
+			continue;
+		}
+
+		start = p + len + 2;
+		stop = (p[len + 1] == '\'' || p[len + 1] == '"') ?
+			strchr (start, p[len + 1]) : NULL;
+
+		return stop ? g_strndup (start, stop - start) : NULL;
+	}
+
+	return NULL;
+}
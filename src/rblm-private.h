@@ -3,28 +3,175 @@
 #define __RBLM_PRIVATE_H__
 
 #include <glib.h>
+#include <string.h>
 #include <ruby.h>
 #include <loudmouth/loudmouth.h>
 
+#include "rblm-handlers.h"
+#include "rblm-reconnect.h"
+#include "rblm-stream-mgmt.h"
+#include "rblm-shaper.h"
+#include "rblm-outbound.h"
+#include "rblm-roster.h"
+
 #define GBOOL2RVAL(x) (x == TRUE ? Qtrue : Qfalse)
 #define RVAL2GBOOL(x) RTEST(x)
 
 #define LMMESSAGENODE2RVAL(x) (rb_lm_message_node_to_ruby_object(x))
+#define LMMESSAGENODE2RVAL_IN(x, owner) (rb_lm_message_node_to_ruby_object_in(x, owner))
 #define LMSSL2RVAL(x) (rb_lm_ssl_to_ruby_object(x))
+#define LMEVENTEDSSL2RVAL(x) (rb_lm_ev_ssl_to_ruby_object(x))
 #define LMPROXY2RVAL(x) (rb_lm_proxy_to_ruby_object(x))
 #define LMMESSAGE2RVAL(x) (rb_lm_message_to_ruby_object(x))
 
+/* Wrappers are typed data, older rubies free them at the end of the GC */
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+/* Native memory held by wrappers, reported so that it drives GC like
+ * memory allocated by ruby itself */
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+#define RBLM_GC_ADJUST_MEMORY(diff) (rb_gc_adjust_memory_usage((ssize_t) (diff)))
+#else
+#define RBLM_GC_ADJUST_MEMORY(diff) ((void) (diff))
+#endif
+
+/* References that dcompact functions update, pinned where GC can't move */
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+#define RBLM_GC_MARK(x) (rb_gc_mark_movable(x))
+#define RBLM_GC_LOCATION(x) (rb_gc_location(x))
+#else
+#define RBLM_GC_MARK(x) (rb_gc_mark(x))
+#define RBLM_GC_LOCATION(x) (x)
+#endif
+
+/* Data behind an LM::Message, nodes caches the single LM::MessageNode
+ * wrapper handed out for each LmMessageNode in the tree */
+typedef struct {
+	LmMessage  *message;
+	GHashTable *nodes;
+	gsize       tree_size;	/* node tree bytes reported to the GC */
+} RbLmMessage;
+
+/* Views handed out on one LmMessageNode, shared by all its wrappers */
+typedef struct _RbLmNodeViews RbLmNodeViews;
+
+/* Data behind an LM::MessageNode, owner is the LM::Message it was reached
+ * from (or Qnil) and keeps the wrapper cache alive */
+typedef struct {
+	LmMessageNode *node;
+	VALUE          owner;
+	RbLmNodeViews *views;	/* held once value_view/attribute_view was used */
+	gsize          tree_size;	/* subtree bytes reported to the GC, detached only */
+} RbLmMessageNode;
+
+/* Data behind LM::Connection and LM::EventedConnection */
+typedef struct {
+	LmConnection        *conn;
+	GMainContext        *context;	/* NULL for the default */
+	RbLmHandlerRegistry *handlers;
+	RbLmHandler         *disconnect;	/* held by handlers, NULL until set */
+	RbLmReconnect       *reconnect;	/* NULL unless enabled */
+	RbLmStreamMgmt      *stream_mgmt;	/* NULL unless enabled */
+	RbLmShaper          *shaper;		/* NULL unless enabled */
+	RbLmOutbound        *outbound;
+	RbLmRoster          *roster;		/* NULL unless enabled */
+} RbLmConnection;
+
+/* The send path of both connection classes, through the priority queues and
+ * the shaper when one is enabled. Pass m, with an optional reply handler, or
+ * raw. */
+gboolean            rblm_connection_send     (RbLmConnection   *data,
+					      LmMessage        *m,
+					      LmMessageHandler *reply,
+					      const gchar      *raw,
+					      RbLmPriority      priority,
+					      GError          **error);
+/* Sends right away, recording the stanza for stream management */
+gboolean            rblm_connection_transmit (RbLmConnection   *data,
+					      LmMessage        *m,
+					      LmMessageHandler *reply,
+					      const gchar      *raw,
+					      GError          **error);
+
+/* -- START of LmMessageNode attribute hack --
+ * Loudmouth keeps node attributes as a GSList of these in node->attributes
+ * but doesn't export the type, this will break if the internals change.
+ */
+typedef struct {
+	gchar *key;
+	gchar *value;
+} RbLmKeyValuePair;
+/* -- END of LmMessageNode attribute hack -- */
+
+/* Receives serialized output, sink is whatever the producer was given */
+typedef void (*RbLmWriteFunc) (gpointer sink, const gchar *str, gsize len);
+
 gboolean            rb_lm__is_kind_of (VALUE object, VALUE klass);
+VALUE               rb_lm__interned_str (const gchar *str);
+void                rb_lm__xml_escape_write  (const gchar   *str,
+					      gsize          len,
+					      RbLmWriteFunc  write,
+					      gpointer       sink);
+void                rb_lm__xml_escape_append (GString     *buf,
+					      const gchar *str,
+					      gsize        len);
+void                rb_lm__gstring_write     (gpointer     sink,
+					      const gchar *str,
+					      gsize        len);
+void                rb_lm__rstring_write     (gpointer     sink,
+					      const gchar *str,
+					      gsize        len);
+gboolean            rb_lm__raw_is_element    (const gchar *raw,
+					      const gchar *name);
+gchar *             rb_lm__raw_attribute     (const gchar *raw,
+					      const gchar *name);
 
 VALUE               rb_lm_message_to_ruby_object      (LmMessage     *m);
 VALUE               rb_lm_message_node_to_ruby_object (LmMessageNode *node);
+VALUE               rb_lm_message_node_to_ruby_object_in (LmMessageNode *node,
+							  VALUE          owner);
+VALUE               rb_lm_message_node_to_hash        (LmMessageNode *node,
+						       VALUE          options);
+gsize               rb_lm_message_node_memsize        (LmMessageNode *node);
+gsize               rb_lm_message_node_own_memsize    (LmMessageNode *node);
+void                rb_lm_message_account_tree        (VALUE          self);
+void                rb_lm_message_adjust_tree         (VALUE          self,
+						       gssize         delta);
+void                rb_lm_message_node_serialize      (LmMessageNode *node,
+						       RbLmWriteFunc  write,
+						       gpointer       sink);
+gchar *             rb_lm_message_node_to_raw         (LmMessageNode *node);
+VALUE               rb_lm_message_node_write_to       (LmMessageNode *node,
+						       VALUE          io);
+void                rb_lm_message_node_build          (LmMessageNode *node,
+						       VALUE          spec);
+VALUE               rb_lm_message_node_select         (LmMessageNode *node,
+						       VALUE          owner,
+						       VALUE          expr,
+						       gboolean       include_self,
+						       gboolean       first);
+LmMessage *         rblm_message_parse                (const gchar   *xml,
+						       gssize         len,
+						       GError       **error);
+void                rb_lm_ev_connection_remember_credentials (VALUE        self,
+							      const gchar *name,
+							      const gchar *password,
+							      const gchar *resource);
 VALUE               rb_lm_ssl_to_ruby_object          (LmSSL         *ssl);
+VALUE               rb_lm_ev_ssl_to_ruby_object       (LmSSL         *ssl);
 VALUE               rb_lm_proxy_to_ruby_object        (LmProxy       *proxy);
 
 LmConnection *      rb_lm_connection_from_ruby_object         (VALUE obj);
+RbLmConnection *    rb_lm_connection_data_from_ruby_object    (VALUE obj);
+LmConnection *      rb_lm_ev_connection_from_ruby_object      (VALUE obj);
+RbLmConnection *    rb_lm_ev_connection_data_from_ruby_object (VALUE obj);
 LmMessage *         rb_lm_message_from_ruby_object            (VALUE obj);
+RbLmMessage *       rb_lm_message_data_from_ruby_object       (VALUE obj);
 LmMessageNode *     rb_lm_message_node_from_ruby_object       (VALUE obj);
 LmSSL *             rb_lm_ssl_from_ruby_object                (VALUE obj);
+LmSSL *             rb_lm_ev_ssl_from_ruby_object             (VALUE obj);
 LmProxy *           rb_lm_proxy_from_ruby_object              (VALUE obj);
 
 LmConnectionState   rb_lm_connection_state_from_ruby_object   (VALUE obj);
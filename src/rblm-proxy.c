@@ -1,17 +1,27 @@
 #include "rblm.h"
+#include "rblm-private.h"
 
 VALUE lm_cProxy;
 
+void proxy_free (LmProxy *proxy);
+
+static const rb_data_type_t proxy_type = {
+	"LM::Proxy",
+	{
+		NULL,
+		(RUBY_DATA_FUNC) proxy_free,
+		NULL,
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 LmProxy *
 rb_lm_proxy_from_ruby_object (VALUE obj)
 {
 	LmProxy *proxy;
 
-	if (!rb_lm__is_kind_of (obj, lm_cProxy)) {
-		rb_raise (rb_eTypeError, "not a LmProxy");
-	}
-
-	Data_Get_Struct (obj, LmProxy, proxy);
+	TypedData_Get_Struct (obj, LmProxy, &proxy_type, proxy);
 
 	return proxy;
 }
@@ -27,8 +37,7 @@ rb_lm_proxy_to_ruby_object (LmProxy *proxy)
 {
 	if (proxy) {
 		lm_proxy_ref (proxy);
-		return Data_Wrap_Struct (lm_cProxy, NULL, 
-					 proxy_free, proxy);
+		return TypedData_Wrap_Struct (lm_cProxy, &proxy_type, proxy);
 	} else {
 		return Qnil;
 	}
@@ -36,7 +45,7 @@ rb_lm_proxy_to_ruby_object (LmProxy *proxy)
 VALUE
 proxy_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, proxy_free, NULL);
+	return TypedData_Wrap_Struct (klass, &proxy_type, NULL);
 }
 
 VALUE
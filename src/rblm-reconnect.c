@@ -0,0 +1,398 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-reconnect.h"
+#include <math.h>
+
+#define DEFAULT_INITIAL_DELAY 1.0
+#define DEFAULT_MAX_DELAY     60.0
+#define DEFAULT_MULTIPLIER    2.0
+#define DEFAULT_JITTER        0.5
+
+static void reconnect_schedule (RbLmReconnect *rc);
+
+/* Monotonic, downtime must not jump with the wall clock */
+static guint64
+reconnect_now (void)
+{
+	return (guint64) g_get_monotonic_time ();
+}
+
+static gdouble
+option_double (VALUE options, const char *key, gdouble def)
+{
+	VALUE value = rb_hash_aref (options, ID2SYM (rb_intern (key)));
+
+	return NIL_P (value) ? def : NUM2DBL (value);
+}
+
+static VALUE
+option_string (VALUE options, const char *key)
+{
+	VALUE value = rb_hash_aref (options, ID2SYM (rb_intern (key)));
+
+	if (!NIL_P (value)) {
+		StringValueCStr (value);
+	}
+
+	return value;
+}
+
+RbLmReconnect *
+rb_lm_reconnect_new (LmConnection         *conn,
+		     GMainContext         *context,
+		     VALUE                 options,
+		     VALUE                 block,
+		     LmDisconnectFunction  forward,
+		     RbLmReconnectFunc     reconnected)
+{
+	RbLmReconnect *rc;
+	gdouble        initial = DEFAULT_INITIAL_DELAY;
+	gdouble        max = DEFAULT_MAX_DELAY;
+	gdouble        multiplier = DEFAULT_MULTIPLIER;
+	gdouble        jitter = DEFAULT_JITTER;
+	guint          max_attempts = 0;
+	VALUE          user = Qnil, password = Qnil, resource = Qnil;
+
+	if (!NIL_P (options)) {
+		VALUE value;
+
+		Check_Type (options, T_HASH);
+
+		initial = option_double (options, "initial_delay", initial);
+		max = option_double (options, "max_delay", max);
+		multiplier = option_double (options, "multiplier", multiplier);
+		jitter = option_double (options, "jitter", jitter);
+
+		value = rb_hash_aref (options, ID2SYM (rb_intern ("max_attempts")));
+		if (!NIL_P (value)) {
+			max_attempts = NUM2UINT (value);
+		}
+
+		user = option_string (options, "user");
+		password = option_string (options, "password");
+		resource = option_string (options, "resource");
+	}
+
+	if (initial <= 0 || max < initial || multiplier < 1) {
+		rb_raise (rb_eArgError,
+			  "expected 0 < initial_delay <= max_delay and multiplier >= 1");
+	}
+	if (jitter < 0 || jitter > 1) {
+		rb_raise (rb_eArgError, "jitter should be between 0 and 1");
+	}
+
+	rc = g_new0 (RbLmReconnect, 1);
+	rc->ref_count = 1;
+	rc->conn = conn;
+	rc->context = context;
+	rc->initial_delay = initial;
+	rc->max_delay = max;
+	rc->multiplier = multiplier;
+	rc->jitter = jitter;
+	rc->max_attempts = max_attempts;
+	rc->forward = forward;
+	rc->handler = rblm_handler_new (block);
+	rc->reconnected = reconnected;
+	rc->rand = g_rand_new ();
+
+	if (!NIL_P (user)) {
+		rblm_reconnect_set_credentials (rc, RSTRING_PTR (user),
+						NIL_P (password) ? NULL : RSTRING_PTR (password),
+						NIL_P (resource) ? NULL : RSTRING_PTR (resource));
+	}
+
+	if (context) {
+		g_main_context_ref (context);
+	}
+
+	return rc;
+}
+
+RbLmReconnect *
+rblm_reconnect_ref (RbLmReconnect *rc)
+{
+	g_atomic_int_inc (&rc->ref_count);
+
+	return rc;
+}
+
+void
+rblm_reconnect_unref (RbLmReconnect *rc)
+{
+	if (!g_atomic_int_dec_and_test (&rc->ref_count)) {
+		return;
+	}
+
+	if (rc->context) {
+		g_main_context_unref (rc->context);
+	}
+	rblm_handler_unref (rc->handler);
+	if (rc->disconnect) {
+		rblm_handler_unref (rc->disconnect);
+	}
+	g_rand_free (rc->rand);
+	g_free (rc->user);
+	g_free (rc->password);
+	g_free (rc->resource);
+	g_free (rc);
+}
+
+void
+rblm_reconnect_set_credentials (RbLmReconnect *rc,
+				const gchar   *user,
+				const gchar   *password,
+				const gchar   *resource)
+{
+	g_free (rc->user);
+	g_free (rc->password);
+	g_free (rc->resource);
+
+	rc->user = g_strdup (user);
+	rc->password = g_strdup (password);
+	rc->resource = g_strdup (resource);
+}
+
+void
+rblm_reconnect_set_disconnect (RbLmReconnect *rc, RbLmHandler *disconnect)
+{
+	if (rc->disconnect) {
+		rblm_handler_unref (rc->disconnect);
+	}
+
+	rc->disconnect = disconnect;
+}
+
+static void
+reconnect_end_outage (RbLmReconnect *rc)
+{
+	if (rc->down_since) {
+		rc->last_downtime = reconnect_now () - rc->down_since;
+		rc->downtime += rc->last_downtime;
+		rc->down_since = 0;
+	}
+	rc->attempt = 0;
+}
+
+/* The outage ends here as far as the metrics go, the owner took over */
+void
+rblm_reconnect_cancel (RbLmReconnect *rc)
+{
+	if (rc->source) {
+		g_source_destroy (rc->source);
+		g_source_unref (rc->source);
+		rc->source = NULL;
+	}
+
+	reconnect_end_outage (rc);
+}
+
+void
+rblm_reconnect_shutdown (RbLmReconnect *rc)
+{
+	rblm_reconnect_cancel (rc);
+	rc->conn = NULL;
+	rc->handler->block = Qnil;
+	rblm_reconnect_set_disconnect (rc, NULL);
+
+	rblm_reconnect_unref (rc);
+}
+
+/* Giving up leaves the connection counted as down */
+static void
+reconnect_done (RbLmReconnect *rc, gboolean success)
+{
+	if (success) {
+		reconnect_end_outage (rc);
+		rc->reconnects++;
+	} else {
+		rc->attempt = 0;
+	}
+
+	rc->reconnected (rc, success);
+}
+
+static void
+reconnect_auth_cb (LmConnection *conn, gboolean success, gpointer user_data)
+{
+	RbLmReconnect *rc = user_data;
+
+	if (!rc->conn) {
+		return;
+	}
+
+	if (success) {
+		reconnect_done (rc, TRUE);
+	} else {
+		/* Explicit close, the disconnect function won't schedule again */
+		lm_connection_close (conn, NULL);
+		reconnect_schedule (rc);
+	}
+}
+
+static void
+reconnect_open_cb (LmConnection *conn, gboolean success, gpointer user_data)
+{
+	RbLmReconnect *rc = user_data;
+	GError        *error = NULL;
+
+	if (!rc->conn) {
+		return;
+	}
+
+	if (!success) {
+		reconnect_schedule (rc);
+		return;
+	}
+
+	if (!rc->user) {
+		reconnect_done (rc, TRUE);
+		return;
+	}
+
+	if (!lm_connection_authenticate (conn, rc->user, rc->password, rc->resource,
+					 reconnect_auth_cb,
+					 rblm_reconnect_ref (rc),
+					 (GDestroyNotify) rblm_reconnect_unref,
+					 &error)) {
+		if (error) {
+			g_error_free (error);
+		}
+		lm_connection_close (conn, NULL);
+		reconnect_schedule (rc);
+	}
+}
+
+static gboolean
+reconnect_attempt (gpointer user_data)
+{
+	RbLmReconnect *rc = user_data;
+	GError        *error = NULL;
+
+	g_source_unref (rc->source);
+	rc->source = NULL;
+
+	if (!rc->conn) {
+		return FALSE;
+	}
+
+	rc->attempts++;
+	if (!lm_connection_open (rc->conn, reconnect_open_cb,
+				 rblm_reconnect_ref (rc),
+				 (GDestroyNotify) rblm_reconnect_unref,
+				 &error)) {
+		if (error) {
+			g_error_free (error);
+		}
+		reconnect_schedule (rc);
+	}
+
+	return FALSE;
+}
+
+/* Next attempt after initial_delay * multiplier ^ attempt, capped at
+ * max_delay, less a random share of up to jitter so that connections
+ * dropped together don't come back together */
+static void
+reconnect_schedule (RbLmReconnect *rc)
+{
+	gdouble delay;
+
+	if (rc->source) {
+		return;
+	}
+
+	if (rc->max_attempts && rc->attempt >= rc->max_attempts) {
+		reconnect_done (rc, FALSE);
+		return;
+	}
+
+	delay = rc->initial_delay * pow (rc->multiplier, rc->attempt);
+	if (delay > rc->max_delay) {
+		delay = rc->max_delay;
+	}
+	delay *= 1.0 - rc->jitter * g_rand_double (rc->rand);
+	rc->attempt++;
+
+	rc->source = g_timeout_source_new ((guint) (delay * 1000));
+	g_source_set_callback (rc->source, reconnect_attempt,
+			       rblm_reconnect_ref (rc),
+			       (GDestroyNotify) rblm_reconnect_unref);
+	g_source_attach (rc->source, rc->context);
+}
+
+static void
+reconnect_disconnect_cb (LmConnection       *conn,
+			 LmDisconnectReason  reason,
+			 gpointer            user_data)
+{
+	RbLmReconnect *rc = user_data;
+
+	if (!rc->conn) {
+		return;
+	}
+
+	if (reason != LM_DISCONNECT_REASON_OK) {
+		rc->disconnects++;
+		if (!rc->down_since) {
+			rc->down_since = reconnect_now ();
+		}
+		reconnect_schedule (rc);
+	}
+
+	if (rc->disconnect) {
+		rc->forward (conn, reason, rc->disconnect);
+	}
+}
+
+void
+rblm_reconnect_install (RbLmReconnect *rc)
+{
+	lm_connection_set_disconnect_function (rc->conn,
+					       reconnect_disconnect_cb,
+					       rblm_reconnect_ref (rc),
+					       (GDestroyNotify) rblm_reconnect_unref);
+}
+
+void
+rb_lm_reconnect_mark (RbLmReconnect *rc)
+{
+	RBLM_GC_MARK (rc->handler->block);
+}
+
+void
+rb_lm_reconnect_compact (RbLmReconnect *rc)
+{
+	rc->handler->block = RBLM_GC_LOCATION (rc->handler->block);
+}
+
+static VALUE
+usec_to_sec (guint64 usec)
+{
+	return rb_float_new ((gdouble) usec / G_USEC_PER_SEC);
+}
+
+void
+rblm_reconnect_get_stats (RbLmReconnect *rc, RbLmReconnectStats *stats)
+{
+	stats->disconnects = rc->disconnects;
+	stats->reconnects = rc->reconnects;
+	stats->attempts = rc->attempts;
+	stats->downtime = rc->downtime;
+	stats->last_downtime = rc->last_downtime;
+	stats->down = rc->down_since != 0;
+}
+
+VALUE
+rb_lm_reconnect_stats_to_ruby_object (const RbLmReconnectStats *stats)
+{
+	VALUE hash = rb_hash_new ();
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("disconnects")), UINT2NUM (stats->disconnects));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("reconnects")), UINT2NUM (stats->reconnects));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("attempts")), UINT2NUM (stats->attempts));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("downtime")), usec_to_sec (stats->downtime));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("last_downtime")), usec_to_sec (stats->last_downtime));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("down")), stats->down ? Qtrue : Qfalse);
+
+	return hash;
+}
@@ -0,0 +1,105 @@
+/*
+ * Automatic reconnection of LM::Connection and LM::EventedConnection
+ *
+ * Once enabled, the connection's disconnect function is routed through the
+ * reconnect state. Any disconnect other than an explicit close schedules a
+ * new open on the main context of the connection after an exponential,
+ * jittered delay, followed by authentication with the last credentials.
+ * Message handlers, SSL and proxy live on the LmConnection itself and carry
+ * over untouched, so nothing has to be rebuilt from ruby.
+ *
+ * The state is ref-counted as Loudmouth and the pending timeout hold
+ * callbacks into it; shutting it down leaves it inert until the last of
+ * those goes away.
+ */
+
+#ifndef _RBLM_RECONNECT_H
+#define	_RBLM_RECONNECT_H
+
+#include "rblm.h"
+#include "rblm-handlers.h"
+
+typedef struct _RbLmReconnect RbLmReconnect;
+
+/* Tells the owner a reconnect succeeded, or that the attempts ran out */
+typedef void (*RbLmReconnectFunc) (RbLmReconnect *rc, gboolean success);
+
+struct _RbLmReconnect {
+	gint                  ref_count;
+	LmConnection         *conn;		/* NULL once shut down */
+	GMainContext         *context;		/* NULL for the default */
+
+	gdouble               initial_delay;	/* seconds */
+	gdouble               max_delay;
+	gdouble               multiplier;
+	gdouble               jitter;		/* 0..1, share of the delay */
+	guint                 max_attempts;	/* per outage, 0 for no limit */
+
+	gchar                *user;
+	gchar                *password;
+	gchar                *resource;
+
+	LmDisconnectFunction  forward;		/* the owner's disconnect function */
+	RbLmHandler          *disconnect;	/* held by the owner's registry */
+	RbLmHandler          *handler;		/* block told about reconnects */
+	RbLmReconnectFunc     reconnected;
+	gpointer              owner;		/* for reconnected, set by the owner */
+
+	GSource              *source;		/* pending attempt */
+	GRand                *rand;
+	guint                 attempt;		/* in the current outage */
+	guint64               down_since;	/* 0 while connected */
+
+	guint                 disconnects;
+	guint                 reconnects;
+	guint                 attempts;
+	guint64               downtime;		/* usec, over all outages */
+	guint64               last_downtime;
+};
+
+/* Counters copied out of the state, so that the Hash can be built without
+ * holding up the GLib loop */
+typedef struct {
+	guint    disconnects;
+	guint    reconnects;
+	guint    attempts;
+	guint64  downtime;		/* usec */
+	guint64  last_downtime;
+	gboolean down;
+} RbLmReconnectStats;
+
+/* Parses options (:initial_delay, :max_delay, :multiplier, :jitter,
+ * :max_attempts, :user, :password, :resource), raises before allocating */
+RbLmReconnect * rb_lm_reconnect_new (LmConnection         *conn,
+				     GMainContext         *context,
+				     VALUE                 options,
+				     VALUE                 block,
+				     LmDisconnectFunction  forward,
+				     RbLmReconnectFunc     reconnected);
+
+RbLmReconnect * rblm_reconnect_ref      (RbLmReconnect *rc);
+void            rblm_reconnect_unref    (RbLmReconnect *rc);
+
+/* Routes the disconnect function of the connection through rc */
+void            rblm_reconnect_install  (RbLmReconnect *rc);
+/* Cancels any pending attempt and makes rc inert, drops the caller's ref */
+void            rblm_reconnect_shutdown (RbLmReconnect *rc);
+/* Cancels a pending attempt, the owner opens or closes the connection */
+void            rblm_reconnect_cancel   (RbLmReconnect *rc);
+
+void            rblm_reconnect_set_credentials (RbLmReconnect *rc,
+						const gchar   *user,
+						const gchar   *password,
+						const gchar   *resource);
+
+/* Entry forwarded to on disconnects, referenced, or NULL for none */
+void            rblm_reconnect_set_disconnect  (RbLmReconnect *rc,
+						RbLmHandler   *disconnect);
+
+void            rb_lm_reconnect_mark    (RbLmReconnect *rc);
+void            rb_lm_reconnect_compact (RbLmReconnect *rc);
+void            rblm_reconnect_get_stats (RbLmReconnect      *rc,
+					  RbLmReconnectStats *stats);
+VALUE           rb_lm_reconnect_stats_to_ruby_object (const RbLmReconnectStats *stats);
+
+#endif	/* _RBLM_RECONNECT_H */
@@ -0,0 +1,531 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-roster.h"
+
+#define ROSTER_XMLNS "jabber:iq:roster"
+#define MUC_USER_XMLNS "http://jabber.org/protocol/muc#user"
+
+typedef struct {
+	gchar *show;		/* NULL when just available */
+	gchar *status;
+	gint   priority;
+} RbLmResource;
+
+typedef struct {
+	gchar      *jid;		/* bare, lower case */
+	gboolean    in_roster;
+	gchar      *name;
+	gchar      *subscription;
+	gchar      *ask;
+	gchar     **groups;
+	GHashTable *resources;	/* resource -> RbLmResource */
+} RbLmContact;
+
+struct _RbLmRosterPresence {
+	RbLmContact  *contact;		/* for a bare JID */
+	RbLmResource *resource;		/* for a full one */
+};
+
+struct _RbLmRoster {
+	gint              ref_count;
+	LmConnection     *conn;		/* NULL once shut down */
+	gboolean          consume;
+	LmMessageHandler *presence;
+	LmMessageHandler *iq;
+	GHashTable       *contacts;	/* bare jid -> RbLmContact */
+};
+
+static RbLmRoster *
+roster_ref (RbLmRoster *roster)
+{
+	g_atomic_int_inc (&roster->ref_count);
+
+	return roster;
+}
+
+static void
+roster_unref (RbLmRoster *roster)
+{
+	if (!g_atomic_int_dec_and_test (&roster->ref_count)) {
+		return;
+	}
+
+	g_hash_table_destroy (roster->contacts);
+	g_free (roster);
+}
+
+static void
+resource_free (RbLmResource *res)
+{
+	g_free (res->show);
+	g_free (res->status);
+	g_free (res);
+}
+
+static void
+contact_clear_item (RbLmContact *contact)
+{
+	g_free (contact->name);
+	g_free (contact->subscription);
+	g_free (contact->ask);
+	g_strfreev (contact->groups);
+
+	contact->name = contact->subscription = contact->ask = NULL;
+	contact->groups = NULL;
+	contact->in_roster = FALSE;
+}
+
+static void
+contact_free (RbLmContact *contact)
+{
+	contact_clear_item (contact);
+	g_hash_table_destroy (contact->resources);
+	g_free (contact->jid);
+	g_free (contact);
+}
+
+/* Splits jid into its lower cased bare part and its resource (or NULL) */
+static gchar *
+roster_bare_jid (const gchar *jid, const gchar **resource)
+{
+	const gchar *slash = strchr (jid, '/');
+	gchar       *bare;
+
+	if (resource) {
+		*resource = slash ? slash + 1 : NULL;
+	}
+
+	bare = g_ascii_strdown (jid, slash ? slash - jid : -1);
+
+	return bare;
+}
+
+static RbLmContact *
+roster_contact (RbLmRoster *roster, gchar *bare)
+{
+	RbLmContact *contact = g_hash_table_lookup (roster->contacts, bare);
+
+	if (contact) {
+		g_free (bare);
+		return contact;
+	}
+
+	contact = g_new0 (RbLmContact, 1);
+	contact->jid = bare;
+	contact->resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						    (GDestroyNotify) resource_free);
+	g_hash_table_insert (roster->contacts, contact->jid, contact);
+
+	return contact;
+}
+
+/* Contacts neither in the roster nor available aren't worth keeping */
+static void
+roster_forget_idle (RbLmRoster *roster, RbLmContact *contact)
+{
+	if (!contact->in_roster && g_hash_table_size (contact->resources) == 0) {
+		g_hash_table_remove (roster->contacts, contact->jid);
+	}
+}
+
+static gchar *
+child_value (LmMessageNode *node, const gchar *name)
+{
+	LmMessageNode *child = lm_message_node_get_child (node, name);
+
+	return child ? g_strdup (lm_message_node_get_value (child)) : NULL;
+}
+
+/* MUC occupants aren't contacts, their presences are left to the MUC code */
+static gboolean
+presence_from_occupant (LmMessage *message)
+{
+	LmMessageNode *child;
+
+	for (child = message->node->children; child; child = child->next) {
+		const gchar *xmlns = lm_message_node_get_attribute (child, "xmlns");
+
+		if (strcmp (child->name, "x") == 0 && xmlns &&
+		    strcmp (xmlns, MUC_USER_XMLNS) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static LmHandlerResult
+roster_presence_cb (LmMessageHandler *handler,
+		    LmConnection     *connection,
+		    LmMessage        *message,
+		    gpointer          user_data)
+{
+	RbLmRoster       *roster = user_data;
+	LmMessageSubType  type = lm_message_get_sub_type (message);
+	const gchar      *from = lm_message_node_get_attribute (message->node, "from");
+	const gchar      *resource;
+	RbLmContact      *contact;
+	gboolean          consume;
+
+	if (!roster->conn || !from ||
+	    (type != LM_MESSAGE_SUB_TYPE_AVAILABLE &&
+	     type != LM_MESSAGE_SUB_TYPE_UNAVAILABLE) ||
+	    presence_from_occupant (message)) {
+		return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+	}
+
+	contact = roster_contact (roster, roster_bare_jid (from, &resource));
+	if (!resource) {
+		resource = "";
+	}
+
+	/* Only presences of roster contacts are consumed, ruby still sees the
+	 * rest; read before an unavailable presence forgets the contact */
+	consume = roster->consume && contact->in_roster;
+
+	if (type == LM_MESSAGE_SUB_TYPE_AVAILABLE) {
+		RbLmResource *res = g_new0 (RbLmResource, 1);
+		gchar        *priority = child_value (message->node, "priority");
+
+		res->show = child_value (message->node, "show");
+		res->status = child_value (message->node, "status");
+		res->priority = priority ? atoi (priority) : 0;
+		g_free (priority);
+
+		g_hash_table_replace (contact->resources, g_strdup (resource), res);
+	} else {
+		g_hash_table_remove (contact->resources, resource);
+		roster_forget_idle (roster, contact);
+	}
+
+	return consume ? LM_HANDLER_RESULT_REMOVE_MESSAGE :
+		LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+static void
+roster_update_item (RbLmRoster *roster, LmMessageNode *item)
+{
+	const gchar   *jid = lm_message_node_get_attribute (item, "jid");
+	const gchar   *subscription = lm_message_node_get_attribute (item, "subscription");
+	RbLmContact   *contact;
+	LmMessageNode *child;
+	GPtrArray     *groups;
+
+	if (!jid) {
+		return;
+	}
+
+	contact = roster_contact (roster, roster_bare_jid (jid, NULL));
+	contact_clear_item (contact);
+
+	if (subscription && strcmp (subscription, "remove") == 0) {
+		roster_forget_idle (roster, contact);
+		return;
+	}
+
+	contact->in_roster = TRUE;
+	contact->name = g_strdup (lm_message_node_get_attribute (item, "name"));
+	contact->subscription = g_strdup (subscription ? subscription : "none");
+	contact->ask = g_strdup (lm_message_node_get_attribute (item, "ask"));
+
+	groups = g_ptr_array_new ();
+	for (child = item->children; child; child = child->next) {
+		if (strcmp (child->name, "group") == 0 && child->value) {
+			g_ptr_array_add (groups, g_strdup (child->value));
+		}
+	}
+	g_ptr_array_add (groups, NULL);
+	contact->groups = (gchar **) g_ptr_array_free (groups, FALSE);
+}
+
+static void
+roster_drop_item (gpointer key, RbLmContact *contact, gpointer user_data)
+{
+	contact_clear_item (contact);
+}
+
+static gboolean
+roster_is_idle (gpointer key, RbLmContact *contact, gpointer user_data)
+{
+	return !contact->in_roster && g_hash_table_size (contact->resources) == 0;
+}
+
+/* Whether a roster result or push comes from the server, that is without a
+ * from or from the account's bare JID. Anything else is spoofed. */
+static gboolean
+roster_from_account (LmConnection *connection, LmMessage *message)
+{
+	const gchar *from = lm_message_node_get_attribute (message->node, "from");
+	const gchar *jid;
+	gchar       *bare;
+	gboolean     res;
+
+	if (!from) {
+		return TRUE;
+	}
+
+	jid = lm_connection_get_jid (connection);
+	if (!jid || strchr (from, '/')) {
+		return FALSE;
+	}
+
+	bare = roster_bare_jid (jid, NULL);
+	res = g_ascii_strcasecmp (from, bare) == 0;
+	g_free (bare);
+
+	return res;
+}
+
+/* Roster results replace the whole roster, pushes update single items */
+static LmHandlerResult
+roster_iq_cb (LmMessageHandler *handler,
+	      LmConnection     *connection,
+	      LmMessage        *message,
+	      gpointer          user_data)
+{
+	RbLmRoster       *roster = user_data;
+	LmMessageSubType  type = lm_message_get_sub_type (message);
+	LmMessageNode    *query, *item;
+	const gchar      *xmlns;
+
+	if (!roster->conn ||
+	    (type != LM_MESSAGE_SUB_TYPE_RESULT && type != LM_MESSAGE_SUB_TYPE_SET) ||
+	    !roster_from_account (connection, message)) {
+		return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+	}
+
+	query = lm_message_node_get_child (message->node, "query");
+	xmlns = query ? lm_message_node_get_attribute (query, "xmlns") : NULL;
+	if (!xmlns || strcmp (xmlns, ROSTER_XMLNS) != 0) {
+		return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+	}
+
+	if (type == LM_MESSAGE_SUB_TYPE_RESULT) {
+		g_hash_table_foreach (roster->contacts, (GHFunc) roster_drop_item, NULL);
+	}
+
+	for (item = query->children; item; item = item->next) {
+		if (strcmp (item->name, "item") == 0) {
+			roster_update_item (roster, item);
+		}
+	}
+
+	if (type == LM_MESSAGE_SUB_TYPE_RESULT) {
+		g_hash_table_foreach_remove (roster->contacts, (GHRFunc) roster_is_idle, NULL);
+	}
+
+	return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+RbLmRoster *
+rblm_roster_new (LmConnection *conn, gboolean consume)
+{
+	RbLmRoster *roster = g_new0 (RbLmRoster, 1);
+
+	roster->ref_count = 1;
+	roster->conn = conn;
+	roster->consume = consume;
+	roster->contacts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+						  (GDestroyNotify) contact_free);
+
+	roster->presence = lm_message_handler_new (roster_presence_cb,
+						   roster_ref (roster),
+						   (GDestroyNotify) roster_unref);
+	roster->iq = lm_message_handler_new (roster_iq_cb,
+					     roster_ref (roster),
+					     (GDestroyNotify) roster_unref);
+	lm_connection_register_message_handler (conn, roster->presence,
+						LM_MESSAGE_TYPE_PRESENCE,
+						LM_HANDLER_PRIORITY_FIRST);
+	lm_connection_register_message_handler (conn, roster->iq,
+						LM_MESSAGE_TYPE_IQ,
+						LM_HANDLER_PRIORITY_FIRST);
+
+	return roster;
+}
+
+void
+rblm_roster_shutdown (RbLmRoster *roster)
+{
+	lm_connection_unregister_message_handler (roster->conn, roster->presence,
+						  LM_MESSAGE_TYPE_PRESENCE);
+	lm_connection_unregister_message_handler (roster->conn, roster->iq,
+						  LM_MESSAGE_TYPE_IQ);
+	lm_message_handler_unref (roster->presence);
+	lm_message_handler_unref (roster->iq);
+	roster->conn = NULL;
+
+	roster_unref (roster);
+}
+
+static VALUE
+str_or_nil (const gchar *str)
+{
+	return str ? rb_str_new2 (str) : Qnil;
+}
+
+static VALUE
+resource_to_ruby_object (RbLmResource *res)
+{
+	VALUE hash = rb_hash_new ();
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("show")), rb_lm__interned_str (res->show));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("status")), str_or_nil (res->status));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("priority")), INT2NUM (res->priority));
+
+	return hash;
+}
+
+static void
+resource_add_to_hash (const gchar *name, RbLmResource *res, VALUE hash)
+{
+	rb_hash_aset (hash, rb_str_new2 (name), resource_to_ruby_object (res));
+}
+
+static VALUE
+contact_to_ruby_object (RbLmContact *contact)
+{
+	VALUE hash = rb_hash_new ();
+	VALUE resources = rb_hash_new ();
+	VALUE groups = rb_ary_new ();
+	int   i;
+
+	for (i = 0; contact->groups && contact->groups[i]; i++) {
+		rb_ary_push (groups, rb_str_new2 (contact->groups[i]));
+	}
+	g_hash_table_foreach (contact->resources, (GHFunc) resource_add_to_hash,
+			      (gpointer) resources);
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("jid")), rb_str_new2 (contact->jid));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("in_roster")), GBOOL2RVAL (contact->in_roster));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("name")), str_or_nil (contact->name));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("subscription")),
+		      rb_lm__interned_str (contact->subscription));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("ask")), rb_lm__interned_str (contact->ask));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("groups")), groups);
+	rb_hash_aset (hash, ID2SYM (rb_intern ("resources")), resources);
+
+	return hash;
+}
+
+VALUE
+rb_lm_roster_presence_to_ruby_object (const RbLmRosterPresence *presence)
+{
+	if (presence->contact) {
+		return contact_to_ruby_object (presence->contact);
+	}
+
+	return resource_to_ruby_object (presence->resource);
+}
+
+VALUE
+rb_lm_roster_jids_to_ruby_object (gchar * const *jids)
+{
+	VALUE ary = rb_ary_new ();
+	int   i;
+
+	for (i = 0; jids[i]; i++) {
+		rb_ary_push (ary, rb_str_new2 (jids[i]));
+	}
+
+	return ary;
+}
+
+static RbLmResource *
+resource_copy (const RbLmResource *res)
+{
+	RbLmResource *copy = g_new (RbLmResource, 1);
+
+	copy->show = g_strdup (res->show);
+	copy->status = g_strdup (res->status);
+	copy->priority = res->priority;
+
+	return copy;
+}
+
+static void
+contact_copy_resource (const gchar *name, RbLmResource *res, GHashTable *resources)
+{
+	g_hash_table_insert (resources, g_strdup (name), resource_copy (res));
+}
+
+static RbLmContact *
+contact_copy (const RbLmContact *contact)
+{
+	RbLmContact *copy = g_new (RbLmContact, 1);
+
+	copy->jid = g_strdup (contact->jid);
+	copy->in_roster = contact->in_roster;
+	copy->name = g_strdup (contact->name);
+	copy->subscription = g_strdup (contact->subscription);
+	copy->ask = g_strdup (contact->ask);
+	copy->groups = g_strdupv (contact->groups);
+	copy->resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						 (GDestroyNotify) resource_free);
+	g_hash_table_foreach (contact->resources, (GHFunc) contact_copy_resource,
+			      copy->resources);
+
+	return copy;
+}
+
+RbLmRosterPresence *
+rblm_roster_presence_of (RbLmRoster *roster, const gchar *jid)
+{
+	const gchar        *resource;
+	gchar              *bare = roster_bare_jid (jid, &resource);
+	RbLmContact        *contact = g_hash_table_lookup (roster->contacts, bare);
+	RbLmResource       *res = NULL;
+	RbLmRosterPresence *presence;
+
+	g_free (bare);
+
+	if (!contact) {
+		return NULL;
+	}
+	if (resource) {
+		res = g_hash_table_lookup (contact->resources, resource);
+		if (!res) {
+			return NULL;
+		}
+	}
+
+	presence = g_new0 (RbLmRosterPresence, 1);
+	if (res) {
+		presence->resource = resource_copy (res);
+	} else {
+		presence->contact = contact_copy (contact);
+	}
+
+	return presence;
+}
+
+void
+rblm_roster_presence_free (RbLmRosterPresence *presence)
+{
+	if (presence->contact) {
+		contact_free (presence->contact);
+	}
+	if (presence->resource) {
+		resource_free (presence->resource);
+	}
+	g_free (presence);
+}
+
+static void
+contact_add_jid (const gchar *jid, RbLmContact *contact, GPtrArray *jids)
+{
+	if (contact->in_roster) {
+		g_ptr_array_add (jids, g_strdup (jid));
+	}
+}
+
+gchar **
+rblm_roster_jids (RbLmRoster *roster)
+{
+	GPtrArray *jids = g_ptr_array_new ();
+
+	g_hash_table_foreach (roster->contacts, (GHFunc) contact_add_jid, jids);
+	g_ptr_array_add (jids, NULL);
+
+	return (gchar **) g_ptr_array_free (jids, FALSE);
+}
@@ -0,0 +1,46 @@
+/*
+ * Roster and presence cache of a connection
+ *
+ * Native handlers registered ahead of everything else keep a table of bare
+ * JIDs, each with its roster item (name, subscription, ask, groups) and the
+ * resources it is available on (show, status, priority). Roster results and
+ * pushes update the items, available and unavailable presences the
+ * resources. Roster stanzas only count without a from or from the account's
+ * bare JID, and presences from MUC occupants are left alone. With consume
+ * set, presences of roster contacts stop there and never reach ruby
+ * handlers; subscription and error presences always go on.
+ *
+ * Lookups are a hash table probe. Call from the thread running the
+ * connection's main loop, or with the GLib thread paused for evented
+ * connections.
+ */
+
+#ifndef _RBLM_ROSTER_H
+#define	_RBLM_ROSTER_H
+
+#include "rblm.h"
+
+typedef struct _RbLmRoster RbLmRoster;
+
+RbLmRoster * rblm_roster_new      (LmConnection *conn,
+				   gboolean      consume);
+/* Unregisters the handlers and makes roster inert, drops the caller's ref */
+void         rblm_roster_shutdown (RbLmRoster   *roster);
+
+/* Copies of cache entries, for building ruby objects without holding up the
+ * GLib loop */
+typedef struct _RbLmRosterPresence RbLmRosterPresence;
+
+/* What is known of a bare JID, or of the resource of a full one, NULL when
+ * nothing is */
+RbLmRosterPresence * rblm_roster_presence_of   (RbLmRoster         *roster,
+						const gchar        *jid);
+void                 rblm_roster_presence_free (RbLmRosterPresence *presence);
+/* Bare JIDs of the roster items, free with g_strfreev () */
+gchar **             rblm_roster_jids          (RbLmRoster         *roster);
+
+/* Hash for a bare JID, the resource's own Hash for a full one */
+VALUE        rb_lm_roster_presence_to_ruby_object (const RbLmRosterPresence *presence);
+VALUE        rb_lm_roster_jids_to_ruby_object     (gchar * const            *jids);
+
+#endif	/* _RBLM_ROSTER_H */
@@ -0,0 +1,554 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-shaper.h"
+
+#define DEFAULT_BURST 1.0	/* seconds worth of tokens */
+
+typedef struct {
+	gdouble rate;		/* per second, 0 for no limit */
+	gdouble capacity;
+	gdouble tokens;
+	guint64 stamp;		/* usec of the last refill */
+} RbLmBucket;
+
+typedef struct {
+	gchar      *domain;	/* "" when not shaping per domain */
+	RbLmBucket  bytes;
+	RbLmBucket  stanzas;
+	GQueue      queue;
+	gboolean    active;	/* in the shaper's round */
+} RbLmShaperDest;
+
+typedef struct {
+	LmMessage        *message;	/* either a message with its reply */
+	LmMessageHandler *reply;
+	gchar            *raw;		/* or a serialized stanza */
+	gsize             bytes;
+	guint64           queued_at;
+} RbLmShaped;
+
+struct _RbLmShaper {
+	RbLmConnection *owner;
+	GMainContext   *context;	/* NULL for the default */
+	RbLmBucket      bytes;
+	RbLmBucket      stanzas;
+	gdouble         domain_bytes_rate;
+	gdouble         domain_stanzas_rate;
+	gdouble         burst;
+
+	GHashTable     *dests;		/* domain -> RbLmShaperDest */
+	GQueue          active;		/* dests with stanzas queued */
+	GSource        *source;		/* pending dispatch */
+	guint64         swept;		/* usec of the last sweep for idle dests */
+
+	guint           depth;
+	guint           max_depth;
+	guint64         queued;		/* stanzas that had to wait */
+	guint64         failed;		/* queued stanzas that couldn't be sent */
+	guint64         delay;		/* usec, over all queued stanzas */
+	guint64         max_delay;
+};
+
+static guint64
+shaper_now (void)
+{
+	return (guint64) g_get_monotonic_time ();
+}
+
+static gdouble
+option_rate (VALUE options, const char *key)
+{
+	VALUE   value = rb_hash_aref (options, ID2SYM (rb_intern (key)));
+	gdouble rate;
+
+	if (NIL_P (value)) {
+		return 0;
+	}
+
+	rate = NUM2DBL (value);
+	if (rate < 0) {
+		rb_raise (rb_eArgError, "%s can't be negative", key);
+	}
+
+	return rate;
+}
+
+static void
+bucket_init (RbLmBucket *b, gdouble rate, gdouble burst, gdouble min, guint64 now)
+{
+	b->rate = rate;
+	b->capacity = MAX (rate * burst, min);
+	b->tokens = b->capacity;
+	b->stamp = now;
+}
+
+/* usec until cost fits, 0 if it does now. A cost above the capacity goes
+ * through on a full bucket and leaves it in debt. */
+static guint64
+bucket_wait (RbLmBucket *b, gdouble cost, guint64 now)
+{
+	gdouble need;
+
+	if (b->rate <= 0) {
+		return 0;
+	}
+
+	if (now > b->stamp) {
+		b->tokens = MIN (b->capacity,
+				 b->tokens + b->rate * (now - b->stamp) / G_USEC_PER_SEC);
+	}
+	b->stamp = now;
+
+	need = MIN (cost, b->capacity);
+	if (b->tokens >= need) {
+		return 0;
+	}
+
+	return (guint64) ((need - b->tokens) / b->rate * G_USEC_PER_SEC) + 1;
+}
+
+/* Whether b has refilled, so that a new bucket would do the same */
+static gboolean
+bucket_full (RbLmBucket *b, guint64 now)
+{
+	gdouble tokens = b->tokens;
+
+	if (b->rate <= 0) {
+		return TRUE;
+	}
+
+	if (now > b->stamp) {
+		tokens += b->rate * (now - b->stamp) / G_USEC_PER_SEC;
+	}
+
+	return tokens >= b->capacity;
+}
+
+static void
+bucket_take (RbLmBucket *b, gdouble cost)
+{
+	if (b->rate > 0) {
+		b->tokens -= cost;
+	}
+}
+
+static void
+shaped_free (RbLmShaped *entry)
+{
+	if (entry->message) {
+		lm_message_unref (entry->message);
+	}
+	if (entry->reply) {
+		lm_message_handler_unref (entry->reply);
+	}
+	g_free (entry->raw);
+	g_free (entry);
+}
+
+static void
+dest_free (RbLmShaperDest *dest)
+{
+	RbLmShaped *entry;
+
+	while ((entry = g_queue_pop_head (&dest->queue))) {
+		shaped_free (entry);
+	}
+	g_free (dest->domain);
+	g_free (dest);
+}
+
+RbLmShaper *
+rb_lm_shaper_new (gpointer owner, GMainContext *context, VALUE options)
+{
+	RbLmShaper *sh;
+	gdouble     bytes, stanzas, domain_bytes, domain_stanzas;
+	gdouble     burst = DEFAULT_BURST;
+	VALUE       value;
+	guint64     now = shaper_now ();
+
+	Check_Type (options, T_HASH);
+
+	bytes = option_rate (options, "bytes_per_sec");
+	stanzas = option_rate (options, "stanzas_per_sec");
+	domain_bytes = option_rate (options, "domain_bytes_per_sec");
+	domain_stanzas = option_rate (options, "domain_stanzas_per_sec");
+
+	value = rb_hash_aref (options, ID2SYM (rb_intern ("burst")));
+	if (!NIL_P (value)) {
+		burst = NUM2DBL (value);
+	}
+
+	if (burst <= 0) {
+		rb_raise (rb_eArgError, "burst should be positive");
+	}
+	if (bytes == 0 && stanzas == 0 && domain_bytes == 0 && domain_stanzas == 0) {
+		rb_raise (rb_eArgError, "expected at least one rate");
+	}
+
+	sh = g_new0 (RbLmShaper, 1);
+	sh->owner = owner;
+	sh->context = context;
+	sh->burst = burst;
+	sh->domain_bytes_rate = domain_bytes;
+	sh->domain_stanzas_rate = domain_stanzas;
+	bucket_init (&sh->bytes, bytes, burst, 1, now);
+	bucket_init (&sh->stanzas, stanzas, burst, 1, now);
+
+	sh->swept = now;
+	sh->dests = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+					   (GDestroyNotify) dest_free);
+	g_queue_init (&sh->active);
+
+	if (context) {
+		g_main_context_ref (context);
+	}
+
+	return sh;
+}
+
+static void
+shaper_cancel (RbLmShaper *sh)
+{
+	if (sh->source) {
+		g_source_destroy (sh->source);
+		g_source_unref (sh->source);
+		sh->source = NULL;
+	}
+}
+
+void
+rblm_shaper_free (RbLmShaper *sh)
+{
+	shaper_cancel (sh);
+
+	g_queue_clear (&sh->active);
+	g_hash_table_destroy (sh->dests);
+	if (sh->context) {
+		g_main_context_unref (sh->context);
+	}
+	g_free (sh);
+}
+
+static gboolean
+shaper_transmit (RbLmShaper *sh, RbLmShaped *entry, GError **error)
+{
+	if (entry->message) {
+		return rblm_connection_transmit (sh->owner, entry->message,
+						 entry->reply, NULL, error);
+	}
+
+	return rblm_connection_transmit (sh->owner, NULL, NULL, entry->raw, error);
+}
+
+/* Sends a queued stanza and accounts for its wait */
+static void
+shaper_release (RbLmShaper *sh, RbLmShaped *entry, guint64 now)
+{
+	guint64 delay = now > entry->queued_at ? now - entry->queued_at : 0;
+
+	if (!shaper_transmit (sh, entry, NULL)) {
+		sh->failed++;
+	}
+
+	sh->delay += delay;
+	sh->max_delay = MAX (sh->max_delay, delay);
+	sh->depth--;
+	shaped_free (entry);
+}
+
+void
+rblm_shaper_flush (RbLmShaper *sh)
+{
+	RbLmShaperDest *dest;
+	guint64         now = shaper_now ();
+
+	shaper_cancel (sh);
+
+	while ((dest = g_queue_pop_head (&sh->active))) {
+		RbLmShaped *entry;
+
+		while ((entry = g_queue_pop_head (&dest->queue))) {
+			shaper_release (sh, entry, now);
+		}
+		dest->active = FALSE;
+	}
+
+	if (sh->owner->outbound) {
+		rblm_outbound_resume (sh->owner->outbound);
+	}
+	rblm_shaper_free (sh);
+}
+
+static guint64
+shaper_wait (RbLmShaper *sh, RbLmShaperDest *dest, RbLmShaped *entry, guint64 now)
+{
+	guint64 wait = 0;
+
+	wait = MAX (wait, bucket_wait (&sh->stanzas, 1, now));
+	wait = MAX (wait, bucket_wait (&sh->bytes, entry->bytes, now));
+	wait = MAX (wait, bucket_wait (&dest->stanzas, 1, now));
+	wait = MAX (wait, bucket_wait (&dest->bytes, entry->bytes, now));
+
+	return wait;
+}
+
+static void
+shaper_take (RbLmShaper *sh, RbLmShaperDest *dest, RbLmShaped *entry)
+{
+	bucket_take (&sh->stanzas, 1);
+	bucket_take (&sh->bytes, entry->bytes);
+	bucket_take (&dest->stanzas, 1);
+	bucket_take (&dest->bytes, entry->bytes);
+}
+
+static gboolean shaper_timeout (gpointer user_data);
+
+static void
+shaper_schedule (RbLmShaper *sh, guint64 wait)
+{
+	if (sh->source) {
+		return;
+	}
+
+	sh->source = g_timeout_source_new ((guint) ((wait + 999) / 1000));
+	g_source_set_callback (sh->source, shaper_timeout, sh, NULL);
+	g_source_attach (sh->source, sh->context);
+}
+
+/* Goes round the waiting domains, sending the head of each that fits, until
+ * a whole round sends nothing, then waits for the earliest refill */
+static void
+shaper_dispatch (RbLmShaper *sh)
+{
+	guint64 now = shaper_now ();
+	guint64 wait = 0;
+	guint   idle = 0;
+
+	while (idle < g_queue_get_length (&sh->active)) {
+		RbLmShaperDest *dest = g_queue_pop_head (&sh->active);
+		RbLmShaped     *entry = g_queue_peek_head (&dest->queue);
+		guint64         need = shaper_wait (sh, dest, entry, now);
+
+		if (need) {
+			g_queue_push_tail (&sh->active, dest);
+			wait = wait ? MIN (wait, need) : need;
+			idle++;
+			continue;
+		}
+
+		shaper_take (sh, dest, entry);
+		g_queue_pop_head (&dest->queue);
+		shaper_release (sh, entry, now);
+		idle = 0;
+
+		if (g_queue_is_empty (&dest->queue)) {
+			dest->active = FALSE;
+		} else {
+			g_queue_push_tail (&sh->active, dest);
+		}
+	}
+
+	if (wait) {
+		shaper_schedule (sh, wait);
+	} else if (sh->owner->outbound) {
+		rblm_outbound_resume (sh->owner->outbound);
+	}
+}
+
+static gboolean
+shaper_timeout (gpointer user_data)
+{
+	RbLmShaper *sh = user_data;
+
+	g_source_unref (sh->source);
+	sh->source = NULL;
+
+	shaper_dispatch (sh);
+
+	return FALSE;
+}
+
+/* Domain part of a JID, "" for none */
+static gchar *
+jid_domain (const gchar *to)
+{
+	const gchar *start, *slash;
+
+	if (!to) {
+		return g_strdup ("");
+	}
+
+	start = strchr (to, '@');
+	start = start ? start + 1 : to;
+	slash = strchr (start, '/');
+
+	return slash ? g_strndup (start, slash - start) : g_strdup (start);
+}
+
+static void
+count_write (gpointer sink, const gchar *str, gsize len)
+{
+	*(gsize *) sink += len;
+}
+
+static gboolean
+dest_idle (gpointer key, gpointer value, gpointer user_data)
+{
+	RbLmShaperDest *dest = value;
+	guint64         now = *(guint64 *) user_data;
+
+	return !dest->active &&
+		bucket_full (&dest->bytes, now) && bucket_full (&dest->stanzas, now);
+}
+
+/* Forgets domains with nothing queued whose buckets have refilled, at most
+ * once per burst so that the sweep stays cheap next to the sends */
+static void
+shaper_sweep (RbLmShaper *sh, guint64 now)
+{
+	if (now - sh->swept < (guint64) (sh->burst * G_USEC_PER_SEC)) {
+		return;
+	}
+
+	g_hash_table_foreach_remove (sh->dests, dest_idle, &now);
+	sh->swept = now;
+}
+
+static RbLmShaperDest *
+shaper_dest (RbLmShaper *sh, LmMessage *m, const gchar *raw, guint64 now)
+{
+	RbLmShaperDest *dest;
+	gchar          *domain;
+
+	if (sh->domain_bytes_rate > 0 || sh->domain_stanzas_rate > 0) {
+		if (m) {
+			domain = jid_domain (lm_message_node_get_attribute (m->node, "to"));
+		} else {
+			gchar *to = rb_lm__raw_attribute (raw, "to");
+
+			domain = jid_domain (to);
+			g_free (to);
+		}
+	} else {
+		domain = g_strdup ("");
+	}
+
+	dest = g_hash_table_lookup (sh->dests, domain);
+	if (dest) {
+		g_free (domain);
+		return dest;
+	}
+
+	dest = g_new0 (RbLmShaperDest, 1);
+	dest->domain = domain;
+	bucket_init (&dest->bytes, sh->domain_bytes_rate, sh->burst, 1, now);
+	bucket_init (&dest->stanzas, sh->domain_stanzas_rate, sh->burst, 1, now);
+	g_queue_init (&dest->queue);
+	g_hash_table_insert (sh->dests, dest->domain, dest);
+
+	return dest;
+}
+
+gboolean
+rblm_shaper_send (RbLmShaper       *sh,
+		  LmMessage        *m,
+		  LmMessageHandler *reply,
+		  const gchar      *raw,
+		  gboolean          urgent,
+		  GError          **error)
+{
+	RbLmShaperDest *dest;
+	RbLmShaped      entry = { m, reply, (gchar *) raw, 0, 0 };
+	RbLmShaped     *queued;
+	gchar          *snapshot = NULL;
+	guint64         now = shaper_now ();
+	gboolean        res;
+
+	/* Serialized once, here, so it is what goes out however long it waits
+	 * and nothing serializes it again. A reply handler needs the message. */
+	if (m && !reply) {
+		snapshot = rb_lm_message_node_to_raw (m->node);
+		entry.message = m = NULL;
+		entry.raw = snapshot;
+		raw = snapshot;
+	}
+
+	if (sh->bytes.rate > 0 || sh->domain_bytes_rate > 0) {
+		if (m) {
+			rb_lm_message_node_serialize (m->node, count_write, &entry.bytes);
+		} else {
+			entry.bytes = strlen (raw);
+		}
+	}
+
+	shaper_sweep (sh, now);
+	dest = shaper_dest (sh, m, raw, now);
+
+	/* Urgent stanzas overtake the queue and leave the buckets in debt */
+	if (urgent || (!dest->active && shaper_wait (sh, dest, &entry, now) == 0)) {
+		shaper_take (sh, dest, &entry);
+		res = shaper_transmit (sh, &entry, error);
+		g_free (snapshot);
+
+		return res;
+	}
+
+	queued = g_new0 (RbLmShaped, 1);
+	queued->message = m ? lm_message_ref (m) : NULL;
+	queued->reply = reply ? lm_message_handler_ref (reply) : NULL;
+	queued->raw = snapshot ? snapshot : g_strdup (raw);
+	queued->bytes = entry.bytes;
+	queued->queued_at = now;
+	g_queue_push_tail (&dest->queue, queued);
+
+	if (!dest->active) {
+		dest->active = TRUE;
+		g_queue_push_tail (&sh->active, dest);
+	}
+
+	sh->queued++;
+	sh->depth++;
+	sh->max_depth = MAX (sh->max_depth, sh->depth);
+
+	if (!sh->source) {
+		shaper_dispatch (sh);
+	}
+
+	return TRUE;
+}
+
+guint
+rblm_shaper_depth (RbLmShaper *sh)
+{
+	return sh->depth;
+}
+
+void
+rblm_shaper_get_stats (RbLmShaper *sh, RbLmShaperStats *stats)
+{
+	stats->depth = sh->depth;
+	stats->max_depth = sh->max_depth;
+	stats->domains = g_hash_table_size (sh->dests);
+	stats->queued = sh->queued;
+	stats->failed = sh->failed;
+	stats->delay = sh->delay;
+	stats->max_delay = sh->max_delay;
+}
+
+VALUE
+rb_lm_shaper_stats_to_ruby_object (const RbLmShaperStats *stats)
+{
+	VALUE hash = rb_hash_new ();
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("depth")), UINT2NUM (stats->depth));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("max_depth")), UINT2NUM (stats->max_depth));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("domains")), UINT2NUM (stats->domains));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("queued")), ULL2NUM (stats->queued));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("failed")), ULL2NUM (stats->failed));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("delay")),
+		      rb_float_new ((gdouble) stats->delay / G_USEC_PER_SEC));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("max_delay")),
+		      rb_float_new ((gdouble) stats->max_delay / G_USEC_PER_SEC));
+
+	return hash;
+}
@@ -0,0 +1,64 @@
+/*
+ * Outbound traffic shaping for LM::Connection and LM::EventedConnection
+ *
+ * Token buckets limit bytes and stanzas per second for the whole connection
+ * and, optionally, for each destination domain. A stanza that doesn't fit
+ * is queued behind the others for its domain and sent from a timeout on the
+ * connection's main context once the buckets have refilled, so ruby never
+ * waits. Domains take turns when the connection bucket is the bottleneck,
+ * and order is kept within each domain.
+ *
+ * Messages are serialized when they are handed over and the string is what
+ * gets sent, so changes made to a message after sending it never show. Only
+ * messages with a reply handler are held by reference, Loudmouth needs them
+ * to match the reply. Domains with nothing queued are forgotten once their
+ * buckets have refilled. Call from the thread running the connection's main
+ * loop, or with the GLib thread paused for evented connections.
+ */
+
+#ifndef _RBLM_SHAPER_H
+#define	_RBLM_SHAPER_H
+
+#include "rblm.h"
+
+typedef struct _RbLmShaper RbLmShaper;
+
+/* Counters copied out of the shaper */
+typedef struct {
+	guint   depth;
+	guint   max_depth;
+	guint   domains;
+	guint64 queued;
+	guint64 failed;
+	guint64 delay;		/* usec */
+	guint64 max_delay;
+} RbLmShaperStats;
+
+/* Parses options (:bytes_per_sec, :stanzas_per_sec, :domain_bytes_per_sec,
+ * :domain_stanzas_per_sec, :burst), raises before allocating. owner is the
+ * RbLmConnection the stanzas are eventually transmitted through. */
+RbLmShaper * rb_lm_shaper_new      (gpointer          owner,
+				    GMainContext     *context,
+				    VALUE             options);
+/* Sends whatever is still queued, ignoring the limits, and frees sh */
+void         rblm_shaper_flush     (RbLmShaper       *sh);
+/* Drops whatever is still queued and frees sh */
+void         rblm_shaper_free      (RbLmShaper       *sh);
+
+/* Takes a serialized copy of m or raw, or a ref on m with its reply handler. Returns FALSE
+ * only when a stanza sent right away failed. Urgent stanzas are sent right
+ * away whatever the buckets hold. */
+gboolean     rblm_shaper_send      (RbLmShaper       *sh,
+				    LmMessage        *m,
+				    LmMessageHandler *reply,
+				    const gchar      *raw,
+				    gboolean          urgent,
+				    GError          **error);
+/* Stanzas waiting for tokens */
+guint        rblm_shaper_depth     (RbLmShaper       *sh);
+
+void         rblm_shaper_get_stats (RbLmShaper       *sh,
+				    RbLmShaperStats  *stats);
+VALUE        rb_lm_shaper_stats_to_ruby_object (const RbLmShaperStats *stats);
+
+#endif	/* _RBLM_SHAPER_H */
@@ -3,6 +3,7 @@
 #include "rblm-synchronizer.h"
 
 static VALUE lm_cSink;
+static VALUE cleanup_callback;
 
 static void
 sink_free (void* _)
@@ -10,6 +11,17 @@ sink_free (void* _)
     rblm_shutdown_sync();
 }
 
+static const rb_data_type_t sink_cleanup_type = {
+    "LM::Sink cleanup",
+    {
+        NULL,
+        sink_free,
+        NULL,
+    },
+    0, 0,
+    0
+};
+
 static VALUE
 sink_file_descriptor (VALUE self)
 {
@@ -32,7 +44,7 @@ sink_notification (VALUE self)
 void
 Init_lm_sink (VALUE lm_mLM)
 {
-    VALUE cleanup_callback = Data_Wrap_Struct(rb_cObject, 0, sink_free, NULL);
+    cleanup_callback = TypedData_Wrap_Struct (rb_cObject, &sink_cleanup_type, NULL);
     rb_global_variable (&cleanup_callback);
 
     lm_cSink = rb_define_class_under (lm_mLM, "Sink", rb_cObject);
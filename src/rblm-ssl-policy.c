@@ -0,0 +1,197 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-ssl-policy.h"
+
+static gint
+hex_digit (gchar c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+/* Accepts the raw digest or its hex form with optional ':' separators */
+static void
+policy_parse_fingerprint (VALUE str, guint8 *digest)
+{
+	const gchar *p;
+	glong        len;
+	guint        n = 0;
+
+	StringValue (str);
+	p = RSTRING_PTR (str);
+	len = RSTRING_LEN (str);
+
+	if (len == RBLM_SSL_FINGERPRINT_LEN) {
+		memcpy (digest, p, RBLM_SSL_FINGERPRINT_LEN);
+		return;
+	}
+
+	while (len > 0) {
+		gint hi, lo;
+
+		if (*p == ':' || *p == ' ') {
+			p++;
+			len--;
+			continue;
+		}
+
+		if (len < 2 || n == RBLM_SSL_FINGERPRINT_LEN ||
+		    (hi = hex_digit (p[0])) < 0 || (lo = hex_digit (p[1])) < 0) {
+			break;
+		}
+
+		digest[n++] = (guint8) (hi << 4 | lo);
+		p += 2;
+		len -= 2;
+	}
+
+	if (len > 0 || n != RBLM_SSL_FINGERPRINT_LEN) {
+		rb_raise (rb_eArgError,
+			  "invalid fingerprint %s (expected an MD5 digest)",
+			  RSTRING_PTR (rb_inspect (str)));
+	}
+}
+
+RbLmSSLPolicy *
+rb_lm_ssl_policy_from_ruby_object (VALUE options, VALUE block)
+{
+	RbLmSSLPolicy *policy;
+	VALUE          pins = Qnil, allow = Qnil;
+	guint8         digest[RBLM_SSL_FINGERPRINT_LEN];
+	guint32        allowed = 0;
+	long           i;
+
+	if (!NIL_P (options)) {
+		Check_Type (options, T_HASH);
+
+		pins = rb_hash_aref (options, ID2SYM (rb_intern ("pins")));
+		allow = rb_hash_aref (options, ID2SYM (rb_intern ("allow")));
+		if (!NIL_P (pins)) {
+			pins = rb_Array (pins);
+		}
+		if (!NIL_P (allow)) {
+			allow = rb_Array (allow);
+		}
+	}
+
+	/* Validate everything before allocating so nothing leaks on raise */
+	for (i = 0; !NIL_P (pins) && i < RARRAY_LEN (pins); i++) {
+		policy_parse_fingerprint (RARRAY_PTR (pins)[i], digest);
+	}
+	for (i = 0; !NIL_P (allow) && i < RARRAY_LEN (allow); i++) {
+		allowed |= 1 << rb_lm_ssl_status_from_ruby_object (RARRAY_PTR (allow)[i]);
+	}
+
+	policy = g_new0 (RbLmSSLPolicy, 1);
+	policy->handler = rblm_handler_new (block);
+	policy->allowed = allowed;
+	policy->pins = g_array_new (FALSE, FALSE, RBLM_SSL_FINGERPRINT_LEN);
+
+	for (i = 0; !NIL_P (pins) && i < RARRAY_LEN (pins); i++) {
+		policy_parse_fingerprint (RARRAY_PTR (pins)[i], digest);
+		g_array_append_val (policy->pins, digest);
+	}
+
+	policy->active = policy->allowed != 0 || policy->pins->len > 0;
+
+	return policy;
+}
+
+void
+rblm_ssl_policy_free (RbLmSSLPolicy *policy)
+{
+	rblm_handler_unref (policy->handler);
+	g_array_free (policy->pins, TRUE);
+	g_free (policy);
+}
+
+const gchar *
+rblm_ssl_policy_get_expected (RbLmSSLPolicy *policy)
+{
+	if (policy->pins->len == 0) {
+		return NULL;
+	}
+
+	return policy->pins->data;
+}
+
+/* Loudmouth hands out its fingerprint buffer zeroed until the handshake got
+ * that far */
+static gboolean
+policy_fingerprint_known (const gchar *fingerprint)
+{
+	guint i;
+
+	if (!fingerprint) {
+		return FALSE;
+	}
+
+	for (i = 0; i < RBLM_SSL_FINGERPRINT_LEN; i++) {
+		if (fingerprint[i]) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+policy_is_pinned (RbLmSSLPolicy *policy, const gchar *fingerprint)
+{
+	guint i;
+
+	for (i = 0; i < policy->pins->len; i++) {
+		if (memcmp (policy->pins->data + i * RBLM_SSL_FINGERPRINT_LEN,
+			    fingerprint, RBLM_SSL_FINGERPRINT_LEN) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+gboolean
+rblm_ssl_policy_evaluate (RbLmSSLPolicy *policy,
+			  LmSSL         *ssl,
+			  LmSSLStatus    status,
+			  LmSSLResponse *response)
+{
+	const gchar *fingerprint;
+
+	if (!policy || !policy->active) {
+		return FALSE;
+	}
+
+	fingerprint = lm_ssl_get_fingerprint (ssl);
+
+	if (policy->pins->len > 0) {
+		if (!policy_fingerprint_known (fingerprint)) {
+			/* The mismatch check against the first pin follows */
+			if (status != LM_SSL_STATUS_CERT_FINGERPRINT_MISMATCH) {
+				*response = LM_SSL_RESPONSE_CONTINUE;
+				return TRUE;
+			}
+		} else if (policy_is_pinned (policy, fingerprint)) {
+			/* Loudmouth only compares against the first pin */
+			*response = LM_SSL_RESPONSE_CONTINUE;
+			return TRUE;
+		}
+	}
+
+	if (policy->allowed & (1 << status)) {
+		*response = LM_SSL_RESPONSE_CONTINUE;
+	} else {
+		*response = LM_SSL_RESPONSE_STOP;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,57 @@
+/*
+ * Declarative certificate policy for LM::SSL and LM::EventedSSL
+ *
+ * Loudmouth asks its LmSSLFunction about every problem it finds with the
+ * server certificate while the handshake is running on the loop thread. A
+ * policy answers those questions in C: a certificate with one of the pinned
+ * fingerprints continues whatever the status, statuses listed as allowed
+ * continue and everything else stops the handshake. The policy is built once
+ * from ruby when the SSL object is created and only read afterwards.
+ *
+ * Loudmouth only reports a fingerprint mismatch when it was given an
+ * expected fingerprint, so the first pin is passed to lm_ssl_new when no
+ * explicit fingerprint is. It may ask about other statuses before it has
+ * computed the fingerprint of the server; with pins those continue, as the
+ * fingerprint check that settles them is still to come.
+ *
+ * The block lives in an RbLmHandler entry shared by the policy and the SSL
+ * object, which marks and updates it for GC.compact.
+ */
+
+#ifndef _RBLM_SSL_POLICY_H
+#define	_RBLM_SSL_POLICY_H
+
+#include "rblm.h"
+#include "rblm-handlers.h"
+
+/* Loudmouth fingerprints are raw MD5 digests */
+#define RBLM_SSL_FINGERPRINT_LEN 16
+
+typedef struct {
+	RbLmHandler *handler;	/* ruby callback, marked by the SSL object */
+	gboolean     active;	/* pins or allowed statuses were given */
+	guint32      allowed;	/* 1 << LmSSLStatus */
+	GArray      *pins;	/* RBLM_SSL_FINGERPRINT_LEN bytes each */
+} RbLmSSLPolicy;
+
+/* Data behind LM::SSL and LM::EventedSSL */
+typedef struct {
+	LmSSL       *ssl;
+	RbLmHandler *block;	/* the policy's, NULL when wrapping an LmSSL */
+} RbLmSSL;
+
+/* Builds the policy from a hash with :pins and :allow, or nil */
+RbLmSSLPolicy * rb_lm_ssl_policy_from_ruby_object (VALUE options, VALUE block);
+void            rblm_ssl_policy_free              (RbLmSSLPolicy *policy);
+
+/* First pin, the expected fingerprint to hand to lm_ssl_new, or NULL */
+const gchar *   rblm_ssl_policy_get_expected      (RbLmSSLPolicy *policy);
+
+/* Decides on status without touching ruby, FALSE if the policy is inactive
+ * and the ruby block should be asked instead */
+gboolean        rblm_ssl_policy_evaluate          (RbLmSSLPolicy *policy,
+						   LmSSL         *ssl,
+						   LmSSLStatus    status,
+						   LmSSLResponse *response);
+
+#endif	/* _RBLM_SSL_POLICY_H */
@@ -1,44 +1,87 @@
 #include "rblm.h"
 #include "rblm-private.h"
+#include "rblm-ssl-policy.h"
 
 VALUE lm_cSSL;
 
-LmSSL *
-rb_lm_ssl_from_ruby_object (VALUE obj)
+void ssl_free (RbLmSSL *self);
+
+static void
+ssl_mark (RbLmSSL *self)
 {
-	LmSSL *ssl;
+	if (self->block) {
+		RBLM_GC_MARK (self->block->block);
+	}
+}
 
-	if (!rb_lm__is_kind_of (obj, lm_cSSL)) {
-		rb_raise (rb_eTypeError, "not a LmSSL");
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+ssl_compact (RbLmSSL *self)
+{
+	if (self->block) {
+		self->block->block = RBLM_GC_LOCATION (self->block->block);
 	}
+}
+#endif
+
+static const rb_data_type_t ssl_type = {
+	"LM::SSL",
+	{
+		(RUBY_DATA_FUNC) ssl_mark,
+		(RUBY_DATA_FUNC) ssl_free,
+		NULL,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+		(RUBY_DATA_FUNC) ssl_compact,
+#endif
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+LmSSL *
+rb_lm_ssl_from_ruby_object (VALUE obj)
+{
+	RbLmSSL *data;
 
-	Data_Get_Struct (obj, LmSSL, ssl);
+	TypedData_Get_Struct (obj, RbLmSSL, &ssl_type, data);
 
-	return ssl;
+	return data->ssl;
 }
 
+/* The block is only referenced from here, the policy stops calling it once
+ * the SSL object is gone */
 void
-ssl_free (LmSSL *ssl)
+ssl_free (RbLmSSL *self)
 {
-	lm_ssl_unref (ssl);
+	if (self->block) {
+		self->block->block = Qnil;
+		rblm_handler_unref (self->block);
+	}
+	if (self->ssl) {
+		lm_ssl_unref (self->ssl);
+	}
+	g_free (self);
 }
 
 VALUE
 rb_lm_ssl_to_ruby_object (LmSSL *ssl)
 {
-	if (ssl) {
-		lm_ssl_ref (ssl);
-		return Data_Wrap_Struct (lm_cSSL, NULL, 
-					 ssl_free, ssl);
-	} else {
+	RbLmSSL *data;
+
+	if (!ssl) {
 		return Qnil;
 	}
+
+	data = g_new0 (RbLmSSL, 1);
+	data->ssl = lm_ssl_ref (ssl);
+
+	return TypedData_Wrap_Struct (lm_cSSL, &ssl_type, data);
 }
 
 VALUE
 ssl_allocate (VALUE klass)
 {
-	return Data_Wrap_Struct (klass, NULL, ssl_free, NULL);
+	return TypedData_Wrap_Struct (klass, &ssl_type, g_new0 (RbLmSSL, 1));
 }
 
 static VALUE
@@ -52,31 +95,44 @@ ssl_func_callback (LmSSL       *ssl,
 		   LmSSLStatus  status,
 		   gpointer     user_data)
 {
-	VALUE response;
+	RbLmSSLPolicy *policy = user_data;
+	LmSSLResponse  decision;
+	VALUE          response;
+
+	if (rblm_ssl_policy_evaluate (policy, ssl, status, &decision)) {
+		return decision;
+	}
 
-	if (!user_data) {
+	if (NIL_P (policy->handler->block)) {
 		return LM_SSL_RESPONSE_CONTINUE;
 	}
 
-	response = rb_funcall ((VALUE)user_data, rb_intern ("call"), 1,
+	response = rb_funcall (policy->handler->block, rb_intern ("call"), 1,
 			       INT2FIX (status));
 
 	return rb_lm_ssl_response_from_ruby_object (response);
 }
 
+/* LM::SSL.new (fingerprint = nil, policy = nil) { |status| ... }
+ *
+ * policy is a hash with :pins, fingerprints accepted whatever else is wrong
+ * with the certificate, and :allow, LM::SSLStatus values to continue on.
+ * With a policy every status is decided without calling the block. */
 static VALUE
 ssl_initialize (int argc, VALUE *argv, VALUE self)
 {
-	LmSSL    *ssl;
-	VALUE     fingerprint;
-	VALUE     func;
-	char     *fingerprint_str = NULL;
-	gpointer  func_ptr = NULL;
-
-	rb_scan_args (argc, argv, "01&", &fingerprint, &func);
-
-	if (!NIL_P (func)) {
-		func_ptr = (gpointer) func;
+	RbLmSSL       *data;
+	VALUE          fingerprint;
+	VALUE          options;
+	VALUE          func;
+	const char    *fingerprint_str = NULL;
+	RbLmSSLPolicy *policy;
+
+	rb_scan_args (argc, argv, "02&", &fingerprint, &options, &func);
+
+	if (NIL_P (options) && TYPE (fingerprint) == T_HASH) {
+		options = fingerprint;
+		fingerprint = Qnil;
 	}
 
 	if (!NIL_P (fingerprint)) {
@@ -91,10 +147,24 @@ ssl_initialize (int argc, VALUE *argv, VALUE self)
 		fingerprint_str = StringValuePtr (str_val);
 	}
 
-	ssl = lm_ssl_new (fingerprint_str, ssl_func_callback,
-			  func_ptr, NULL);
+	policy = rb_lm_ssl_policy_from_ruby_object (options, func);
+	if (!fingerprint_str) {
+		fingerprint_str = rblm_ssl_policy_get_expected (policy);
+	}
+
+	/* initialize may be called again on an SSL object */
+	TypedData_Get_Struct (self, RbLmSSL, &ssl_type, data);
+	if (data->block) {
+		data->block->block = Qnil;
+		rblm_handler_unref (data->block);
+	}
+	if (data->ssl) {
+		lm_ssl_unref (data->ssl);
+	}
 
-	DATA_PTR (self) = ssl;
+	data->block = rblm_handler_ref (policy->handler);
+	data->ssl = lm_ssl_new (fingerprint_str, ssl_func_callback, policy,
+				(GDestroyNotify) rblm_ssl_policy_free);
 
 	return self;
 }
@@ -0,0 +1,300 @@
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-stream-mgmt.h"
+
+#define PING_XMLNS "urn:xmpp:ping"
+
+#define DEFAULT_BUFFER    256
+#define DEFAULT_ACK_EVERY 16
+
+/* Loudmouth runs handlers by descending priority and puts a new handler
+ * ahead of those registered earlier at the same one */
+#define COUNT_PRIORITY    ((LmHandlerPriority) (LM_HANDLER_PRIORITY_FIRST + 1))
+
+typedef struct {
+	guint64  seq;
+	gchar   *xml;
+} RbLmUnacked;
+
+struct _RbLmStreamMgmt {
+	gint              ref_count;
+	LmConnection     *conn;		/* NULL once shut down */
+	LmMessageHandler *counter;
+
+	RbLmUnacked      *ring;
+	guint             capacity;
+	guint             head;		/* oldest entry */
+	guint             len;
+
+	guint             ack_every;
+	guint             since_ack;	/* stanzas sent since the last request */
+
+	guint64           sent;		/* also the last sequence number */
+	guint64           acked;
+	guint64           received;
+	guint64           resent;
+	guint64           dropped;	/* pushed out of a full ring unacked */
+};
+
+/* An ack request in flight, owned by its LmMessageHandler */
+typedef struct {
+	RbLmStreamMgmt *sm;
+	guint64         seq;
+} RbLmAckRequest;
+
+static RbLmStreamMgmt *
+stream_mgmt_ref (RbLmStreamMgmt *sm)
+{
+	g_atomic_int_inc (&sm->ref_count);
+
+	return sm;
+}
+
+static void
+stream_mgmt_unref (RbLmStreamMgmt *sm)
+{
+	guint i;
+
+	if (!g_atomic_int_dec_and_test (&sm->ref_count)) {
+		return;
+	}
+
+	for (i = 0; i < sm->len; i++) {
+		g_free (sm->ring[(sm->head + i) % sm->capacity].xml);
+	}
+	g_free (sm->ring);
+	g_free (sm);
+}
+
+static LmHandlerResult
+stream_mgmt_count (LmMessageHandler *handler,
+		   LmConnection     *connection,
+		   LmMessage        *message,
+		   gpointer          user_data)
+{
+	((RbLmStreamMgmt *) user_data)->received++;
+
+	return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+void
+rb_lm_stream_mgmt_options (VALUE options, guint *capacity, guint *ack_every)
+{
+	*capacity = DEFAULT_BUFFER;
+	*ack_every = DEFAULT_ACK_EVERY;
+
+	if (!NIL_P (options)) {
+		VALUE value;
+
+		Check_Type (options, T_HASH);
+
+		value = rb_hash_aref (options, ID2SYM (rb_intern ("buffer")));
+		if (!NIL_P (value)) {
+			*capacity = NUM2UINT (value);
+		}
+		value = rb_hash_aref (options, ID2SYM (rb_intern ("ack_every")));
+		if (!NIL_P (value)) {
+			*ack_every = NUM2UINT (value);
+		}
+	}
+
+	if (*capacity == 0 || *ack_every == 0 || *ack_every > *capacity) {
+		rb_raise (rb_eArgError,
+			  "expected 0 < ack_every <= buffer");
+	}
+}
+
+RbLmStreamMgmt *
+rblm_stream_mgmt_new (LmConnection *conn, guint capacity, guint ack_every)
+{
+	RbLmStreamMgmt *sm = g_new0 (RbLmStreamMgmt, 1);
+
+	sm->ref_count = 1;
+	sm->conn = conn;
+	sm->capacity = capacity;
+	sm->ack_every = ack_every;
+	sm->ring = g_new0 (RbLmUnacked, capacity);
+
+	sm->counter = lm_message_handler_new (stream_mgmt_count,
+					      stream_mgmt_ref (sm),
+					      (GDestroyNotify) stream_mgmt_unref);
+	lm_connection_register_message_handler (conn, sm->counter,
+						LM_MESSAGE_TYPE_MESSAGE,
+						COUNT_PRIORITY);
+	lm_connection_register_message_handler (conn, sm->counter,
+						LM_MESSAGE_TYPE_PRESENCE,
+						COUNT_PRIORITY);
+	lm_connection_register_message_handler (conn, sm->counter,
+						LM_MESSAGE_TYPE_IQ,
+						COUNT_PRIORITY);
+
+	return sm;
+}
+
+void
+rblm_stream_mgmt_shutdown (RbLmStreamMgmt *sm)
+{
+	lm_connection_unregister_message_handler (sm->conn, sm->counter,
+						  LM_MESSAGE_TYPE_MESSAGE);
+	lm_connection_unregister_message_handler (sm->conn, sm->counter,
+						  LM_MESSAGE_TYPE_PRESENCE);
+	lm_connection_unregister_message_handler (sm->conn, sm->counter,
+						  LM_MESSAGE_TYPE_IQ);
+	lm_message_handler_unref (sm->counter);
+	sm->conn = NULL;
+
+	stream_mgmt_unref (sm);
+}
+
+/* Drops entries up to seq from the front of the ring */
+static void
+stream_mgmt_ack (RbLmStreamMgmt *sm, guint64 seq)
+{
+	if (seq <= sm->acked) {
+		return;
+	}
+	sm->acked = seq;
+
+	while (sm->len > 0 && sm->ring[sm->head].seq <= seq) {
+		g_free (sm->ring[sm->head].xml);
+		sm->ring[sm->head].xml = NULL;
+		sm->head = (sm->head + 1) % sm->capacity;
+		sm->len--;
+	}
+}
+
+static LmHandlerResult
+stream_mgmt_ack_cb (LmMessageHandler *handler,
+		    LmConnection     *connection,
+		    LmMessage        *message,
+		    gpointer          user_data)
+{
+	RbLmAckRequest *req = user_data;
+
+	if (req->sm->conn) {
+		stream_mgmt_ack (req->sm, req->seq);
+	}
+
+	return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+ack_request_free (RbLmAckRequest *req)
+{
+	stream_mgmt_unref (req->sm);
+	g_free (req);
+}
+
+void
+rblm_stream_mgmt_request_ack (RbLmStreamMgmt *sm)
+{
+	LmMessage        *ping;
+	LmMessageHandler *handler;
+	RbLmAckRequest   *req;
+	LmMessageNode    *node;
+
+	sm->since_ack = 0;
+	if (!sm->conn || sm->len == 0) {
+		return;
+	}
+
+	req = g_new0 (RbLmAckRequest, 1);
+	req->sm = stream_mgmt_ref (sm);
+	req->seq = sm->sent;
+
+	ping = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+					     LM_MESSAGE_SUB_TYPE_GET);
+	node = lm_message_node_add_child (ping->node, "ping", NULL);
+	lm_message_node_set_attribute (node, "xmlns", PING_XMLNS);
+
+	handler = lm_message_handler_new (stream_mgmt_ack_cb, req,
+					  (GDestroyNotify) ack_request_free);
+	lm_connection_send_with_reply (sm->conn, ping, handler, NULL);
+
+	lm_message_handler_unref (handler);
+	lm_message_unref (ping);
+}
+
+static void
+stream_mgmt_push (RbLmStreamMgmt *sm, gchar *xml)
+{
+	RbLmUnacked *entry;
+
+	if (sm->len == sm->capacity) {
+		g_free (sm->ring[sm->head].xml);
+		sm->head = (sm->head + 1) % sm->capacity;
+		sm->len--;
+		sm->dropped++;
+	}
+
+	entry = &sm->ring[(sm->head + sm->len) % sm->capacity];
+	entry->seq = ++sm->sent;
+	entry->xml = xml;
+	sm->len++;
+
+	if (++sm->since_ack >= sm->ack_every) {
+		rblm_stream_mgmt_request_ack (sm);
+	}
+}
+
+void
+rblm_stream_mgmt_sent (RbLmStreamMgmt *sm, LmMessage *m)
+{
+	stream_mgmt_push (sm, rb_lm_message_node_to_raw (m->node));
+}
+
+void
+rblm_stream_mgmt_sent_raw (RbLmStreamMgmt *sm, const gchar *str)
+{
+	stream_mgmt_push (sm, g_strdup (str));
+}
+
+guint
+rblm_stream_mgmt_resume (RbLmStreamMgmt *sm)
+{
+	guint i;
+
+	if (!sm->conn) {
+		return 0;
+	}
+
+	for (i = 0; i < sm->len; i++) {
+		RbLmUnacked *entry = &sm->ring[(sm->head + i) % sm->capacity];
+
+		if (!lm_connection_send_raw (sm->conn, entry->xml, NULL)) {
+			break;
+		}
+	}
+	sm->resent += i;
+
+	/* Requests sent before the disconnect won't be answered */
+	rblm_stream_mgmt_request_ack (sm);
+
+	return i;
+}
+
+void
+rblm_stream_mgmt_get_stats (RbLmStreamMgmt *sm, RbLmStreamMgmtStats *stats)
+{
+	stats->sent = sm->sent;
+	stats->acked = sm->acked;
+	stats->unacked = sm->len;
+	stats->received = sm->received;
+	stats->resent = sm->resent;
+	stats->dropped = sm->dropped;
+}
+
+VALUE
+rb_lm_stream_mgmt_stats_to_ruby_object (const RbLmStreamMgmtStats *stats)
+{
+	VALUE hash = rb_hash_new ();
+
+	rb_hash_aset (hash, ID2SYM (rb_intern ("sent")), ULL2NUM (stats->sent));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("acked")), ULL2NUM (stats->acked));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("unacked")), UINT2NUM (stats->unacked));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("received")), ULL2NUM (stats->received));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("resent")), ULL2NUM (stats->resent));
+	rb_hash_aset (hash, ID2SYM (rb_intern ("dropped")), ULL2NUM (stats->dropped));
+
+	return hash;
+}
@@ -0,0 +1,65 @@
+/*
+ * Acknowledged delivery of outbound stanzas
+ *
+ * Loudmouth 1.4 drops top level elements it has no message type for and
+ * performs resource binding itself, so the <enable/>, <a/>, <r/> and
+ * <resume/> elements of XEP-0198 can neither be received nor negotiated.
+ * This keeps the part of it that works on top of plain stanzas: every
+ * outbound stanza goes into a bounded ring tagged with a sequence number,
+ * and every ack_every stanzas an XEP-0199 ping is sent. The server answers
+ * iqs in order, so any reply to the ping, errors included, acknowledges
+ * every stanza sent before it. After a reconnect the stanzas still in the
+ * ring are sent again. Inbound message, presence and iq stanzas are counted
+ * by handlers registered above LM_HANDLER_PRIORITY_FIRST, so that handlers
+ * removing stanzas at FIRST, like the roster cache, can't hide them.
+ *
+ * Call from the thread running the connection's main loop, or with the
+ * GLib thread paused for evented connections.
+ */
+
+#ifndef _RBLM_STREAM_MGMT_H
+#define	_RBLM_STREAM_MGMT_H
+
+#include "rblm.h"
+
+typedef struct _RbLmStreamMgmt RbLmStreamMgmt;
+
+/* Counters copied out of the state, for building the Hash without holding
+ * up the GLib loop */
+typedef struct {
+	guint64 sent;
+	guint64 acked;
+	guint   unacked;
+	guint64 received;
+	guint64 resent;
+	guint64 dropped;
+} RbLmStreamMgmtStats;
+
+/* Parses options (:buffer, :ack_every), raises on values out of range */
+void             rb_lm_stream_mgmt_options (VALUE           options,
+					    guint          *capacity,
+					    guint          *ack_every);
+
+RbLmStreamMgmt * rblm_stream_mgmt_new      (LmConnection   *conn,
+					    guint           capacity,
+					    guint           ack_every);
+/* Unregisters the counters and makes sm inert, drops the caller's ref */
+void             rblm_stream_mgmt_shutdown (RbLmStreamMgmt *sm);
+
+/* Record a stanza that was just sent */
+void             rblm_stream_mgmt_sent      (RbLmStreamMgmt *sm,
+					     LmMessage      *m);
+void             rblm_stream_mgmt_sent_raw  (RbLmStreamMgmt *sm,
+					     const gchar    *str);
+
+/* Sends an ack request for everything sent so far */
+void             rblm_stream_mgmt_request_ack (RbLmStreamMgmt *sm);
+
+/* Sends every unacknowledged stanza again, returns how many */
+guint            rblm_stream_mgmt_resume    (RbLmStreamMgmt *sm);
+
+void             rblm_stream_mgmt_get_stats (RbLmStreamMgmt      *sm,
+					     RbLmStreamMgmtStats *stats);
+VALUE            rb_lm_stream_mgmt_stats_to_ruby_object (const RbLmStreamMgmtStats *stats);
+
+#endif	/* _RBLM_STREAM_MGMT_H */
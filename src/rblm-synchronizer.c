@@ -2,6 +2,8 @@
 
 #include "rblm-synchronizer.h"
 #include "rblm-callback.h"
+#include "rblm-frozen-message.h"
+#include "rblm-ssl-policy.h"
 #include <errno.h>
 #include <string.h>
 
@@ -14,6 +16,9 @@ static GMainLoop* main_loop = NULL;
 /* Was GLib thread started? */
 static gboolean glib_started = FALSE;
 
+/* Set by the GLib thread once its main loop runs, under event_loop_started_mx */
+static gboolean loop_running = FALSE;
+
 /* Startup synchronization condition variable */
 GCond* event_loop_started = NULL;
 GMutex* event_loop_started_mx = NULL;
@@ -32,6 +37,15 @@ GIOChannel* lm2rb_write = NULL;
 /* Async message queue used to forward LM events to ruby */
 GAsyncQueue* lm2rb_queue = NULL;
 
+/* Native objects waiting to be released on the GLib thread */
+static GAsyncQueue* release_queue = NULL;
+static volatile gint release_scheduled = 0;
+
+typedef struct {
+    GDestroyNotify unref;
+    gpointer       object;
+} RbLmRelease;
+
 /* Pipe notification token */
 static gchar g_token = '1';
 
@@ -94,7 +108,10 @@ rb2lm_notify (GIOChannel* source, GIOCondition cond, gpointer _)
 static gboolean
 main_loop_started (gpointer _)
 {
+    g_mutex_lock (event_loop_started_mx);
+    loop_running = TRUE;
     g_cond_signal (event_loop_started);
+    g_mutex_unlock (event_loop_started_mx);
     return FALSE; /* only run once */
 }
 
@@ -126,16 +143,22 @@ rblm_init_sync()
 {
     if (!glib_started)
     {
-        g_thread_init(NULL);
-        event_loop_started = g_cond_new();
-        event_loop_started_mx = g_mutex_new();
+        if (!g_thread_supported())
+            g_thread_init(NULL);
+        if (!event_loop_started)
+        {
+            event_loop_started = g_cond_new();
+            event_loop_started_mx = g_mutex_new();
+        }
 
         rblm_create_pipe(&rb2lm_read, &rb2lm_write);
         rblm_create_pipe(&lm2rb_read, &lm2rb_write);
 
         lm2rb_queue = g_async_queue_new();
+        release_queue = g_async_queue_new();
 
         GError* error = NULL;
+        g_mutex_lock (event_loop_started_mx);
         glib_thread = g_thread_create((GThreadFunc) &loop_thread, /* func     */
                                       NULL,                       /* data     */
                                       TRUE,                       /* joinable */
@@ -145,17 +168,74 @@ rblm_init_sync()
             g_error_free(error);
         }
 
-        /* Wait until main loop is running */
-        g_cond_wait (event_loop_started, event_loop_started_mx);
+        /* Wait until main loop is running, the signal may come before we wait */
+        while (!loop_running)
+            g_cond_wait (event_loop_started, event_loop_started_mx);
+        g_mutex_unlock (event_loop_started_mx);
         glib_started = TRUE;
     }
 }
 
+/* Unref everything queued by rblm_release_later */
+static void
+release_pending (void)
+{
+    RbLmRelease* release;
+    while ((release = g_async_queue_try_pop (release_queue)))
+    {
+        release->unref (release->object);
+        g_free (release);
+    }
+}
+
+/* Idle source draining the release queue in the GLib thread */
+static gboolean
+release_drain (gpointer _)
+{
+    /* Clear first so releases queued while draining schedule a new run */
+    g_atomic_int_set (&release_scheduled, 0);
+    release_pending ();
+    return FALSE;
+}
+
+/* Release object with unref on the GLib thread without waiting for it.
+ * Only queues the object, so it is safe to call from GC free functions */
+void
+rblm_release_later (GDestroyNotify unref, gpointer object)
+{
+    RbLmRelease* release;
+
+    if (!object)
+        return;
+
+    if (!glib_started)
+    {
+        unref (object);
+        return;
+    }
+
+    release = g_new (RbLmRelease, 1);
+    release->unref = unref;
+    release->object = object;
+    g_async_queue_push (release_queue, release);
+
+    if (g_atomic_int_compare_and_exchange (&release_scheduled, 0, 1))
+        g_idle_add (release_drain, NULL);
+}
+
 /* Shut down synchronization layer, call from ruby thread */
 void
 rblm_shutdown_sync() {
+    if (!glib_started)
+        return;
+
     g_main_loop_quit(main_loop);
     g_thread_join(glib_thread);
+    glib_started = FALSE;
+    loop_running = FALSE;
+    release_pending ();
+    /* The idle source died with the loop, let the next start schedule again */
+    g_atomic_int_set (&release_scheduled, 0);
     g_io_channel_shutdown(lm2rb_read, FALSE, NULL);
     g_io_channel_shutdown(lm2rb_write, FALSE, NULL);
     g_io_channel_shutdown(rb2lm_read, FALSE, NULL);
@@ -165,6 +245,7 @@ rblm_shutdown_sync() {
     g_io_channel_unref(rb2lm_read);
     g_io_channel_unref(rb2lm_write);
     g_async_queue_unref (lm2rb_queue);
+    g_async_queue_unref (release_queue);
 }
 
 /* Trigger event in GLib event loop that will wait for ruby thread */
@@ -200,13 +281,10 @@ rb2lm_resume_glib()
  *    1. Push message to async queue *
  *    2. Notify ruby through pipe    */
 static void
-notify_ruby (LmAsyncNotification notification,
-             VALUE block,
-             gpointer data)
+notify_ruby_push (LmAsyncCallback* cb)
 {
     gsize written;
     GError* error = NULL;
-    LmAsyncCallback* cb = create_async_message (notification, block, data);
     g_async_queue_push (lm2rb_queue, (gpointer)cb);
     if (g_io_channel_write_chars (lm2rb_write, &g_token, 1, &written, &error) == G_IO_STATUS_ERROR)
     {
@@ -215,25 +293,49 @@ notify_ruby (LmAsyncNotification notification,
     }
 }
 
-/* Handlers that get called back by Loudmouth in GLib thread */
+void
+notify_ruby_handler (LmAsyncNotification notification,
+                     RbLmHandler* handler,
+                     gpointer data)
+{
+    notify_ruby_push (create_handler_message (notification, handler, data));
+}
+
+/* Handlers that get called back by Loudmouth in GLib thread, user_data is
+ * the RbLmHandler entry of the connection */
 LmHandlerResult
 msg_handler (LmMessageHandler *handler,
              LmConnection     *connection,
              LmMessage        *message,
              gpointer          user_data)
 {
-    notify_ruby (LM_CB_MSG, (VALUE)user_data, MSG2GPOINTER (lm_message_ref (message)));
+    notify_ruby_handler (LM_CB_MSG, user_data, MSG2GPOINTER (lm_message_ref (message)));
+
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+/* Same as msg_handler but flattens the message here, so the ruby thread only
+ * gets the LM::FrozenMessage snapshot */
+LmHandlerResult
+frozen_msg_handler (LmMessageHandler *handler,
+                    LmConnection     *connection,
+                    LmMessage        *message,
+                    gpointer          user_data)
+{
+    notify_ruby_handler (LM_CB_FROZEN_MSG, user_data, rblm_frozen_message_new (message));
 
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 }
 
+/* Reply, open, auth and disconnect handlers get the RbLmHandler entry held by
+ * the registry of the connection as user_data too */
 LmHandlerResult
 reply_handler (LmMessageHandler *handler,
                LmConnection *connection,
                LmMessage *message,
-               gpointer *user_data)
+               gpointer user_data)
 {
-    notify_ruby (LM_CB_REPLY, (VALUE)user_data, MSG2GPOINTER (message));
+    notify_ruby_handler (LM_CB_REPLY, user_data, MSG2GPOINTER (lm_message_ref (message)));
 
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 }
@@ -242,27 +344,36 @@ void open_handler (LmConnection *conn,
                    gboolean success,
                    gpointer user_data)
 {
-    notify_ruby (LM_CB_CONN_OPEN, (VALUE)user_data, GBOOL2GPOINTER (success));
+    notify_ruby_handler (LM_CB_CONN_OPEN, user_data, GBOOL2GPOINTER (success));
 }
 
 void auth_handler (LmConnection *conn,
                    gboolean success,
                    gpointer user_data)
 {
-    notify_ruby (LM_CB_AUTH, (VALUE)user_data, GBOOL2GPOINTER (success));
+    notify_ruby_handler (LM_CB_AUTH, user_data, GBOOL2GPOINTER (success));
 }
 
 void disconnect_handler (LmConnection *conn,
                          LmDisconnectReason  reason,
                          gpointer user_data)
 {
-    notify_ruby (LM_CB_CONN_OPEN, (VALUE)user_data, DISCONNECT2GPOINTER (reason));
+    notify_ruby_handler (LM_CB_DISCONNECT, user_data, DISCONNECT2GPOINTER (reason));
 }
 
 LmSSLResponse ssl_handler (LmSSL *ssl, LmSSLStatus status, gpointer user_data)
 {
-    notify_ruby (LM_CB_SSL, (VALUE)user_data, SSLSTATUS2GPOINTER (status));
+    RbLmSSLPolicy* policy = user_data;
+    LmSSLResponse response = LM_SSL_RESPONSE_CONTINUE;
+
+    /* A policy settles the status here, ruby is only told about rejections */
+    if (rblm_ssl_policy_evaluate (policy, ssl, status, &response) &&
+        response == LM_SSL_RESPONSE_CONTINUE)
+        return response;
+
+    if (!NIL_P (policy->handler->block))
+        notify_ruby_handler (LM_CB_SSL, policy->handler, SSLSTATUS2GPOINTER (status));
 
-    /* TODO: We need to get this from ruby, use a blocking pipe read? */
-    return LM_SSL_RESPONSE_CONTINUE;
+    /* Without a policy ruby can't answer in time, the handshake goes on */
+    return response;
 }
@@ -22,6 +22,7 @@
  * message and dispatches it to the right event handler.
  * Loudmouth/GLib events that need to be sent to the Ruby thread are:
  *   - new message notifications (msg_handler_cb)
+ *   - frozen message notifications (frozen_msg_handler)
  *   - reply notifications (msg_handler_for_send_cb)
  *   - connection open notifications (open_callback)
  *   - authentication notifications (auth_callback)
@@ -37,6 +38,7 @@
 #define	_RBLM_SYNCHRONIZER_H
 
 #include "rblm.h"
+#include "rblm-callback.h"
 #include <loudmouth/loudmouth.h>
 
 /* Call Loudmouth API with no return value from ruby thread */
@@ -68,6 +70,9 @@ void rblm_init_sync();
 /* Shut down synchronization layer, call from ruby thread */
 void rblm_shutdown_sync();
 
+/* Queue object for unref in the GLib thread, safe from GC free functions */
+void rblm_release_later (GDestroyNotify unref, gpointer object);
+
 /* Was the GLib thread started? (i.e. is synchronization necessary? */
 gboolean rblm_sync_started();
 
@@ -80,9 +85,13 @@ void rb2lm_pause_glib();
 /* 'Resume' GLib */
 void rb2lm_resume_glib();
 
+/* Post a notification for the ruby thread, call from GLib thread */
+void notify_ruby_handler (LmAsyncNotification notification, RbLmHandler* handler, gpointer data);
+
 /* Loudmouth event handlers */
 LmHandlerResult msg_handler (LmMessageHandler *handler, LmConnection *connection, LmMessage *message, gpointer user_data);
-LmHandlerResult reply_handler (LmMessageHandler *handler, LmConnection *connection, LmMessage *message, gpointer *user_data);
+LmHandlerResult frozen_msg_handler (LmMessageHandler *handler, LmConnection *connection, LmMessage *message, gpointer user_data);
+LmHandlerResult reply_handler (LmMessageHandler *handler, LmConnection *connection, LmMessage *message, gpointer user_data);
 void open_handler (LmConnection *conn, gboolean success, gpointer user_data);
 void auth_handler (LmConnection *conn, gboolean success, gpointer user_data);
 void disconnect_handler (LmConnection *conn, LmDisconnectReason  reason, gpointer user_data);
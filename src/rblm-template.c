@@ -0,0 +1,301 @@
+/*
+ * Precompiled stanza templates
+ *
+ *   chat = LM::Template.compile ("<message to='{{to}}' type='chat'>" \
+ *                                "<body>{{body}}</body></message>")
+ *   chat.send (conn, :to => 'someone@example.org', :body => 'hi')
+ *
+ * The template is split once into literal bytes and named slots. Rendering
+ * only copies the literals and the XML escaped slot values into a fresh
+ * String, which is then sent like send_raw would, without building or
+ * serializing an LmMessage. A literal {{ is written as \{{.
+ */
+
+#include "rblm.h"
+#include "rblm-private.h"
+#include "rblm-synchronizer.h"
+
+extern VALUE lm_cEventedConnection;
+
+VALUE lm_cTemplate;
+
+typedef struct {
+	gsize offset;		/* literal bytes preceding the slot */
+	gsize length;
+	ID    slot;		/* 0 for the trailing literal */
+} TemplateSegment;
+
+typedef struct {
+	GString         *literals;
+	guint            n_segments;
+	TemplateSegment *segments;
+} Template;
+
+static void
+template_clear (Template *tmpl)
+{
+	if (tmpl->literals) {
+		g_string_free (tmpl->literals, TRUE);
+		tmpl->literals = NULL;
+	}
+
+	g_free (tmpl->segments);
+	tmpl->segments = NULL;
+	tmpl->n_segments = 0;
+}
+
+static void
+template_free (Template *tmpl)
+{
+	template_clear (tmpl);
+	g_free (tmpl);
+}
+
+static size_t
+template_memsize (const Template *tmpl)
+{
+	size_t size = sizeof (Template) +
+		tmpl->n_segments * sizeof (TemplateSegment);
+
+	if (tmpl->literals) {
+		size += tmpl->literals->allocated_len;
+	}
+
+	return size;
+}
+
+static const rb_data_type_t template_type = {
+	"LM::Template",
+	{
+		NULL,
+		(RUBY_DATA_FUNC) template_free,
+		(size_t (*) (const void *)) template_memsize,
+	},
+	0, 0,
+	RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static Template *
+rb_lm_template_from_ruby_object (VALUE obj)
+{
+	Template *tmpl;
+
+	TypedData_Get_Struct (obj, Template, &template_type, tmpl);
+
+	return tmpl;
+}
+
+static VALUE
+template_allocate (VALUE klass)
+{
+	return TypedData_Wrap_Struct (klass, &template_type,
+				      g_new0 (Template, 1));
+}
+
+static VALUE
+template_initialize (VALUE self, VALUE source)
+{
+	Template    *tmpl;
+	GArray      *segments;
+	const gchar *p, *end, *open, *close;
+	gsize        start = 0;	/* where the literal before the next slot begins */
+
+	tmpl = rb_lm_template_from_ruby_object (self);
+	StringValue (source);
+
+	/* initialize may be called again on a compiled template */
+	template_clear (tmpl);
+
+	tmpl->literals = g_string_sized_new (RSTRING_LEN (source));
+	segments = g_array_new (FALSE, TRUE, sizeof (TemplateSegment));
+
+	p = RSTRING_PTR (source);
+	end = p + RSTRING_LEN (source);
+
+	while (p < end) {
+		TemplateSegment seg;
+		gchar          *name;
+
+		open = g_strstr_len (p, end - p, "{{");
+		if (!open) {
+			break;
+		}
+
+		/* \{{ stands for a literal {{ */
+		if (open > p && open[-1] == '\\') {
+			g_string_append_len (tmpl->literals, p, open - p - 1);
+			g_string_append_len (tmpl->literals, "{{", 2);
+			p = open + 2;
+			continue;
+		}
+
+		close = g_strstr_len (open + 2, end - open - 2, "}}");
+		if (!close || close == open + 2) {
+			g_array_free (segments, TRUE);
+			template_clear (tmpl);
+			rb_raise (rb_eArgError, "malformed template slot at offset %ld",
+				  (long) (open - RSTRING_PTR (source)));
+		}
+
+		g_string_append_len (tmpl->literals, p, open - p);
+		seg.offset = start;
+		seg.length = tmpl->literals->len - start;
+		start = tmpl->literals->len;
+
+		name = g_strndup (open + 2, close - open - 2);
+		seg.slot = rb_intern (g_strstrip (name));
+		g_free (name);
+
+		g_array_append_val (segments, seg);
+		p = close + 2;
+	}
+
+	{
+		TemplateSegment tail;
+
+		g_string_append_len (tmpl->literals, p, end - p);
+		tail.offset = start;
+		tail.length = tmpl->literals->len - start;
+		tail.slot = 0;
+		g_array_append_val (segments, tail);
+	}
+
+	tmpl->n_segments = segments->len;
+	tmpl->segments = (TemplateSegment *) g_array_free (segments, FALSE);
+
+	return self;
+}
+
+static VALUE
+template_compile (VALUE klass, VALUE source)
+{
+	return rb_class_new_instance (1, &source, klass);
+}
+
+/* Renders into a new String. Slot values are converted with to_s, which may
+ * run other threads, so nothing is shared between renders. */
+static VALUE
+template_render_string (Template *tmpl, VALUE vars)
+{
+	VALUE buf;
+	guint i;
+
+	if (!tmpl->segments) {
+		rb_raise (rb_eArgError, "template not compiled");
+	}
+
+	Check_Type (vars, T_HASH);
+	buf = rb_str_buf_new (tmpl->literals->len + 256);
+
+	for (i = 0; i < tmpl->n_segments; i++) {
+		TemplateSegment *seg = &tmpl->segments[i];
+		VALUE            value, value_str;
+
+		rb_str_buf_cat (buf, tmpl->literals->str + seg->offset,
+				seg->length);
+
+		if (!seg->slot) {
+			continue;
+		}
+
+		value = rb_hash_lookup2 (vars, ID2SYM (seg->slot), Qundef);
+		if (value == Qundef) {
+			value = rb_hash_lookup2 (vars, rb_id2str (seg->slot), Qundef);
+		}
+		if (value == Qundef) {
+			rb_raise (rb_eArgError, "missing value for template slot %s",
+				  rb_id2name (seg->slot));
+		}
+		if (NIL_P (value)) {
+			continue;
+		}
+
+		value_str = rb_obj_as_string (value);
+		rb_lm__xml_escape_write (RSTRING_PTR (value_str),
+					 RSTRING_LEN (value_str),
+					 rb_lm__rstring_write, (gpointer) buf);
+	}
+
+	return buf;
+}
+
+static VALUE
+template_render (VALUE self, VALUE vars)
+{
+	Template *tmpl = rb_lm_template_from_ruby_object (self);
+
+	return template_render_string (tmpl, vars);
+}
+
+/* send (conn, vars, options = {})
+ *
+ * Renders and sends the stanza the way conn.send_raw would, through rate
+ * limiting, stream management, the :priority classes and presence
+ * coalescing */
+static VALUE
+template_send (int argc, VALUE *argv, VALUE self)
+{
+	Template       *tmpl = rb_lm_template_from_ruby_object (self);
+	RbLmConnection *data;
+	RbLmPriority    priority;
+	VALUE           conn_rval, vars, options;
+	VALUE           str;
+	const gchar    *str_ptr;
+	GError         *error = NULL;
+	gboolean        res;
+
+	rb_scan_args (argc, argv, "21", &conn_rval, &vars, &options);
+
+	priority = rb_lm_priority_from_options (options);
+	str = template_render_string (tmpl, vars);
+	str_ptr = StringValueCStr (str);
+
+	if (rb_lm__is_kind_of (conn_rval, lm_cEventedConnection)) {
+		data = rb_lm_ev_connection_data_from_ruby_object (conn_rval);
+		LM_CALL2 (rblm_connection_send (data, NULL, NULL, str_ptr,
+						priority, &error), res);
+	} else {
+		data = rb_lm_connection_data_from_ruby_object (conn_rval);
+		res = rblm_connection_send (data, NULL, NULL, str_ptr, priority, &error);
+	}
+
+	RB_GC_GUARD (str);
+
+	if (error) {
+		g_warning ("Could not send template: %s\n", error->message);
+		g_error_free (error);
+	}
+
+	return GBOOL2RVAL (res);
+}
+
+static VALUE
+template_get_slots (VALUE self)
+{
+	Template *tmpl = rb_lm_template_from_ruby_object (self);
+	VALUE     slots = rb_ary_new ();
+	guint     i;
+
+	for (i = 0; i < tmpl->n_segments; i++) {
+		if (tmpl->segments[i].slot) {
+			rb_ary_push (slots, ID2SYM (tmpl->segments[i].slot));
+		}
+	}
+
+	return slots;
+}
+
+extern void
+Init_lm_template (VALUE lm_mLM)
+{
+	lm_cTemplate = rb_define_class_under (lm_mLM, "Template", rb_cObject);
+
+	rb_define_alloc_func (lm_cTemplate, template_allocate);
+
+	rb_define_singleton_method (lm_cTemplate, "compile", template_compile, 1);
+
+	rb_define_method (lm_cTemplate, "initialize", template_initialize, 1);
+	rb_define_method (lm_cTemplate, "render", template_render, 1);
+	rb_define_method (lm_cTemplate, "send", template_send, -1);
+	rb_define_method (lm_cTemplate, "slots", template_get_slots, 0);
+}
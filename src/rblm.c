@@ -13,5 +13,14 @@ Init_loudmouth (void)
 	Init_lm_constants (lm_mLM);
 	Init_lm_ssl (lm_mLM);
 	Init_lm_proxy (lm_mLM);
+	Init_lm_evented_connection (lm_mLM);
+	Init_lm_evented_ssl (lm_mLM);
+	Init_lm_callback (lm_mLM);
+	Init_lm_sink (lm_mLM);
+	Init_lm_frozen_message (lm_mLM);
+	Init_lm_message_parser (lm_mLM);
+	Init_lm_capture (lm_mLM);
+	Init_lm_template (lm_mLM);
+	Init_lm_connection_set (lm_mLM);
 }
 
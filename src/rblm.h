@@ -12,6 +12,15 @@ extern void Init_lm_message_node    (VALUE lm_mLM);
 extern void Init_lm_constants       (VALUE lm_mLM);
 extern void Init_lm_ssl             (VALUE lm_mLM);
 extern void Init_lm_proxy           (VALUE lm_mLM);
+extern void Init_lm_evented_connection (VALUE lm_mLM);
+extern void Init_lm_evented_ssl     (VALUE lm_mLM);
+extern void Init_lm_callback        (VALUE lm_mLM);
+extern void Init_lm_sink            (VALUE lm_mLM);
+extern void Init_lm_frozen_message (VALUE lm_mLM);
+extern void Init_lm_message_parser  (VALUE lm_mLM);
+extern void Init_lm_capture         (VALUE lm_mLM);
+extern void Init_lm_template        (VALUE lm_mLM);
+extern void Init_lm_connection_set  (VALUE lm_mLM);
 
 #endif /* __RLM_H__ */
 